@@ -4,9 +4,24 @@
  */
 
 #include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#ifdef LC2K_LIBRARY
+#define LC2K_INTERNAL
+#include "lc2k.h"
+#endif
 
 #define MAXLINELENGTH 1000
 #define MAX_LABEL_LENGTH 7
@@ -14,6 +29,19 @@
 #define MIN_FILL_BOUNDS (-2147483647 - 1)
 #define MAX_FILL_BOUNDS 2147483647
 #define MAX_OPCODE_LENGTH 20
+#define MIN_OFFSET (-32768)
+#define MAX_OFFSET 32767
+#define RELAXED_BRANCH_WORDS 4
+#define RELAXED_MEMORY_WORDS 3
+#define MAX_ALIGN 65536
+#define NOOP_INSTRUCTION (7 << 22)
+#define ASSEMBLER_VERSION "lc2k-as 7" // bump whenever the output for a given source changes
+#define DEFAULT_CACHE_LIMIT (64L * 1024 * 1024)
+#define MAX_CACHE_PATH_LENGTH 4096
+
+// binary object format, see writeBinaryObject
+#define OBJECT_MAGIC "LC2O"
+#define OBJECT_VERSION 1
 
 // identifies the type of the opcode
 enum OPCODE_TYPE {
@@ -22,6 +50,7 @@ enum OPCODE_TYPE {
     JTYPE,
     OTYPE,
     FILL,
+    ALIGN,
     UNDEFINED,
 };
 
@@ -31,12 +60,38 @@ struct LabelInformation {
     char labelName[MAX_LABEL_LENGTH];
     char labelValue[MAX_LABEL_VALUE_LENGTH];
     int lineNumber;
+    int pinned; // stored to or address taken, so it must keep its own word
     struct LabelInformation* next;
 };
 
 // head in label list is null
 struct LabelInformation* labels = NULL;
 
+// per-line layout built during the first pass; a line's address is its
+// position in the object once pooled constants have been removed
+struct LineInformation {
+    int isFill;
+    int hasLabel;
+    int isLocalConstant; // .fill of a number under a local label
+    int value;
+    int aliasOf;         // line whose word this line shares, or -1
+    int address;
+    int isBranch;        // beq
+    int isMemory;        // lw or sw
+    char target[MAX_LABEL_LENGTH]; // label operand, if it is one
+    int targetLine;      // line of the label operand, or -1
+    int relaxed;         // expanded into a long-range sequence
+    int literal;         // address of its literal pool word when relaxed
+    int isAlign;
+    int align;           // .align boundary in words
+    int alignsData;      // .align pads the data section rather than the text
+    int padding;         // words inserted by .align
+};
+
+struct LineInformation* lines = NULL;
+int lineCount = 0;
+int lineCapacity = 0;
+
 // details about supported opcode
 struct OpcodeInfo {
     char name[MAX_OPCODE_LENGTH];
@@ -54,7 +109,8 @@ struct OpcodeInfo opcodeList[] = {
     {"jalr", (5 << 22), JTYPE},
     {"halt", (6 << 22), OTYPE},
     {"noop", (7 << 22), OTYPE},
-    {".fill", -1, FILL}
+    {".fill", -1, FILL},
+    {".align", -1, ALIGN}
 };
 
 // int all opcodes
@@ -79,6 +135,7 @@ struct TextEntry {
 int textLength = 0;
 
 struct TextEntry* textEntry = NULL;
+struct TextEntry* textTail = NULL; // last entry, so appends are O(1)
 
 struct DataEntry {
     int value;
@@ -88,6 +145,7 @@ struct DataEntry {
 int dataLength = 0;
 
 struct DataEntry* dataEntry = NULL;
+struct DataEntry* dataTail = NULL;
 
 struct RelocationEntry {
     int lineOffset;
@@ -99,6 +157,102 @@ struct RelocationEntry {
 int relocationLength = 0;
 
 struct RelocationEntry* relocationEntry = NULL;
+struct RelocationEntry* relocationTail = NULL;
+
+// binary object layout: header, section table, then section payloads.
+// Fields are written in host byte order and every record has a fixed size
+// so the linker can use the file in place without parsing it line by line.
+// Objects are therefore only portable between hosts of the same byte order;
+// a foreign object fails the linker's version check.
+enum SECTION_TYPE {
+    SECTION_TEXT = 1,
+    SECTION_DATA,
+    SECTION_SYMBOLS,
+    SECTION_RELOCATIONS,
+    SECTION_STRINGS,
+    SECTION_POOL,
+};
+
+enum RELOCATION_KIND {
+    RELOCATE_LW,
+    RELOCATE_SW,
+    RELOCATE_FILL,
+    RELOCATE_LITERAL,
+};
+
+struct ObjectHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t sectionCount;
+    uint32_t reserved;
+};
+
+struct SectionHeader {
+    uint32_t type;
+    uint32_t offset; // bytes from the start of the file
+    uint32_t count;  // words, records or bytes depending on the type
+    uint32_t align;  // in words
+};
+
+struct SymbolRecord {
+    uint32_t name; // offset into the string table
+    int32_t offset;
+    uint8_t type;
+    uint8_t padding[3];
+};
+
+struct RelocationRecord {
+    int32_t offset;
+    uint32_t label; // offset into the string table
+    uint8_t kind;
+    uint8_t padding[3];
+};
+
+// emit the binary object format instead of decimal text
+int binaryOutput = 0;
+
+// merge identical local constants, see poolConstants
+int poolOutput = 0;
+int poolWordsSaved = 0;
+
+// strictest .align seen in each section, recorded in the object so the
+// linker places the sections on matching boundaries
+int textAlign = 1;
+int dataAlign = 1;
+
+// registers clobbered by relaxed sequences: the address is loaded into the
+// first, jalr links into the second. Relaxation is off (-1) unless -r names
+// two scratch registers, since the program loses whatever they held.
+int relaxAddressRegister = -1;
+int relaxLinkRegister = -1;
+int literalCount = 0;
+
+// The literal pool sits at the very start of the text, behind a branch
+// over it, because lw can only reach absolute addresses up to MAX_OFFSET.
+// Its loads are relocated through this local name; any local label works
+// since the linker only needs the offset stored in the instruction.
+char literalLabel[] = "_lit";
+
+// on-disk object cache, keyed by a hash of the source, the assembler
+// version and every option that changes the output
+struct ObjectCache {
+    const char* directory;
+    long sizeLimit;
+    int hits;
+    int misses;
+    int pruned;
+};
+
+struct ObjectCache objectCache = { NULL, DEFAULT_CACHE_LIMIT, 0, 0, 0 };
+
+// options that affect the emitted object, folded into the cache key
+char optionsSignature[MAXLINELENGTH] = "";
+
+struct CacheFile {
+    char name[MAX_CACHE_PATH_LENGTH];
+    long size;
+    struct timespec lastUsed;
+};
 
 // functions we were given
 int readAndParse(FILE *, char *, char *, char *, char *, char *);
@@ -107,24 +261,57 @@ int isNumber(char *);
 // first pass over input file
 void assemblerPass1(FILE *inputFile);
 
+// layout between the passes
+void addLine(char* label, char* opcode, char* arg0, char* arg2);
+void poolConstants(FILE *inputFile);
+int lineInData(struct LineInformation* line);
+void assignAddresses(void);
+int needsRelaxation(struct LineInformation* line);
+void layoutLines(void);
+void emitRelaxedSequence(struct LineInformation* line, char *opcode, char *arg0, char *arg1);
+void emitLiteralPool(void);
+int lineAddress(int lineNumber);
+struct LabelInformation* findLabel(char* labelName);
+
 // second pass over input file
 void assemblerPass2(FILE *inputFile, FILE *outputFile);
 
 // helper functions
 int isDuplicate(char *label);
 int isValid(char *label);
-int isGlobalLabel(char* label);
+static int isGlobalLabel(char* label);
 //void addLabelToList(char *label, char *opcode, char *arg0, int lineNumber);
 int getOpcodeDetails(const char* opcode, struct OpcodeInfo* opcode_info);
-int formatOpcodeBasedOnType(struct OpcodeInfo* opcodeInfo, char *label, char *opcode, char *arg0, char *arg1, char *arg2, int lineNumber);
-int isValidRegister(char* reg);
+int formatOpcodeBasedOnType(struct OpcodeInfo* opcodeInfo, char *label, char *opcode, char *arg0, char *arg1, char *arg2, int address);
+static int isValidRegister(char* reg);
 int lookupLabelAddress(char* labelName);
 void addOpcodeToTextSection(int opcode);
 void addEntryToDataSection(int entry);
 void addEntryToRelocationSection(int lineOffset, char* opcodeName, char* labelName);
 void addEntryToSymbolTableSection(int lineOffset, char* symbolName, char symbolType);
 int isAlreadyAdded(char* symbolName);
-void exitProgram(char* message);
+static void exitProgram(char* message);
+static void exitWithError(const char* format, ...);
+
+// object cache
+char* readWholeFile(FILE* file, size_t* length);
+uint64_t hashBytes(uint64_t hash, const void* bytes, size_t length);
+void cachePathForKey(uint64_t key, const char* extension, char* path);
+int copyFile(const char* sourcePath, const char* destinationPath);
+int lookupObjectCache(uint64_t key, const char* outputPath);
+void storeObjectCache(uint64_t key, const char* outputPath);
+void pruneObjectCache(void);
+int cacheFileComparator(const void* file1, const void* file2);
+void printCacheStats(void);
+
+// object writers
+void writeTextObject(FILE* outputFile);
+void writeBinaryObject(FILE* outputFile);
+uint32_t addString(char** strings, uint32_t* length, uint32_t* capacity, const char* string);
+uint32_t* collectPoolOffsets(uint32_t* poolLength);
+
+// library entry, see lc2k.h
+void resetAssembler(void);
 
 /*
  * Read and parse a line of the assembly-language file.  Fields are returned
@@ -153,8 +340,7 @@ int readAndParse(FILE *inFilePtr, char *label, char *opcode, char *arg0,
     /* check for line too long (by looking for a \n) */
     if (strchr(line, '\n') == NULL) {
         /* line too long */
-        printf("error: line too long\n");
-        exit(1);
+        exitWithError("error: line too long\n");
     }
 
     /* is there a label? */
@@ -187,6 +373,7 @@ void assemblerPass1(FILE* inputFile) {
     arg1[MAXLINELENGTH], arg2[MAXLINELENGTH];
     int lineNumber = 0;
     while (readAndParse(inputFile, label, opcode, arg0, arg1, arg2)) {
+        addLine(label, opcode, arg0, arg2);
         // there's no label so we just increment line number and continue
         if (strlen(label) == 0) {
             lineNumber++;
@@ -195,8 +382,7 @@ void assemblerPass1(FILE* inputFile) {
         // check if label is duplicate and valid
         // throw an error here
         if (!isValid(label)) {
-            printf("%s\n", label);
-            exitProgram("Invalid label");
+            exitWithError("%s\n\nInvalid label\n", label);
         }
         if (isDuplicate(label)) {
             exitProgram("Duplicate label");
@@ -204,6 +390,7 @@ void assemblerPass1(FILE* inputFile) {
         struct LabelInformation* newLabel = (struct LabelInformation*) malloc(sizeof(struct LabelInformation));
         strcpy(newLabel->labelName, label);
         newLabel->lineNumber = lineNumber;
+        newLabel->pinned = 0;
         newLabel->next = NULL;
         if (!strcmp(opcode, ".fill")) {
             if (isNumber(arg0)) {
@@ -232,6 +419,7 @@ void assemblerPass2(FILE *inputFile, FILE *outputFile) {
     char label[MAXLINELENGTH], opcode[MAXLINELENGTH], arg0[MAXLINELENGTH],
     arg1[MAXLINELENGTH], arg2[MAXLINELENGTH];
     int lineNumber = 0;
+    emitLiteralPool();
     while (readAndParse(inputFile, label, opcode, arg0, arg1, arg2)) {
         int machineInstruction = 0;
         struct OpcodeInfo opcodeInfo;
@@ -243,8 +431,32 @@ void assemblerPass2(FILE *inputFile, FILE *outputFile) {
             //printf("%s\n", opcode);
             exitProgram("Unsupported opcode");
         }
-        if (opcodeInfo.opcodeType != FILL) {
-            machineInstruction = formatOpcodeBasedOnType(&opcodeInfo, label, opcode, arg0, arg1, arg2, lineNumber);
+        if (lines[lineNumber].aliasOf != -1) {
+            // pooled constant, its word lives at the line it aliases
+            ++lineNumber;
+            continue;
+        }
+        if (opcodeInfo.opcodeType == ALIGN) {
+            for (int i = 0; i < lines[lineNumber].padding; ++i) {
+                if (lines[lineNumber].alignsData) {
+                    addEntryToDataSection(0);
+                } else {
+                    addOpcodeToTextSection(NOOP_INSTRUCTION);
+                }
+            }
+            ++lineNumber;
+            continue;
+        }
+        if (lines[lineNumber].relaxed) {
+            if (!isValidRegister(arg0) || !isValidRegister(arg1)) {
+                exitProgram("Invalid registers");
+            }
+            if (isGlobalLabel(label)) {
+                addEntryToSymbolTableSection(textLength, label, 'T');
+            }
+            emitRelaxedSequence(&lines[lineNumber], opcode, arg0, arg1);
+        } else if (opcodeInfo.opcodeType != FILL) {
+            machineInstruction = formatOpcodeBasedOnType(&opcodeInfo, label, opcode, arg0, arg1, arg2, lines[lineNumber].address);
             addOpcodeToTextSection(machineInstruction);
         } else {
             if (isNumber(arg0)) {
@@ -266,8 +478,7 @@ void assemblerPass2(FILE *inputFile, FILE *outputFile) {
                         addEntryToRelocationSection(dataLength, ".fill", arg0);
                         addEntryToDataSection(0); // don't have value so we use dummy val of 0, resolve during linking
                     } else {
-                        printf("%s\n", arg0);
-                        exitProgram("Invalid label");
+                        exitWithError("%s\n\nInvalid label\n", arg0);
                     }
                 } else {
                     addEntryToRelocationSection(dataLength, ".fill", arg0);
@@ -280,7 +491,28 @@ void assemblerPass2(FILE *inputFile, FILE *outputFile) {
         }
         ++lineNumber;
     }
-    fprintf(outputFile, "%d %d %d %d\n", textLength, dataLength, symbolLength, relocationLength);
+    if (binaryOutput) {
+        writeBinaryObject(outputFile);
+    } else {
+        writeTextObject(outputFile);
+    }
+}
+
+void writeTextObject(FILE* outputFile) {
+    uint32_t poolLength = 0;
+    uint32_t* pool = collectPoolOffsets(&poolLength);
+    if (textAlign > 1 || dataAlign > 1) {
+        // section alignments follow the pool count when either is needed
+        fprintf(outputFile, "%d %d %d %d %u %d %d\n", textLength, dataLength, symbolLength, relocationLength,
+            poolLength, textAlign, dataAlign);
+    } else if (poolOutput) {
+        // the pool count is an optional fifth header field, with the
+        // poolable data offsets listed after the relocation table
+        fprintf(outputFile, "%d %d %d %d %u\n", textLength, dataLength, symbolLength, relocationLength,
+            poolLength);
+    } else {
+        fprintf(outputFile, "%d %d %d %d\n", textLength, dataLength, symbolLength, relocationLength);
+    }
     struct TextEntry* current = textEntry;
     while (current) {
         fprintf(outputFile, "%d\n", current->machineCode);
@@ -304,6 +536,122 @@ void assemblerPass2(FILE *inputFile, FILE *outputFile) {
         fprintf(outputFile, "%d %s %s\n", current3->lineOffset, current3->opcodeName, current3->label);
         current3 = current3->next;
     }
+
+    for (uint32_t i = 0; i < poolLength; ++i) {
+        fprintf(outputFile, "%u\n", pool[i]);
+    }
+    free(pool);
+}
+
+// data offsets of the constants the linker may merge across objects
+uint32_t* collectPoolOffsets(uint32_t* poolLength) {
+    uint32_t* pool = malloc((lineCount + 1) * sizeof(uint32_t));
+    uint32_t dataIndex = 0;
+    *poolLength = 0;
+    for (int i = 0; i < lineCount; ++i) {
+        if (lines[i].isAlign && lines[i].alignsData) {
+            dataIndex += lines[i].padding;
+        }
+        if (!lines[i].isFill || lines[i].aliasOf != -1) {
+            continue;
+        }
+        if (poolOutput && lines[i].isLocalConstant) {
+            pool[(*poolLength)++] = dataIndex;
+        }
+        dataIndex++;
+    }
+    return pool;
+}
+
+uint32_t addString(char** strings, uint32_t* length, uint32_t* capacity, const char* string) {
+    uint32_t offset = *length;
+    uint32_t size = strlen(string) + 1;
+    while (*length + size > *capacity) {
+        *capacity *= 2;
+        *strings = realloc(*strings, *capacity);
+    }
+    memcpy(*strings + offset, string, size);
+    *length += size;
+    return offset;
+}
+
+void writeBinaryObject(FILE* outputFile) {
+    struct ObjectHeader header = { { 0 }, OBJECT_VERSION, 6, 0 };
+    struct SectionHeader sections[6];
+    memcpy(header.magic, OBJECT_MAGIC, 4);
+
+    uint32_t stringCapacity = 256;
+    uint32_t stringLength = 0;
+    char* strings = malloc(stringCapacity);
+
+    struct SymbolRecord* symbols = calloc(symbolLength + 1, sizeof(struct SymbolRecord));
+    int index = 0;
+    for (struct SymbolTableEntry* current = symbolTableEntry; current; current = current->next, ++index) {
+        symbols[index].name = addString(&strings, &stringLength, &stringCapacity, current->symbolName);
+        symbols[index].offset = current->lineOffset;
+        symbols[index].type = current->entryType;
+    }
+
+    struct RelocationRecord* relocations = calloc(relocationLength + 1, sizeof(struct RelocationRecord));
+    index = 0;
+    for (struct RelocationEntry* current = relocationEntry; current; current = current->next, ++index) {
+        relocations[index].offset = current->lineOffset;
+        relocations[index].label = addString(&strings, &stringLength, &stringCapacity, current->label);
+        if (!strcmp(current->opcodeName, "lw")) {
+            relocations[index].kind = RELOCATE_LW;
+        } else if (!strcmp(current->opcodeName, "sw")) {
+            relocations[index].kind = RELOCATE_SW;
+        } else if (!strcmp(current->opcodeName, ".lit")) {
+            relocations[index].kind = RELOCATE_LITERAL;
+        } else {
+            relocations[index].kind = RELOCATE_FILL;
+        }
+    }
+
+    uint32_t poolLength = 0;
+    uint32_t* pool = collectPoolOffsets(&poolLength);
+
+    uint32_t types[6] = { SECTION_TEXT, SECTION_DATA, SECTION_SYMBOLS, SECTION_RELOCATIONS, SECTION_STRINGS,
+        SECTION_POOL };
+    uint32_t counts[6] = { textLength, dataLength, symbolLength, relocationLength, stringLength, poolLength };
+    uint32_t sizes[6] = { sizeof(int32_t), sizeof(int32_t), sizeof(struct SymbolRecord),
+        sizeof(struct RelocationRecord), 1, sizeof(uint32_t) };
+    if (!poolOutput) {
+        header.sectionCount = 5;
+    }
+    uint32_t offset = sizeof(header) + header.sectionCount * sizeof(struct SectionHeader);
+    for (int i = 0; i < header.sectionCount; ++i) {
+        sections[i].type = types[i];
+        sections[i].offset = offset;
+        sections[i].count = counts[i];
+        sections[i].align = types[i] == SECTION_TEXT ? textAlign : types[i] == SECTION_DATA ? dataAlign : 1;
+        // keep every section 4-byte aligned so the linker can read it in place
+        offset += (counts[i] * sizes[i] + 3) & ~3u;
+    }
+
+    fwrite(&header, sizeof(header), 1, outputFile);
+    fwrite(sections, sizeof(struct SectionHeader), header.sectionCount, outputFile);
+    for (struct TextEntry* current = textEntry; current; current = current->next) {
+        int32_t word = current->machineCode;
+        fwrite(&word, sizeof(word), 1, outputFile);
+    }
+    for (struct DataEntry* current = dataEntry; current; current = current->next) {
+        int32_t word = current->value;
+        fwrite(&word, sizeof(word), 1, outputFile);
+    }
+    fwrite(symbols, sizeof(struct SymbolRecord), symbolLength, outputFile);
+    fwrite(relocations, sizeof(struct RelocationRecord), relocationLength, outputFile);
+    fwrite(strings, 1, stringLength, outputFile);
+    static const char padding[4] = { 0 };
+    fwrite(padding, 1, (4 - stringLength % 4) % 4, outputFile);
+    if (poolOutput) {
+        fwrite(pool, sizeof(uint32_t), poolLength, outputFile);
+    }
+
+    free(pool);
+    free(strings);
+    free(symbols);
+    free(relocations);
 }
 
 int isDuplicate(char *labelNameIn) {
@@ -343,7 +691,7 @@ int isValid(char *labelNameIn) {
     return 1;
 }
 
-int isGlobalLabel(char* label) {
+static int isGlobalLabel(char* label) {
     return isupper(label[0]);
 }
 
@@ -387,7 +735,7 @@ int getOpcodeDetails(const char* opcode, struct OpcodeInfo* opcode_info) {
     return 0;
 }
 
-int formatOpcodeBasedOnType(struct OpcodeInfo* opcodeInfo, char *label, char *opcode, char *arg0, char *arg1, char *arg2, int lineNumber) {
+int formatOpcodeBasedOnType(struct OpcodeInfo* opcodeInfo, char *label, char *opcode, char *arg0, char *arg1, char *arg2, int address) {
     int machineInstruction = opcodeInfo->opcode;
     switch (opcodeInfo->opcodeType) {
         case RTYPE: {
@@ -432,16 +780,18 @@ int formatOpcodeBasedOnType(struct OpcodeInfo* opcodeInfo, char *label, char *op
                             addEntryToSymbolTableSection(0, arg2, 'U');
                         }
                     } else {
-                        printf("%s\n", arg2);
-                        exitProgram("Invalid label");
+                        exitWithError("%s\n\nInvalid label\n", arg2);
                     }
                 }
             }
             if (strcmp(opcode, "beq") && !isNumber(arg2)) {
+                if (offset > MAX_OFFSET) {
+                    exitProgram("Offset out of range");
+                }
                 addEntryToRelocationSection(textLength, opcodeInfo->name, arg2);
             }
             if (!strcmp(opcode, "beq") && !isNumber(arg2)) {
-                offset = offset - lineNumber - 1;
+                offset = offset - address - 1;
                 if (offset < -32768 || offset > 32767) {
                     exitProgram("Offset out of range");
                 }
@@ -469,8 +819,7 @@ int formatOpcodeBasedOnType(struct OpcodeInfo* opcodeInfo, char *label, char *op
             break;
         }
         default: {
-            printf("%s\n", opcode);
-            exitProgram("Unsupported opcode");
+            exitWithError("%s\n\nUnsupported opcode\n", opcode);
         }
     }
     return machineInstruction;
@@ -478,7 +827,7 @@ int formatOpcodeBasedOnType(struct OpcodeInfo* opcodeInfo, char *label, char *op
 
 
 
-int isValidRegister(char* reg) {
+static int isValidRegister(char* reg) {
     if (!isNumber(reg)) {
         return 0;
     }
@@ -490,14 +839,304 @@ int isValidRegister(char* reg) {
 }
 
 int lookupLabelAddress(char* labelName) {
+    struct LabelInformation* current = findLabel(labelName);
+    if (current == NULL) {
+        return -1;
+    }
+    return lineAddress(current->lineNumber);
+}
+
+struct LabelInformation* findLabel(char* labelName) {
     struct LabelInformation* current = labels;
     while (current != NULL) {
         if (!strcmp(current->labelName, labelName)) {
-            return current->lineNumber;
+            return current;
         }
         current = current->next;
     }
-    return -1;
+    return NULL;
+}
+
+void addLine(char* label, char* opcode, char* arg0, char* arg2) {
+    if (lineCount == lineCapacity) {
+        lineCapacity = lineCapacity ? lineCapacity * 2 : 256;
+        lines = realloc(lines, lineCapacity * sizeof(struct LineInformation));
+    }
+    struct LineInformation* line = &lines[lineCount++];
+    line->isFill = !strcmp(opcode, ".fill");
+    line->hasLabel = strlen(label) > 0;
+    line->isLocalConstant = line->isFill && line->hasLabel && !isGlobalLabel(label) && isNumber(arg0);
+    line->value = line->isLocalConstant ? atoi(arg0) : 0;
+    line->aliasOf = -1;
+    line->address = lineCount - 1;
+    line->isBranch = !strcmp(opcode, "beq");
+    line->isMemory = !strcmp(opcode, "lw") || !strcmp(opcode, "sw");
+    line->target[0] = '\0';
+    if ((line->isBranch || line->isMemory) && !isNumber(arg2) && strlen(arg2) < MAX_LABEL_LENGTH) {
+        strcpy(line->target, arg2);
+    }
+    line->targetLine = -1;
+    line->relaxed = 0;
+    line->literal = -1;
+    line->isAlign = !strcmp(opcode, ".align");
+    line->align = 1;
+    line->alignsData = 0;
+    line->padding = 0;
+    if (line->isAlign) {
+        if (line->hasLabel) {
+            exitProgram("Label not allowed on .align");
+        }
+        char *end = NULL;
+        long align = strtol(arg0, &end, 10);
+        if (!isNumber(arg0) || *end != '\0' || align < 1 || align > MAX_ALIGN || (align & (align - 1))) {
+            exitProgram("Invalid .align boundary");
+        }
+        line->align = align;
+    }
+}
+
+// Merge .fill constants that carry a local label and are only ever read
+// directly through that label, i.e. by "lw 0 X label". Any other use (a
+// store, a branch, an address taken by another .fill) pins the label to a
+// private word. A lw or sw with a non-zero base register indexes from the
+// label, so every .fill in the run around it must keep its place as well;
+// a labelled .fill followed by an unlabelled one is the head of an array
+// for the same reason.
+void poolConstants(FILE *inputFile) {
+    char label[MAXLINELENGTH], opcode[MAXLINELENGTH], arg0[MAXLINELENGTH],
+    arg1[MAXLINELENGTH], arg2[MAXLINELENGTH];
+    while (readAndParse(inputFile, label, opcode, arg0, arg1, arg2)) {
+        struct LabelInformation* target = NULL;
+        if (!strcmp(opcode, "lw") || !strcmp(opcode, "sw") || !strcmp(opcode, "beq")) {
+            target = findLabel(arg2);
+        } else if (!strcmp(opcode, ".fill")) {
+            target = findLabel(arg0);
+        }
+        if (target == NULL) {
+            continue;
+        }
+        int isMemory = !strcmp(opcode, "lw") || !strcmp(opcode, "sw");
+        int isDirect = isNumber(arg0) && atoi(arg0) == 0;
+        if (!strcmp(opcode, "lw") && isDirect) {
+            continue;
+        }
+        target->pinned = 1;
+        if (isMemory && !isDirect) {
+            // indexed access: keep the whole run of .fill words in place
+            int first = target->lineNumber;
+            int last = target->lineNumber;
+            while (first > 0 && lines[first - 1].isFill) {
+                --first;
+            }
+            while (last + 1 < lineCount && lines[last + 1].isFill) {
+                ++last;
+            }
+            for (int i = first; i <= last && lines[i].isFill; ++i) {
+                lines[i].isLocalConstant = 0;
+            }
+        }
+    }
+    for (struct LabelInformation* current = labels; current; current = current->next) {
+        if (current->pinned) {
+            lines[current->lineNumber].isLocalConstant = 0;
+        }
+    }
+    for (int i = 0; i + 1 < lineCount; ++i) {
+        if (lines[i + 1].isFill && !lines[i + 1].hasLabel) {
+            lines[i].isLocalConstant = 0;
+        }
+    }
+
+    // open-addressed table from value to 1 + the first line holding it
+    int capacity = 16;
+    while (capacity < 2 * lineCount) {
+        capacity *= 2;
+    }
+    int* canonical = calloc(capacity, sizeof(int));
+    for (int i = 0; i < lineCount; ++i) {
+        if (!lines[i].isLocalConstant) {
+            continue;
+        }
+        int slot = hashBytes(0xcbf29ce484222325ULL, &lines[i].value, sizeof(lines[i].value)) & (capacity - 1);
+        while (canonical[slot] != 0 && lines[canonical[slot] - 1].value != lines[i].value) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (canonical[slot] != 0) {
+            lines[i].aliasOf = canonical[slot] - 1;
+            poolWordsSaved++;
+        } else {
+            canonical[slot] = i + 1;
+        }
+    }
+    free(canonical);
+}
+
+// .fill lines, and any .align directly in front of one, belong to the data
+int lineInData(struct LineInformation* line) {
+    return line->isFill || (line->isAlign && line->alignsData);
+}
+
+// The literal pool and its guard branch come first, then text, then data.
+// Pooled constants take no space, relaxed lines take the size of their
+// expansion and .align pads to a multiple of its boundary, counted from the
+// start of its own section.
+void assignAddresses(void) {
+    literalCount = 0;
+    for (int i = 0; i < lineCount; ++i) {
+        if (lines[i].relaxed) {
+            // branches and loads of the same label share one literal
+            int j = 0;
+            while (j < i && !(lines[j].relaxed && lines[j].targetLine == lines[i].targetLine)) {
+                ++j;
+            }
+            lines[i].literal = j < i ? lines[j].literal : 1 + literalCount++;
+        }
+    }
+    int textAddress = literalCount ? literalCount + 1 : 0;
+    for (int i = 0; i < lineCount; ++i) {
+        if (lineInData(&lines[i])) {
+            continue;
+        }
+        lines[i].address = textAddress;
+        if (lines[i].isAlign) {
+            lines[i].padding = (lines[i].align - textAddress % lines[i].align) % lines[i].align;
+            textAddress += lines[i].padding;
+        } else {
+            textAddress += !lines[i].relaxed ? 1 : lines[i].isBranch ? RELAXED_BRANCH_WORDS : RELAXED_MEMORY_WORDS;
+        }
+    }
+    int dataAddress = textAddress;
+    for (int i = 0; i < lineCount; ++i) {
+        if (!lineInData(&lines[i])) {
+            continue;
+        }
+        lines[i].address = dataAddress;
+        if (lines[i].isAlign) {
+            int dataOffset = dataAddress - textAddress;
+            lines[i].padding = (lines[i].align - dataOffset % lines[i].align) % lines[i].align;
+            dataAddress += lines[i].padding;
+        } else if (lines[i].aliasOf == -1) {
+            dataAddress++;
+        }
+    }
+}
+
+int needsRelaxation(struct LineInformation* line) {
+    if (line->relaxed || line->targetLine == -1) {
+        return 0;
+    }
+    int targetAddress = lineAddress(line->targetLine);
+    if (line->isBranch) {
+        int offset = targetAddress - line->address - 1;
+        return offset < MIN_OFFSET || offset > MAX_OFFSET;
+    }
+    return targetAddress > MAX_OFFSET;
+}
+
+// Lay the program out, expanding out-of-range branches and label loads and
+// stores until no more need it. Expanding only ever grows the program, so
+// every pass can only add relaxations and the loop reaches a fixed point.
+void layoutLines(void) {
+    for (int i = 0; i < lineCount; ++i) {
+        struct LabelInformation* target = lines[i].target[0] ? findLabel(lines[i].target) : NULL;
+        lines[i].targetLine = target ? target->lineNumber : -1;
+    }
+    for (int i = lineCount - 1, nextIsFill = 0; i >= 0; --i) {
+        if (lines[i].isAlign) {
+            lines[i].alignsData = nextIsFill;
+            int* sectionAlign = nextIsFill ? &dataAlign : &textAlign;
+            if (lines[i].align > *sectionAlign) {
+                *sectionAlign = lines[i].align;
+            }
+        } else {
+            nextIsFill = lines[i].isFill;
+        }
+    }
+    int changed = 1;
+    while (changed) {
+        assignAddresses();
+        changed = 0;
+        if (relaxAddressRegister == -1) {
+            break;
+        }
+        for (int i = 0; i < lineCount; ++i) {
+            if (needsRelaxation(&lines[i])) {
+                lines[i].relaxed = 1;
+                changed = 1;
+            }
+        }
+    }
+    for (int i = 0; i < lineCount; ++i) {
+        if (!lines[i].relaxed) {
+            continue;
+        }
+        if (lines[i].literal > MAX_OFFSET) {
+            exitProgram("Literal pool out of range");
+        }
+        if (lines[i].isBranch) {
+            printf("relaxed beq at line %d through r%d and r%d (+%d words)\n", i + 1,
+                relaxAddressRegister, relaxLinkRegister, RELAXED_BRANCH_WORDS - 1);
+        } else {
+            printf("relaxed lw/sw at line %d through r%d (+%d words)\n", i + 1,
+                relaxAddressRegister, RELAXED_MEMORY_WORDS - 1);
+        }
+    }
+    if (literalCount) {
+        printf("literal pool: %d words plus 1 guard branch\n", literalCount);
+    }
+}
+
+// beq regA regB far becomes
+//     beq  regA regB 1     equal: fall into the jump
+//     beq  0 0 2           not equal: skip it
+//     lw   0 addr literal  literal holds the address of far
+//     jalr addr link
+// and lw/sw regA regB far becomes
+//     lw   0 addr literal
+//     add  addr regA addr
+//     lw/sw addr regB 0
+void emitRelaxedSequence(struct LineInformation* line, char *opcode, char *arg0, char *arg1) {
+    int regA = atoi(arg0);
+    int regB = atoi(arg1);
+    int loadLiteral = (2 << 22) | (relaxAddressRegister << 16) | (line->literal & 0xFFFF);
+    if (line->isBranch) {
+        addOpcodeToTextSection((4 << 22) | (regA << 19) | (regB << 16) | 1);
+        addOpcodeToTextSection((4 << 22) | 2);
+        addEntryToRelocationSection(textLength, "lw", literalLabel);
+        addOpcodeToTextSection(loadLiteral);
+        addOpcodeToTextSection((5 << 22) | (relaxAddressRegister << 19) | (relaxLinkRegister << 16));
+        return;
+    }
+    if (regA == relaxAddressRegister || (!strcmp(opcode, "sw") && regB == relaxAddressRegister)) {
+        exitProgram("Relaxation register conflicts with operand");
+    }
+    int memoryOpcode = !strcmp(opcode, "lw") ? (2 << 22) : (3 << 22);
+    addEntryToRelocationSection(textLength, "lw", literalLabel);
+    addOpcodeToTextSection(loadLiteral);
+    addOpcodeToTextSection((regA << 19) | (relaxAddressRegister << 16) | relaxAddressRegister);
+    addOpcodeToTextSection(memoryOpcode | (relaxAddressRegister << 19) | (regB << 16));
+}
+
+// literal words hold label addresses; they live in the text section, so
+// they get their own whole-word relocation rather than a .fill one
+void emitLiteralPool(void) {
+    if (!literalCount) {
+        return;
+    }
+    addOpcodeToTextSection((4 << 22) | literalCount);
+    for (int i = 0; i < lineCount; ++i) {
+        if (lines[i].relaxed && lines[i].literal == textLength) {
+            addEntryToRelocationSection(textLength, ".lit", lines[i].target);
+            addOpcodeToTextSection(lineAddress(lines[i].targetLine));
+        }
+    }
+}
+
+int lineAddress(int lineNumber) {
+    if (lines[lineNumber].aliasOf != -1) {
+        lineNumber = lines[lineNumber].aliasOf;
+    }
+    return lines[lineNumber].address;
 }
 
 void addOpcodeToTextSection(int opcode) {
@@ -509,14 +1148,10 @@ void addOpcodeToTextSection(int opcode) {
 
     if (textEntry == NULL) {
         textEntry = entry;
-        return;
-    }
-
-    struct TextEntry* current = textEntry;
-    while (current->next) {
-        current = current->next;
+    } else {
+        textTail->next = entry;
     }
-    current->next = entry;
+    textTail = entry;
 }
 
 void addEntryToDataSection(int value) {
@@ -528,14 +1163,10 @@ void addEntryToDataSection(int value) {
 
     if (dataEntry == NULL) {
         dataEntry = entry;
-        return;
-    }
-
-    struct DataEntry* current = dataEntry;
-    while (current->next) {
-        current = current->next;
+    } else {
+        dataTail->next = entry;
     }
-    current->next = entry;
+    dataTail = entry;
 }
 
 void addEntryToRelocationSection(int lineOffset, char* opcodeName, char* labelName) {
@@ -549,14 +1180,10 @@ void addEntryToRelocationSection(int lineOffset, char* opcodeName, char* labelNa
 
     if (relocationEntry == NULL) {
         relocationEntry = entry;
-        return;
-    }
-
-    struct RelocationEntry* current = relocationEntry;
-    while (current->next) {
-        current = current->next;
+    } else {
+        relocationTail->next = entry;
     }
-    current->next = entry;
+    relocationTail = entry;
 }
 
 void addEntryToSymbolTableSection(int lineOffset, char* symbolName, char entryType) {
@@ -594,11 +1221,214 @@ int isAlreadyAdded(char* symbolName) {
     return 0;
 }
 
-void exitProgram(char* message) {
-    printf("\n%s\n", message);
+static void exitProgram(char* message) {
+    exitWithError("\n%s\n", message);
+}
+
+// Prints an error and exits; inside the library the message goes back to
+// the lc2k call instead, see lc2k.h.
+static void exitWithError(const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+#ifdef LC2K_LIBRARY
+    lc2kFail(format, arguments);
+#endif
+    vprintf(format, arguments);
+    va_end(arguments);
     exit(1);
 }
 
+char* readWholeFile(FILE* file, size_t* length) {
+    size_t capacity = 4096;
+    size_t used = 0;
+    char* buffer = malloc(capacity);
+    size_t count;
+    while ((count = fread(buffer + used, 1, capacity - used, file)) > 0) {
+        used += count;
+        if (used == capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+    }
+    *length = used;
+    return buffer;
+}
+
+// 64-bit FNV-1a, chained so several buffers can be folded into one key
+uint64_t hashBytes(uint64_t hash, const void* bytes, size_t length) {
+    const unsigned char* current = bytes;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= current[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+void cachePathForKey(uint64_t key, const char* extension, char* path) {
+    snprintf(path, MAX_CACHE_PATH_LENGTH, "%s/%016llx.%s",
+        objectCache.directory, (unsigned long long) key, extension);
+}
+
+// clone the file when the filesystem supports reflinks, otherwise copy it
+int copyFile(const char* sourcePath, const char* destinationPath) {
+    int source = open(sourcePath, O_RDONLY);
+    if (source < 0) {
+        return 0;
+    }
+    int destination = open(destinationPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (destination < 0) {
+        close(source);
+        return 0;
+    }
+    int copied = 0;
+#ifdef FICLONE
+    copied = ioctl(destination, FICLONE, source) == 0;
+#endif
+    if (!copied) {
+        char buffer[65536];
+        ssize_t count;
+        copied = 1;
+        while ((count = read(source, buffer, sizeof(buffer))) > 0) {
+            if (write(destination, buffer, count) != count) {
+                copied = 0;
+                break;
+            }
+        }
+        if (count < 0) {
+            copied = 0;
+        }
+    }
+    close(source);
+    if (close(destination) != 0) {
+        copied = 0;
+    }
+    return copied;
+}
+
+// returns 1 and fills the output file if the object is already cached;
+// a pooled object also restores poolWordsSaved from the .pool file stored
+// beside it
+int lookupObjectCache(uint64_t key, const char* outputPath) {
+    char path[MAX_CACHE_PATH_LENGTH];
+    if (poolOutput) {
+        cachePathForKey(key, "pool", path);
+        FILE* poolFile = fopen(path, "r");
+        int found = poolFile != NULL && fscanf(poolFile, "%d", &poolWordsSaved) == 1;
+        if (poolFile != NULL) {
+            fclose(poolFile);
+        }
+        if (!found) {
+            objectCache.misses++;
+            return 0;
+        }
+    }
+    cachePathForKey(key, "obj", path);
+    if (access(path, R_OK) != 0 || !copyFile(path, outputPath)) {
+        objectCache.misses++;
+        return 0;
+    }
+    // bump the timestamp so pruning sees this entry as recently used
+    utime(path, NULL);
+    objectCache.hits++;
+    return 1;
+}
+
+void storeObjectCache(uint64_t key, const char* outputPath) {
+    char path[MAX_CACHE_PATH_LENGTH];
+    char temporaryPath[MAX_CACHE_PATH_LENGTH + 32];
+    mkdir(objectCache.directory, 0755);
+    if (poolOutput) {
+        // the count goes in first, so a reader that finds the object also
+        // finds its count
+        cachePathForKey(key, "pool", path);
+        snprintf(temporaryPath, sizeof(temporaryPath), "%s.%ld.tmp", path, (long) getpid());
+        FILE* poolFile = fopen(temporaryPath, "w");
+        if (poolFile == NULL) {
+            return;
+        }
+        fprintf(poolFile, "%d\n", poolWordsSaved);
+        if (fclose(poolFile) != 0 || rename(temporaryPath, path) != 0) {
+            unlink(temporaryPath);
+            return;
+        }
+    }
+    cachePathForKey(key, "obj", path);
+    // write under a private name and rename so concurrent builds never see
+    // a partially written entry
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.%ld.tmp", path, (long) getpid());
+    if (!copyFile(outputPath, temporaryPath) || rename(temporaryPath, path) != 0) {
+        unlink(temporaryPath);
+        return;
+    }
+    pruneObjectCache();
+}
+
+int cacheFileComparator(const void* file1, const void* file2) {
+    const struct CacheFile* a = file1;
+    const struct CacheFile* b = file2;
+    if (a->lastUsed.tv_sec != b->lastUsed.tv_sec) {
+        return a->lastUsed.tv_sec < b->lastUsed.tv_sec ? -1 : 1;
+    }
+    if (a->lastUsed.tv_nsec != b->lastUsed.tv_nsec) {
+        return a->lastUsed.tv_nsec < b->lastUsed.tv_nsec ? -1 : 1;
+    }
+    return strcmp(a->name, b->name);
+}
+
+// drop least recently used entries until the cache fits in its size limit
+void pruneObjectCache(void) {
+    DIR* directory = opendir(objectCache.directory);
+    if (directory == NULL) {
+        return;
+    }
+    int fileCount = 0;
+    int fileCapacity = 64;
+    long totalSize = 0;
+    struct CacheFile* files = malloc(fileCapacity * sizeof(struct CacheFile));
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL) {
+        size_t nameLength = strlen(entry->d_name);
+        if (nameLength < 4 || strcmp(entry->d_name + nameLength - 4, ".obj")) {
+            continue;
+        }
+        struct stat info;
+        char path[MAX_CACHE_PATH_LENGTH];
+        snprintf(path, sizeof(path), "%s/%s", objectCache.directory, entry->d_name);
+        if (stat(path, &info) != 0) {
+            continue;
+        }
+        if (fileCount == fileCapacity) {
+            fileCapacity *= 2;
+            files = realloc(files, fileCapacity * sizeof(struct CacheFile));
+        }
+        strcpy(files[fileCount].name, path);
+        files[fileCount].size = info.st_size;
+        files[fileCount].lastUsed = info.st_mtim;
+        totalSize += info.st_size;
+        fileCount++;
+    }
+    closedir(directory);
+
+    qsort(files, fileCount, sizeof(struct CacheFile), cacheFileComparator);
+    for (int i = 0; i < fileCount && totalSize > objectCache.sizeLimit; ++i) {
+        if (unlink(files[i].name) == 0) {
+            totalSize -= files[i].size;
+            objectCache.pruned++;
+            // drop the pool count stored beside a pooled object
+            char poolPath[MAX_CACHE_PATH_LENGTH + 8];
+            snprintf(poolPath, sizeof(poolPath), "%.*spool",
+                (int) strlen(files[i].name) - 3, files[i].name);
+            unlink(poolPath);
+        }
+    }
+    free(files);
+}
+
+void printCacheStats(void) {
+    printf("object cache: %d hits, %d misses, %d pruned\n",
+        objectCache.hits, objectCache.misses, objectCache.pruned);
+}
+
 /*
  !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
 !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
@@ -611,26 +1441,80 @@ void exitProgram(char* message) {
                                                                     */
 
 
+#ifndef LC2K_LIBRARY
 int main(int argc, char *argv[]) {
     char *inFileString, *outFileString;
     FILE *inFilePtr, *outFilePtr;
     /*char label[MAXLINELENGTH], opcode[MAXLINELENGTH], arg0[MAXLINELENGTH],
             arg1[MAXLINELENGTH], arg2[MAXLINELENGTH]; */
+    int argIndex = 1;
+
+    objectCache.directory = getenv("LC2K_OBJECT_CACHE");
+    for (; argIndex < argc && argv[argIndex][0] == '-'; ++argIndex) {
+        if (!strcmp(argv[argIndex], "-C") && argIndex + 1 < argc) {
+            objectCache.directory = argv[++argIndex];
+        } else if (!strcmp(argv[argIndex], "-L") && argIndex + 1 < argc) {
+            objectCache.sizeLimit = atol(argv[++argIndex]);
+        } else if (!strcmp(argv[argIndex], "-r") && argIndex + 1 < argc) {
+            char* registers = argv[++argIndex];
+            if (!strcmp(registers, "none")) {
+                relaxAddressRegister = relaxLinkRegister = -1;
+            } else if (sscanf(registers, "%d,%d", &relaxAddressRegister, &relaxLinkRegister) != 2 ||
+                relaxAddressRegister < 1 || relaxAddressRegister > 7 ||
+                relaxLinkRegister < 1 || relaxLinkRegister > 7 ||
+                relaxAddressRegister == relaxLinkRegister) {
+                exitProgram("Invalid relaxation registers");
+            }
+            snprintf(optionsSignature + strlen(optionsSignature),
+                sizeof(optionsSignature) - strlen(optionsSignature), " -r %s", registers);
+        } else if (!strcmp(argv[argIndex], "-p")) {
+            poolOutput = 1;
+            strcat(optionsSignature, " -p");
+        } else if (!strcmp(argv[argIndex], "-b")) {
+            binaryOutput = 1;
+            strcat(optionsSignature, " -b");
+        } else {
+            break;
+        }
+    }
 
-    if (argc != 3) {
-        printf("error: usage: %s <assembly-code-file> <machine-code-file>\n",
+    if (argc - argIndex != 2) {
+        printf("error: usage: %s [-b] [-p] [-r addr,link|none] [-C cache-dir] [-L cache-bytes] <assembly-code-file> <machine-code-file>\n"
+            "       -r relaxes out-of-range beq/lw/sw through the scratch registers addr and link,\n"
+            "          which the program must not rely on; relaxation is off by default\n",
             argv[0]);
         exit(1);
     }
 
-    inFileString = argv[1];
-    outFileString = argv[2];
+    inFileString = argv[argIndex];
+    outFileString = argv[argIndex + 1];
 
     inFilePtr = fopen(inFileString, "r");
     if (inFilePtr == NULL) {
         printf("error in opening %s\n", inFileString);
         exit(1);
     }
+
+    uint64_t cacheKey = 0;
+    if (objectCache.directory != NULL && objectCache.directory[0] != '\0') {
+        size_t sourceLength;
+        char* source = readWholeFile(inFilePtr, &sourceLength);
+        cacheKey = hashBytes(0xcbf29ce484222325ULL, source, sourceLength);
+        cacheKey = hashBytes(cacheKey, ASSEMBLER_VERSION, sizeof(ASSEMBLER_VERSION));
+        cacheKey = hashBytes(cacheKey, optionsSignature, strlen(optionsSignature) + 1);
+        free(source);
+        if (lookupObjectCache(cacheKey, outFileString)) {
+            if (poolOutput) {
+                printf("constant pool: %d words saved\n", poolWordsSaved);
+            }
+            printCacheStats();
+            return(0);
+        }
+        rewind(inFilePtr);
+    } else {
+        objectCache.directory = NULL;
+    }
+
     outFilePtr = fopen(outFileString, "w");
     if (outFilePtr == NULL) {
         printf("error in opening %s\n", outFileString);
@@ -638,11 +1522,123 @@ int main(int argc, char *argv[]) {
     }
     
     assemblerPass1(inFilePtr);
+    if (poolOutput) {
+        rewind(inFilePtr);
+        poolConstants(inFilePtr);
+    }
+    layoutLines();
     rewind(inFilePtr);
     assemblerPass2(inFilePtr, outFilePtr);
+    fclose(inFilePtr);
+    if (fclose(outFilePtr) != 0) {
+        printf("error in writing %s\n", outFileString);
+        exit(1);
+    }
+
+    if (poolOutput) {
+        printf("constant pool: %d words saved\n", poolWordsSaved);
+    }
+
+    if (objectCache.directory != NULL) {
+        storeObjectCache(cacheKey, outFileString);
+        printCacheStats();
+    }
 
     return(0);
 }
+#endif
+
+#ifdef LC2K_LIBRARY
+// Frees what the last assembly left in the globals and restores the
+// defaults the command line starts from.
+void resetAssembler(void) {
+    while (labels != NULL) {
+        struct LabelInformation* next = labels->next;
+        free(labels);
+        labels = next;
+    }
+    while (symbolTableEntry != NULL) {
+        struct SymbolTableEntry* next = symbolTableEntry->next;
+        free(symbolTableEntry);
+        symbolTableEntry = next;
+    }
+    while (textEntry != NULL) {
+        struct TextEntry* next = textEntry->next;
+        free(textEntry);
+        textEntry = next;
+    }
+    while (dataEntry != NULL) {
+        struct DataEntry* next = dataEntry->next;
+        free(dataEntry);
+        dataEntry = next;
+    }
+    while (relocationEntry != NULL) {
+        struct RelocationEntry* next = relocationEntry->next;
+        free(relocationEntry);
+        relocationEntry = next;
+    }
+    free(lines);
+    lines = NULL;
+    lineCount = lineCapacity = 0;
+    symbolLength = textLength = dataLength = relocationLength = 0;
+    textTail = NULL;
+    dataTail = NULL;
+    relocationTail = NULL;
+    poolWordsSaved = 0;
+    textAlign = dataAlign = 1;
+    relaxAddressRegister = -1;
+    relaxLinkRegister = -1;
+    literalCount = 0;
+}
 
+// Runs both passes over source from memory and writes a binary object
+// into memory, as -b would write to a file.
+int lc2kAssemble(const char* source, size_t length, int flags, LC2KObject* object,
+    char* error, size_t errorSize) {
+    char* bytes = NULL;
+    size_t size = 0;
+    // an empty stream stands in for an empty source, which fmemopen rejects
+    FILE* inFilePtr = length > 0 ? fmemopen((void*) source, length, "r") : fopen("/dev/null", "r");
+    FILE* outFilePtr = open_memstream(&bytes, &size);
+    object->bytes = NULL;
+    object->size = 0;
+    resetAssembler();
+    binaryOutput = 1;
+    poolOutput = (flags & LC2K_POOL) != 0;
+    lc2kMessage[0] = '\0';
+    if (setjmp(lc2kErrorJump)) {
+        lc2kCopyMessage(error, errorSize);
+        if (inFilePtr != NULL) {
+            fclose(inFilePtr);
+        }
+        if (outFilePtr != NULL) {
+            fclose(outFilePtr);
+        }
+        free(bytes);
+        return 1;
+    }
+    if (inFilePtr == NULL || outFilePtr == NULL) {
+        exitProgram("Out of memory");
+    }
 
+    assemblerPass1(inFilePtr);
+    if (poolOutput) {
+        rewind(inFilePtr);
+        poolConstants(inFilePtr);
+    }
+    layoutLines();
+    rewind(inFilePtr);
+    assemblerPass2(inFilePtr, outFilePtr);
+    fclose(inFilePtr);
+    fclose(outFilePtr);
+    object->bytes = (unsigned char*) bytes;
+    object->size = size;
+    return 0;
+}
 
+void lc2kFreeObject(LC2KObject* object) {
+    free(object->bytes);
+    object->bytes = NULL;
+    object->size = 0;
+}
+#endif
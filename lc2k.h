@@ -0,0 +1,96 @@
+/**
+ * LC-2K toolchain library
+ * Assembles, links and simulates entirely in memory, for harnesses that
+ * run many short programs and would otherwise pay for three processes and
+ * two rounds of decimal text files per test.
+ *
+ * The library is assembler.c, linker.c and simulator.c built with
+ * -DLC2K_LIBRARY and linked together with the caller; built without it,
+ * the same files are the command-line tools. Objects travel between the
+ * calls in the binary object format, which the linker uses in place.
+ *
+ * Every call returns 0 on success. On failure it returns 1 and copies the
+ * message the command-line tool would have printed into error. The
+ * assembler and simulator keep their state in globals, so calls must not
+ * run concurrently. Memory a failed call had allocated is freed before it
+ * returns, or for the assembler at its next call.
+ */
+
+#ifndef LC2K_H
+#define LC2K_H
+
+#include <stddef.h>
+
+#define LC2K_NUMREGS 8
+
+// flags for lc2kAssemble and lc2kLink, the -p and --gc-sections options
+#define LC2K_POOL 1
+#define LC2K_GC_SECTIONS 2
+
+// an object in the binary format
+typedef struct LC2KObject {
+    unsigned char* bytes;
+    size_t size;
+} LC2KObject;
+
+// a linked executable, text then data, as the linker would print it
+typedef struct LC2KImage {
+    int* words;
+    int size;
+} LC2KImage;
+
+typedef struct LC2KRun {
+    int reg[LC2K_NUMREGS];
+    int pc;
+    long long instructions;
+    long long cacheHits;
+    long long cacheMisses;
+    int* memory; // the program's memory once the cache has been flushed
+    int memorySize;
+} LC2KRun;
+
+int lc2kAssemble(const char* source, size_t length, int flags, LC2KObject* object,
+    char* error, size_t errorSize);
+int lc2kLink(const LC2KObject* objects, int count, int flags, LC2KImage* image,
+    char* error, size_t errorSize);
+int lc2kSimulate(const LC2KImage* image, int blockSizeInWords, int numberOfSets, int blocksPerSet,
+    LC2KRun* run, char* error, size_t errorSize);
+
+void lc2kFreeObject(LC2KObject* object);
+void lc2kFreeImage(LC2KImage* image);
+void lc2kFreeRun(LC2KRun* run);
+
+#ifdef LC2K_INTERNAL
+// Inside the library the tools' error paths, which print a message and
+// exit, hand the message to lc2kFail instead, which keeps it and jumps back
+// to the lc2k call. Other output is switched off while a call runs.
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LC2K_MESSAGE_SIZE 1024
+
+static jmp_buf lc2kErrorJump;
+static char lc2kMessage[LC2K_MESSAGE_SIZE];
+
+// keeps the message the tool would have printed and fails the call
+static void lc2kFail(const char* format, va_list arguments) {
+    vsnprintf(lc2kMessage, sizeof(lc2kMessage), format, arguments);
+    longjmp(lc2kErrorJump, 1);
+}
+
+// copies the message, without the blank lines around it, to error
+static void lc2kCopyMessage(char* error, size_t errorSize) {
+    const char* start = lc2kMessage + strspn(lc2kMessage, "\n");
+    size_t length = strlen(start);
+    while (length > 0 && start[length - 1] == '\n') {
+        length--;
+    }
+    if (errorSize > 0) {
+        snprintf(error, errorSize, "%.*s", (int) length, start);
+    }
+}
+#endif
+
+#endif
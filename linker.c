@@ -4,81 +4,536 @@
  */
 
 #include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#ifdef LC2K_LIBRARY
+#define LC2K_INTERNAL
+#include "lc2k.h"
+#endif
 
-#define MAXSIZE 300
-#define MAXLINELENGTH 1000
-#define MAXFILES 6
+#define MAX_LABEL_LENGTH 7
+#define MAX_ALIGN 65536
+#define RELOCATION_TASK_SIZE 4096 // relocations patched per unit of parallel work
+#define LINK_STATE_MAGIC "LC2K-LINK-STATE"
+#define LINK_STATE_VERSION 1
+#define FIXED_WORD_WIDTH 11 // fits any int, so -i output can be patched in place
+#define PROFILE_MAGIC "LC2K-PROFILE"
+#define PROFILE_VERSION 1
 
 #define BITMASK_FOR_PARSING_MACHINE_CODE 0x00000007
 #define BITMASK_BITS_ZERO_TO_FIFTEEN 0xFFFF
+#define MAX_OFFSET 32767
+#define NOOP_INSTRUCTION (7 << 22)
+#define BEQ_OPCODE 4
+#define HALT_OPCODE 6
+
+#define OBJECT_MAGIC "LC2O"
+#define OBJECT_VERSION 1
+#define ARCHIVE_MAGIC "LC2A"
+#define ARCHIVE_VERSION 1
 
 typedef struct FileData FileData;
 typedef struct SymbolTableEntry SymbolTableEntry;
 typedef struct RelocationTableEntry RelocationTableEntry;
 typedef struct CombinedFiles CombinedFiles;
+typedef struct SymbolIndexEntry SymbolIndexEntry;
+typedef struct SymbolIndex SymbolIndex;
+typedef struct RelocationTask RelocationTask;
+typedef struct RelocationPool RelocationPool;
+typedef struct ParallelJob ParallelJob;
+typedef struct Scanner Scanner;
+typedef struct LinkSite LinkSite;
+typedef struct LinkState LinkState;
+typedef struct Archive Archive;
+typedef struct ArchiveExtraction ArchiveExtraction;
+typedef struct GcObject GcObject;
+typedef struct GcRegions GcRegions;
+typedef struct Profile Profile;
+typedef struct LayoutUnit LayoutUnit;
+typedef struct LinkOptions LinkOptions;
 
 struct SymbolTableEntry {
-    char label[7];
+    char label[MAX_LABEL_LENGTH];
     char location;
     int offset;
 };
 
 struct RelocationTableEntry {
     int offset;
-    char inst[7];
-    char label[7];
+    int kind; // RELOCATION_KIND, classified when the object is read
+    char inst[MAX_LABEL_LENGTH];
+    char label[MAX_LABEL_LENGTH];
     int file;
 };
 
+// Every table is sized from the object's header and allocated in one
+// block, see allocateFileData, so memory grows with the input and not with
+// a compile-time limit.
 struct FileData {
+    const char* fileName;
+    const char* error; // first problem found while reading, reported after all files are read
+    int errorLine;     // line of the error in a text object, 0 if none
+    struct stat status; // identity of the file when it was read, for -i
+    const unsigned char* archive; // mapping of an input that is an archive, which has no tables
+    size_t archiveSize;
     int textSize;
     int dataSize;
     int symbolTableSize;
     int relocationTableSize;
     int textStartingLine; // in final executible
     int dataStartingLine; // in final executible
-    int text[MAXSIZE];
-    int data[MAXSIZE];
-    SymbolTableEntry symbolTable[MAXSIZE];
-    RelocationTableEntry relocTable[MAXSIZE];
+    int textAlign; // required alignment of each section, in words
+    int dataAlign;
+    int* text;
+    int* data;
+    SymbolTableEntry* symbolTable;
+    RelocationTableEntry* relocTable;
+    int* textMap;   // final address of each text word
+    int* dataMap;   // final address of each data word
+    char* poolable; // data words the assembler marked as mergeable
 };
 
 struct CombinedFiles {
-    int text[MAXSIZE];
-    int data[MAXSIZE];
-    SymbolTableEntry     symTable[MAXSIZE];
-    RelocationTableEntry relocTable[MAXSIZE];
+    int* text;
+    int* data;
+    int* poolSlots;   // open addressed on a constant's value: 1 + the data index of
+                      // the first mergeable word holding it, 0 for an empty slot
+    int poolCapacity; // a power of two at least twice the data size
+    int textSize;
+    int dataSize;
+};
+
+// One slot per defined global symbol across every object, open addressed
+// on the label's hash. Built once before layout, so duplicates are caught
+// on insertion, and filled with final addresses once layout is done.
+struct SymbolIndexEntry {
+    const char* label; // NULL for an empty slot
+    int file;          // defining object, -1 for Stack
+    int symbol;        // entry in that object's symbol table
+    int address;       // final absolute address
+};
+
+struct SymbolIndex {
+    SymbolIndexEntry* slots;
+    int capacity; // a power of two at least twice the symbol count
+};
+
+// A run of one object's relocations. Every relocation patches its own word
+// of the combined image, so tasks run in any order on any thread; a failing
+// task keeps its first error and the earliest task's error is reported,
+// matching what a serial link would print.
+struct RelocationTask {
+    int file;
+    int first;
+    int last;
+    const char* errorFormat;
+    const char* errorLabel;
+};
+
+struct RelocationPool {
+    struct FileData* files;
+    struct CombinedFiles* combined;
+    struct SymbolIndex* symbols;
+    struct RelocationTask* tasks;
+};
+
+// Independent tasks claimed in order from a shared counter by one thread
+// per online processor, see runParallel.
+struct ParallelJob {
+    void (*run)(void* context, int task);
+    void* context;
+    int taskCount;
+    atomic_int nextTask;
+};
+
+// A word in one object patched with the address of a global label defined
+// in another, so -i can re-patch it when that label moves.
+struct LinkSite {
+    int file;
+    int address;  // of the patched word in the executable
+    int kind;     // RELOCATION_KIND
+    int highBits; // opcode and registers of a patched lw or sw
+    char label[MAX_LABEL_LENGTH];
+};
+
+// What -i keeps from the previous link in <output>.state: each object's
+// layout and file identity, the symbol index with final addresses, and the
+// cross-object relocation sites. The output itself is written with fixed
+// width words so any word can be rewritten in place.
+struct LinkState {
     int textSize;
     int dataSize;
-    int symTableSize;
-    int relocTableSize;
+    struct FileData* files; // layout and status only, no tables
+    int* exportCounts;      // defined globals per object
+    struct SymbolIndex symbols;
+    char (*labels)[MAX_LABEL_LENGTH];
+    struct LinkSite* sites;
+    int siteCount;
+};
+
+// An archive input, mapped whole. Only its header, member table and symbol
+// index are read up front; a member is parsed once it is extracted.
+struct Archive {
+    const char* fileName;
+    const unsigned char* bytes;
+    const struct ArchiveMember* members;
+    uint32_t memberCount;
+    const char* strings;
+    uint32_t stringsSize;
+    struct SymbolIndex symbols; // defined global -> member, in the file field
+    char* extracted;
+};
+
+// members read by one round of extractArchiveMembers, one task each
+struct ArchiveExtraction {
+    struct FileData* files;
+    struct Archive** archives; // archive of each task
+    uint32_t* members;         // member of each task
+    int firstFile;             // where the round's members go in files
+};
+
+// An object split into regions for --gc-sections. A region runs from one
+// label, global or referenced by a relocation, to the next, so each is a
+// function or data item as far as the linker can tell.
+struct GcObject {
+    int* textRegion; // region of each text word, numbered across all objects
+    int* dataRegion;
+    int* textRelocation; // relocation patching each word, -1 if none
+    int* dataRelocation;
+    int keepAll; // object whose layout cannot change, see findRegions
+};
+
+// where each region of a --gc-sections pass lies
+struct GcRegions {
+    int* file;
+    int* start;
+    char* isData;
+    int count;
+};
+
+// per-address counts written by the simulator's -profile, indexed by the
+// address in the default layout of the same link
+struct Profile {
+    long long* executions;
+    long long* accesses; // loads and stores
+    long long* misses;
+    int size;
+};
+
+// What --profile places as one piece: a chain of text regions that fall
+// through into each other, or a single data region. Regions are those of
+// --gc-sections, see findRegions.
+struct LayoutUnit {
+    int first; // of its regions in the placement order
+    int count;
+    int words;
+    int group; // 0 stays in place, 1 hot, 2 cold
+    int index; // in the default layout
+    long long heat; // executions of text, accesses of data
+    long long misses;
+};
+
+// the options that change the linked image, see linkObjects
+struct LinkOptions {
+    int pool;
+    int gcSections;
+    char** keep;
+    int keepCount;
+    const char* profileName;
+};
+
+// position in a memory-mapped text object
+struct Scanner {
+    const char* cursor;
+    const char* end;
+    int line;
+};
+
+// binary object layout written by the assembler's -b option
+enum SECTION_TYPE {
+    SECTION_TEXT = 1,
+    SECTION_DATA,
+    SECTION_SYMBOLS,
+    SECTION_RELOCATIONS,
+    SECTION_STRINGS,
+    SECTION_POOL,
+};
+
+enum RELOCATION_KIND {
+    RELOCATE_LW,
+    RELOCATE_SW,
+    RELOCATE_FILL,
+    RELOCATE_LITERAL,
+};
+
+// relocation names in the text format, indexed by RELOCATION_KIND
+static const char* relocationNames[] = { "lw", "sw", ".fill", ".lit" };
+
+// steps of a link timed by --timing; a phase may run in several pieces
+enum LINK_PHASE {
+    PHASE_INCREMENTAL,
+    PHASE_READ,
+    PHASE_VALIDATE,
+    PHASE_LAYOUT,
+    PHASE_RESOLVE,
+    PHASE_RELOCATE,
+    PHASE_WRITE,
+    PHASE_COUNT,
+};
+
+static const char* phaseNames[] = { "incremental", "read", "validate", "layout", "resolve", "relocate", "write" };
+
+// seconds spent in each phase, indexed by LINK_PHASE
+double phaseSeconds[PHASE_COUNT];
+char phaseRan[PHASE_COUNT];
+
+// lc2kLink links without reporting what pooling and --gc-sections saved
+static int quiet = 0;
+
+struct ObjectHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t sectionCount;
+    uint32_t reserved;
+};
+
+struct SectionHeader {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t count;
+    uint32_t align;
+};
+
+struct SymbolRecord {
+    uint32_t name;
+    int32_t offset;
+    uint8_t type;
+    uint8_t padding[3];
+};
+
+struct RelocationRecord {
+    int32_t offset;
+    uint32_t label;
+    uint8_t kind;
+    uint8_t padding[3];
+};
+
+// Archive layout written by linker -a: the header, the member table, the
+// symbol index, the string table, then each member's object file verbatim.
+// Every part starts on a 4-byte boundary.
+struct ArchiveHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t memberCount;
+    uint32_t symbolCount;
+    uint32_t stringsOffset;
+    uint32_t stringsSize;
+};
+
+struct ArchiveMember {
+    uint32_t name; // string table offset
+    uint32_t offset;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+// a global defined by a member
+struct ArchiveSymbol {
+    uint32_t name;
+    uint32_t member;
 };
 
-int validateDuplicates(struct FileData* fileData, int totalFiles);
-int checkDuplicateGlobalLabels(struct FileData* fileData1, struct FileData* fileData2);
-int validateReserved(struct FileData* fileData, int totalFiles, const char* reservedLabel);
-int isGlobalLabel(char* label);
-int needsResolution(const char* label, struct FileData* fileData, int objectFileIndex);
-int resolveGlobalLabel(const char* label, struct FileData* files, int totalFiles,
-    int objectFileIndex, struct CombinedFiles* combined);
-void printOutput(struct CombinedFiles* combined, FILE *outputFile);
+void readObjectTask(void* context, int fileIndex);
+void validateObjectTask(void* context, int fileIndex);
+int readObjectFile(struct FileData* fileData, int fileIndex);
+int readObjectBytes(const unsigned char* bytes, size_t size, struct FileData* fileData, int fileIndex);
+void reportObjectErrors(struct FileData* files, int first, int count);
+static void exitWithError(const char* format, ...);
+void createArchive(const char* archiveName, char** memberNames, int memberCount);
+int openArchive(struct FileData* input, struct Archive* archive);
+int extractArchiveMembers(struct FileData** files, int totalFiles);
+void readMemberTask(void* context, int task);
+void writeAligned(FILE* outputFile, const void* bytes, size_t size);
+void collectGarbage(struct FileData* files, int totalFiles, char** keep, int keepCount);
+void findRegions(struct FileData* fileData, int fileIndex, struct GcObject* object, struct GcRegions* regions);
+int localTarget(struct FileData* fileData, int relocation);
+int regionOfLocal(struct FileData* fileData, struct GcObject* object, int address);
+void markRegion(char* live, int* worklist, int* worklistSize, int region);
+int endsFlow(struct FileData* fileData, struct GcObject* object, int address);
+void profileLayout(struct FileData* files, int totalFiles, struct CombinedFiles* combined, int pool,
+    const char* profileName, struct SymbolIndex* symbols);
+const char* reorderByProfile(struct FileData* files, int totalFiles, struct CombinedFiles* combined, int pool,
+    struct Profile* profile, struct SymbolIndex* symbols, int* hotCounts, int* unitCounts);
+void readProfile(const char* profileName, struct Profile* profile);
+int compareLayoutUnits(const void* first, const void* second);
+int lwTargetsInRange(struct FileData* files, int totalFiles, struct SymbolIndex* symbols);
+void compactObject(struct FileData* fileData, int fileIndex, struct GcObject* object, char* live, struct SymbolIndex* symbols);
+int relocateLocal(struct FileData* fileData, int* textMap, int textSize, int address);
+int allocateFileData(struct FileData* fileData);
+int validateObject(struct FileData* fileData);
+int objectError(struct FileData* fileData, int line, const char* message);
+int readTextObject(const char* bytes, size_t size, struct FileData* fileData, int fileIndex);
+void skipSpaces(struct Scanner* scanner);
+int scanInteger(struct Scanner* scanner, int* value);
+int scanWide(struct Scanner* scanner, long long* value);
+int matchRestOfLine(struct Scanner* scanner, const char* text);
+int scanToken(struct Scanner* scanner, char* token, int size);
+int atEndOfLine(struct Scanner* scanner);
+int endLine(struct Scanner* scanner);
+int readBinaryObject(const unsigned char* bytes, size_t size, struct FileData* fileData, int fileIndex);
+const char* lookupString(const char* strings, uint32_t stringsSize, uint32_t offset);
+void buildSymbolIndex(struct FileData* files, int totalFiles, struct SymbolIndex* index);
+void allocateSymbolIndex(struct SymbolIndex* index, int count);
+void resolveSymbolIndex(struct FileData* files, struct CombinedFiles* combined, struct SymbolIndex* index);
+static uint32_t hashBytes(const void* bytes, size_t length);
+SymbolIndexEntry* findSymbolSlot(struct SymbolIndex* index, const char* label);
+SymbolIndexEntry* lookupSymbol(struct SymbolIndex* index, const char* label);
+int isGlobalLabel(const char* label);
+void printOutput(struct CombinedFiles* combined, FILE *outputFile, int width);
+const char* incrementalLink(struct FileData* files, int totalFiles, const char* outFileString, const char* stateName,
+    int* repatched);
+int readLinkState(const char* stateName, struct FileData* files, int totalFiles, struct LinkState* state);
+void writeLinkState(const char* stateName, struct FileData* files, int totalFiles,
+    struct CombinedFiles* combined, struct SymbolIndex* symbols, struct LinkSite* sites, int siteCount);
+int collectLinkSites(struct FileData* files, int totalFiles, const char* include, struct CombinedFiles* combined,
+    struct SymbolIndex* symbols, struct LinkSite** sites, int siteCount);
+int sameFile(struct stat* first, struct stat* second);
+int writeWords(int descriptor, const int* words, int count, int address);
+char* linkStateName(const char* outFileString);
+int offsetInRange(int offset);
+int relocationKind(const char* inst);
+void applyRelocations(struct FileData* files, int totalFiles, struct CombinedFiles* combined, struct SymbolIndex* symbols);
+void runRelocationTask(void* context, int task);
+void runParallel(void (*run)(void* context, int task), void* context, int taskCount);
+void* parallelWorker(void* argument);
+void layoutText(struct FileData* files, int totalFiles, struct CombinedFiles* combined);
+int layoutData(struct FileData* files, int totalFiles, struct CombinedFiles* combined, int pool);
+int placeDataWord(struct FileData* fileData, int word, struct CombinedFiles* combined, int pool);
+int* findPoolSlot(struct CombinedFiles* combined, int value);
+int alignUp(int address, int align);
+double monotonicSeconds(void);
+void endPhase(int phase, double* start);
+void printTiming(int json);
+void writeLinkMap(const char* mapName, const char* outFileString, struct FileData* files, int totalFiles,
+    struct CombinedFiles* combined, struct SymbolIndex* symbols);
+void writeRuns(FILE* mapFile, const char* section, const int* map, int size);
+int compareSymbolAddresses(const void* first, const void* second);
+void linkObjects(struct FileData* files, int totalFiles, struct LinkOptions* options,
+    struct CombinedFiles* combined, struct SymbolIndex* symbols, double* phaseStart);
 
+#ifndef LC2K_LIBRARY
 int main(int argc, char *argv[])
 {
     char *inFileString, *outFileString;
-    FILE *inFilePtr, *outFilePtr;
-    int i, j;
+    FILE *outFilePtr;
+    int i;
+    int argIndex = 1;
+    int pool = 0;
+    int incremental = 0;
+    int gcSections = 0;
+    const char* profileName = NULL;
+    const char* mapName = NULL;
+    int timing = 0; // 1 for text, 2 for JSON
+    char** keep = malloc(argc * sizeof(char*));
+    int keepCount = 0;
+
+    if (argc > 3 && !strcmp(argv[1], "-a")) {
+        createArchive(argv[2], argv + 3, argc - 3);
+        exit(0);
+    }
+
+    for (; argIndex < argc && argv[argIndex][0] == '-'; ++argIndex) {
+        if (!strcmp(argv[argIndex], "-p")) {
+            pool = 1;
+        } else if (!strcmp(argv[argIndex], "-i")) {
+            incremental = 1;
+        } else if (!strcmp(argv[argIndex], "--gc-sections")) {
+            gcSections = 1;
+        } else if (!strncmp(argv[argIndex], "--keep=", 7)) {
+            keep[keepCount++] = argv[argIndex] + 7;
+        } else if (!strncmp(argv[argIndex], "--profile=", 10)) {
+            profileName = argv[argIndex] + 10;
+        } else if (!strncmp(argv[argIndex], "--map=", 6)) {
+            mapName = argv[argIndex] + 6;
+        } else if (!strcmp(argv[argIndex], "--timing")) {
+            timing = 1;
+        } else if (!strcmp(argv[argIndex], "--timing=json")) {
+            timing = 2;
+        } else {
+            break;
+        }
+    }
 
-    if (argc <= 2) {
-        printf("error: usage: %s <obj file> ... <output-exe-file>\n",
-            argv[0]);
+    if (argc - argIndex < 2) {
+        printf("error: usage: %s [-p] [-i] [--gc-sections [--keep=<global label>]...] [--profile=<file>] [--map=<file>]\n"
+            "       [--timing[=json]] <obj or archive file> ... <output-exe-file>\n"
+            "       %s -a <archive-file> <obj file> ...\n", argv[0], argv[0]);
         exit(1);
     }
 
     outFileString = argv[argc - 1];
+    int totalFiles = argc - argIndex - 1;
+    FileData* files = calloc(totalFiles, sizeof(FileData));
+    for (i = 0; i < totalFiles; i++) {
+        inFileString = argv[argIndex + i];
+        files[i].fileName = inFileString;
+    }
+
+    char* stateName = linkStateName(outFileString);
+    double phaseStart = monotonicSeconds();
+    if (incremental && pool) {
+        // pooled words are shared between objects, so no object can be
+        // re-patched on its own
+        printf("incremental link: constant pooling needs a full link\n");
+        unlink(stateName);
+        incremental = 0;
+    } else if (incremental && gcSections) {
+        // an edit to one object can change what is live in every other
+        printf("incremental link: --gc-sections needs a full link\n");
+        unlink(stateName);
+        incremental = 0;
+    } else if (incremental && profileName != NULL) {
+        // hot words from every object are interleaved
+        printf("incremental link: --profile needs a full link\n");
+        unlink(stateName);
+        incremental = 0;
+    } else if (incremental && mapName != NULL) {
+        // the map lists every object, but unchanged objects are not read
+        printf("incremental link: --map needs a full link\n");
+        unlink(stateName);
+        incremental = 0;
+    } else if (incremental) {
+        int repatched = 0;
+        const char* reason = incrementalLink(files, totalFiles, outFileString, stateName, &repatched);
+        endPhase(PHASE_INCREMENTAL, &phaseStart);
+        if (reason == NULL) {
+            printf("incremental link: %d of %d objects re-patched\n", repatched, totalFiles);
+            if (timing) {
+                printTiming(timing == 2);
+            }
+            free(stateName);
+            exit(0);
+        }
+        printf("incremental link: %s, relinking everything\n", reason);
+        free(files);
+        files = calloc(totalFiles, sizeof(FileData));
+        for (i = 0; i < totalFiles; i++) {
+            files[i].fileName = argv[argIndex + i];
+        }
+    }
 
     outFilePtr = fopen(outFileString, "w");
     if (outFilePtr == NULL) {
@@ -86,73 +541,24 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    FileData files[MAXFILES];
-
     //Reads in all files and combines into master
-    for (i = 0; i < argc - 2; i++) {
-        inFileString = argv[i + 1];
-
-        inFilePtr = fopen(inFileString, "r");
-
-        if (inFilePtr == NULL) {
-            printf("error in opening %s\n", inFileString);
-            exit(1);
-        }
-
-        char line[MAXLINELENGTH];
-        int sizeText, sizeData, sizeSymbol, sizeReloc;
-
-        // parse first line
-        fgets(line, MAXSIZE, inFilePtr);
-        sscanf(line, "%d %d %d %d",
-            &sizeText, &sizeData, &sizeSymbol, &sizeReloc);
-
-        files[i].textSize = sizeText;
-        files[i].dataSize = sizeData;
-        files[i].symbolTableSize = sizeSymbol;
-        files[i].relocationTableSize = sizeReloc;
-
-        // read in text
-        int instr;
-        for (j = 0; j < sizeText; j++) {
-            fgets(line, MAXLINELENGTH, inFilePtr);
-            instr = atoi(line);
-            files[i].text[j] = instr;
-        }
-
-        // read in data
-        int data;
-        for (j = 0; j < sizeData; j++) {
-            fgets(line, MAXLINELENGTH, inFilePtr);
-            data = atoi(line);
-            files[i].data[j] = data;
-        }
-
-        // read in the symbol table
-        char label[7];
-        char type;
-        int addr;
-        for (j = 0; j < sizeSymbol; j++) {
-            fgets(line, MAXLINELENGTH, inFilePtr);
-            sscanf(line, "%s %c %d",
-                label, &type, &addr);
-            files[i].symbolTable[j].offset = addr;
-            strcpy(files[i].symbolTable[j].label, label);
-            files[i].symbolTable[j].location = type;
-        }
-
-        // read in relocation table
-        char opcode[7];
-        for (j = 0; j < sizeReloc; j++) {
-            fgets(line, MAXLINELENGTH, inFilePtr);
-            sscanf(line, "%d %s %s",
-                &addr, opcode, label);
-            files[i].relocTable[j].offset = addr;
-            strcpy(files[i].relocTable[j].inst, opcode);
-            strcpy(files[i].relocTable[j].label, label);
-            files[i].relocTable[j].file = i;
-        }
-        fclose(inFilePtr);
+    runParallel(readObjectTask, files, totalFiles);
+    endPhase(PHASE_READ, &phaseStart);
+    runParallel(validateObjectTask, files, totalFiles);
+    reportObjectErrors(files, 0, totalFiles);
+    endPhase(PHASE_VALIDATE, &phaseStart);
+    int archiveCount = 0;
+    for (i = 0; i < totalFiles; i++) {
+        archiveCount += files[i].archive != NULL;
+    }
+    // members are validated as they are read
+    totalFiles = extractArchiveMembers(&files, totalFiles);
+    endPhase(PHASE_READ, &phaseStart);
+    if (incremental && archiveCount > 0) {
+        // members have no file of their own to watch for changes
+        printf("incremental link: archive members need a full link\n");
+        unlink(stateName);
+        incremental = 0;
     } // end reading files
 
     // *** INSERT YOUR CODE BELOW ***
@@ -160,224 +566,2237 @@ int main(int argc, char *argv[])
     //    Happy coding!!!
 
     struct CombinedFiles combined = { 0 };
-    int totalFiles = argc - 2;
+    struct SymbolIndex symbols = { 0 };
+    struct LinkOptions options = { pool, gcSections, keep, keepCount, profileName };
+    linkObjects(files, totalFiles, &options, &combined, &symbols, &phaseStart);
 
-    if (!validateDuplicates(files, totalFiles)) {
-        printf("error: duplicate global labels found \n");
-        exit(1);
+    printOutput(&combined, outFilePtr, incremental ? FIXED_WORD_WIDTH : 0);
+    if (incremental) {
+        struct LinkSite* sites = NULL;
+        int siteCount = collectLinkSites(files, totalFiles, NULL, &combined, &symbols, &sites, 0);
+        writeLinkState(stateName, files, totalFiles, &combined, &symbols, sites, siteCount);
+    }
+    free(stateName);
+    if (mapName != NULL) {
+        writeLinkMap(mapName, outFileString, files, totalFiles, &combined, &symbols);
+    }
+    endPhase(PHASE_WRITE, &phaseStart);
+    if (timing) {
+        printTiming(timing == 2);
     }
+} // end main
+#endif
 
-    if (!validateReserved(files, totalFiles, "Stack")) {
-        printf("error: reserved label Stack used \n");
-        exit(1);
+// Lays out and relocates objects that have been read and validated, for
+// main and for lc2kLink. Each step is charged to its --timing phase.
+void linkObjects(struct FileData* files, int totalFiles, struct LinkOptions* options,
+    struct CombinedFiles* combined, struct SymbolIndex* symbols, double* phaseStart) {
+    if (options->gcSections) {
+        collectGarbage(files, totalFiles, options->keep, options->keepCount);
     }
+    endPhase(PHASE_LAYOUT, phaseStart);
 
-    combined.textSize = 0;
-    combined.dataSize = 0;
+    buildSymbolIndex(files, totalFiles, symbols);
+    endPhase(PHASE_RESOLVE, phaseStart);
 
-    for (int i = 0; i < totalFiles; ++i) {
-        combined.textSize += files[i].textSize;
-        combined.dataSize += files[i].dataSize;
-    }
+    layoutText(files, totalFiles, combined);
 
-    int textOffset = 0;
-    int dataOffset = 0;
-    for (int i = 0; i < totalFiles; ++i) {
-        memcpy(combined.text + textOffset, files[i].text, files[i].textSize * sizeof(int));
-        textOffset += files[i].textSize;
+    int wordsSaved = layoutData(files, totalFiles, combined, options->pool);
+    if (options->pool && !quiet) {
+        printf("constant pool: %d words saved\n", wordsSaved);
+    }
 
-        memcpy(combined.data + dataOffset, files[i].data, files[i].dataSize * sizeof(int));
-        dataOffset += files[i].dataSize;
+    if (options->profileName != NULL) {
+        profileLayout(files, totalFiles, combined, options->pool, options->profileName, symbols);
     }
+    endPhase(PHASE_LAYOUT, phaseStart);
 
-    textOffset = 0;
-    dataOffset = 0;
+    resolveSymbolIndex(files, combined, symbols);
+    endPhase(PHASE_RESOLVE, phaseStart);
 
-    int startDataOffsetObj = combined.textSize;
+    applyRelocations(files, totalFiles, combined, symbols);
+    endPhase(PHASE_RELOCATE, phaseStart);
+}
 
-    for (int i = 0; i < totalFiles; ++i) {
-        for (int j = 0; j < files[i].relocationTableSize; j++) {
-            if (strcmp(files[i].relocTable[j].inst, ".fill")) {
-                int instruction = combined.text[textOffset + files[i].relocTable[j].offset];
-                int opcode = instruction >> 22 & BITMASK_FOR_PARSING_MACHINE_CODE;
-                int arg0 = instruction >> 19 & BITMASK_FOR_PARSING_MACHINE_CODE;
-                int arg1 = instruction >> 16 & BITMASK_FOR_PARSING_MACHINE_CODE;
-                int arg2 = instruction & BITMASK_BITS_ZERO_TO_FIFTEEN;
-                //printf("instruction 0 %d\n", instruction);
-                if (!isGlobalLabel(files[i].relocTable[j].label) || (!needsResolution(files[i].relocTable[j].label, files, i))) {
-                    if (arg2 >= files[i].textSize) {
-                        int offsetObjectFile = arg2 - files[i].textSize;
-                        int labelOffset = startDataOffsetObj + offsetObjectFile;
-                        labelOffset &= 0xFFFF;
-                        instruction = opcode << 22 | arg0 << 19 | arg1 << 16 | labelOffset;
-                        combined.text[textOffset + files[i].relocTable[j].offset] = instruction;
-                    } else {
-                        int offsetObjectFile = arg2 + textOffset;
-                        offsetObjectFile &= 0xFFFF;
-                        instruction = opcode << 22 | arg0 << 19 | arg1 << 16 | offsetObjectFile;
-                        combined.text[textOffset + files[i].relocTable[j].offset] = instruction;
-                    }
-                } else {
-                    //printf("resolving %s\n", files[i].relocTable[j].label);
-                    int globalLabelOffset = resolveGlobalLabel(files[i].relocTable[j].label, files, totalFiles, i, &combined);
-                    //printf("offset %d\n", globalLabelOffset);
-                    if (globalLabelOffset == -1) {
-                        printf("error resolving global label %s\n", files[i].relocTable[j].label);
-                        exit(1);
-                    }
-                    globalLabelOffset &= 0xFFFF;
-                    //printf("instruction %d\n", instruction);
-                    instruction = opcode << 22 | arg0 << 19 | arg1 << 16 | globalLabelOffset;
-                    //printf("instruction %d\n", instruction);
-                    combined.text[textOffset + files[i].relocTable[j].offset] = instruction;
-                }
-            } else {
-                int offset = files[i].relocTable[j].offset;
-                if (!isGlobalLabel(files[i].relocTable[j].label) || !needsResolution(files[i].relocTable[j].label, files, i)) {
-                    int fillValue = combined.data[dataOffset + offset];
-                    if (fillValue >= files[i].textSize) {
-                        int offsetObjectFile = fillValue - files[i].textSize + startDataOffsetObj;
-                        combined.data[dataOffset + offset] = offsetObjectFile;
-                    } else {
-                        combined.data[dataOffset + offset] += textOffset;
-                    }
-                } else {
-                    int globalLabelOffset = resolveGlobalLabel(files[i].relocTable[j].label, files, totalFiles, i, &combined);
-                    if (globalLabelOffset == -1) {
-                        printf("error resolving global label %s\n", files[i].relocTable[j].label);
-                        exit(1);
-                    }
-                    globalLabelOffset &= 0xFFFF;
-                    combined.data[dataOffset + offset] = globalLabelOffset;
-                }
+#ifdef LC2K_LIBRARY
+// Links binary or text objects held in memory into one image, as the
+// command line would without -i. Objects are named by their position in
+// error messages; archives are not accepted.
+int lc2kLink(const LC2KObject* objects, int count, int flags, LC2KImage* image,
+    char* error, size_t errorSize) {
+    // everything the link allocates hangs off these heap blocks, so both
+    // exits below can free it; locals changed after setjmp would not
+    // survive the longjmp
+    struct FileData* files = calloc(count + 1, sizeof(FileData));
+    char* names = malloc((size_t) (count + 1) * 24);
+    struct CombinedFiles* combined = calloc(1, sizeof(CombinedFiles));
+    struct SymbolIndex* symbols = calloc(1, sizeof(SymbolIndex));
+    struct LinkOptions options = { (flags & LC2K_POOL) != 0, (flags & LC2K_GC_SECTIONS) != 0, NULL, 0, NULL };
+    double phaseStart = monotonicSeconds();
+    int wasQuiet = quiet;
+    image->words = NULL;
+    image->size = 0;
+    quiet = 1;
+    lc2kMessage[0] = '\0';
+    if (setjmp(lc2kErrorJump)) {
+        lc2kCopyMessage(error, errorSize);
+    } else {
+        for (int i = 0; i < count; ++i) {
+            files[i].fileName = names + i * 24;
+            sprintf(names + i * 24, "object %d", i);
+            if (readObjectBytes(objects[i].bytes, objects[i].size, &files[i], i)) {
+                validateObject(&files[i]);
             }
         }
-        textOffset += files[i].textSize;
-        dataOffset += files[i].dataSize;
-        startDataOffsetObj += files[i].dataSize;
+        reportObjectErrors(files, 0, count);
+        linkObjects(files, count, &options, combined, symbols, &phaseStart);
+
+        image->size = combined->textSize + combined->dataSize;
+        image->words = malloc((image->size + 1) * sizeof(int));
+        memcpy(image->words, combined->text, combined->textSize * sizeof(int));
+        memcpy(image->words + combined->textSize, combined->data, combined->dataSize * sizeof(int));
     }
-    printOutput(&combined, outFilePtr);
-} // end main
 
-int validateDuplicates(struct FileData* fileData, int totalFiles) {
-    for (int i = 0; i < totalFiles; ++i) {
-        for (int j = i + 1; j < totalFiles; ++j) {
-            //dupe found
-            if (!checkDuplicateGlobalLabels(&fileData[i], &fileData[j])) {
-                return 0;
-            }
-        }
+    for (int i = 0; i < count; ++i) {
+        free(files[i].text);
+    }
+    free(files);
+    free(names);
+    free(combined->text);
+    free(combined->data);
+    free(combined->poolSlots);
+    free(combined);
+    free(symbols->slots);
+    free(symbols);
+    quiet = wasQuiet;
+    // the image is only allocated once nothing can fail
+    return image->words == NULL;
+}
+
+void lc2kFreeImage(LC2KImage* image) {
+    free(image->words);
+    image->words = NULL;
+    image->size = 0;
+}
+#endif
+
+void readObjectTask(void* context, int fileIndex) {
+    struct FileData* files = context;
+    readObjectFile(&files[fileIndex], fileIndex);
+}
+
+void validateObjectTask(void* context, int fileIndex) {
+    struct FileData* files = context;
+    if (files[fileIndex].error == NULL && files[fileIndex].archive == NULL) {
+        validateObject(&files[fileIndex]);
     }
-    return 1;
 }
 
-int checkDuplicateGlobalLabels(struct FileData* fileData1, struct FileData* fileData2) {
-    for (int i = 0; i < fileData1->symbolTableSize; ++i) {
-        if (fileData1->symbolTable[i].location == 'U') {
+// prints the first error of files first..first+count-1 and exits, if any
+void reportObjectErrors(struct FileData* files, int first, int count) {
+    for (int i = first; i < first + count; i++) {
+        if (files[i].error == NULL) {
             continue;
         }
-        for (int j = 0; j < fileData2->symbolTableSize; ++j) {
-            if (fileData2->symbolTable[j].location == 'U') {
-                continue;
-            }
+        if (files[i].errorLine > 0) {
+            exitWithError("error: %s:%d: %s\n", files[i].fileName, files[i].errorLine, files[i].error);
+        }
+        exitWithError("error: %s: %s\n", files[i].fileName, files[i].error);
+    }
+}
 
-            // duplicate found
-            if (!strcmp(fileData1->symbolTable[i].label, fileData2->symbolTable[j].label)) {
-                return 0;
-            }
+// Prints an error and exits; inside the library the message goes back to
+// the lc2k call instead, see lc2k.h.
+static void exitWithError(const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+#ifdef LC2K_LIBRARY
+    lc2kFail(format, arguments);
+#endif
+    vprintf(format, arguments);
+    va_end(arguments);
+    exit(1);
+}
+
+// Maps the object and parses it in place, as the binary format when it
+// starts with the magic and as the decimal text format otherwise. An
+// archive stays mapped for extractArchiveMembers. Each file is read by its
+// own task, so problems are recorded, not printed.
+int readObjectFile(struct FileData* fileData, int fileIndex) {
+    int descriptor = open(fileData->fileName, O_RDONLY);
+    struct stat info;
+    if (descriptor < 0 || fstat(descriptor, &info) != 0) {
+        if (descriptor >= 0) {
+            close(descriptor);
         }
+        return objectError(fileData, 0, "cannot open object file");
     }
-    //none
-    return 1;
+    size_t size = info.st_size;
+    if (size == 0) {
+        close(descriptor);
+        return objectError(fileData, 1, "malformed header");
+    }
+    fileData->status = info;
+    void* bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (bytes == MAP_FAILED) {
+        return objectError(fileData, 0, "cannot map object file");
+    }
+    if (size >= sizeof(struct ArchiveHeader) && !memcmp(bytes, ARCHIVE_MAGIC, 4)) {
+        fileData->archive = bytes;
+        fileData->archiveSize = size;
+        return 1;
+    }
+    int success = readObjectBytes(bytes, size, fileData, fileIndex);
+    munmap(bytes, size);
+    return success;
 }
 
-int validateReserved(struct FileData* fileData, int totalFiles, const char* reservedLabel) {
-    for (int i = 0; i < totalFiles; ++i) {
-        for (int j = 0; j < fileData[i].symbolTableSize; ++j) {
-            if (fileData[i].symbolTable[j].location == 'U') {
+int readObjectBytes(const unsigned char* bytes, size_t size, struct FileData* fileData, int fileIndex) {
+    if (size >= sizeof(struct ObjectHeader) && !memcmp(bytes, OBJECT_MAGIC, 4)) {
+        return readBinaryObject(bytes, size, fileData, fileIndex) ||
+            objectError(fileData, 0, "malformed binary object");
+    }
+    return readTextObject((const char*) bytes, size, fileData, fileIndex);
+}
+
+// Bundles object files into an archive whose symbol index lists every
+// global each member defines, so a link can pick members without parsing
+// them. Members are stored verbatim under their base names.
+void createArchive(const char* archiveName, char** memberNames, int memberCount) {
+    struct FileData* members = calloc(memberCount, sizeof(FileData));
+    for (int i = 0; i < memberCount; ++i) {
+        members[i].fileName = memberNames[i];
+    }
+    runParallel(readObjectTask, members, memberCount);
+    runParallel(validateObjectTask, members, memberCount);
+    reportObjectErrors(members, 0, memberCount);
+
+    int symbolCount = 0;
+    for (int i = 0; i < memberCount; ++i) {
+        if (members[i].archive != NULL) {
+            exitWithError("error: %s: archives cannot be nested\n", members[i].fileName);
+        }
+        for (int j = 0; j < members[i].symbolTableSize; ++j) {
+            symbolCount += members[i].symbolTable[j].location != 'U';
+        }
+    }
+
+    // a label defined twice could never be linked, so catch it now
+    struct SymbolIndex index = { 0 };
+    allocateSymbolIndex(&index, symbolCount);
+    uint32_t stringsCapacity = 64;
+    uint32_t stringsSize = 0;
+    char* strings = malloc(stringsCapacity);
+    struct ArchiveMember* table = calloc(memberCount + 1, sizeof(struct ArchiveMember));
+    struct ArchiveSymbol* symbols = calloc(symbolCount + 1, sizeof(struct ArchiveSymbol));
+    int symbol = 0;
+    for (int i = 0; i < memberCount; ++i) {
+        const char* baseName = strrchr(members[i].fileName, '/');
+        baseName = baseName == NULL ? members[i].fileName : baseName + 1;
+        table[i].name = stringsSize;
+        uint32_t length = strlen(baseName) + 1;
+        while (stringsSize + length > stringsCapacity) {
+            stringsCapacity *= 2;
+            strings = realloc(strings, stringsCapacity);
+        }
+        memcpy(strings + stringsSize, baseName, length);
+        stringsSize += length;
+        table[i].size = members[i].status.st_size;
+
+        for (int j = 0; j < members[i].symbolTableSize; ++j) {
+            SymbolTableEntry* entry = &members[i].symbolTable[j];
+            if (entry->location == 'U') {
                 continue;
             }
-            //reserved found
-            if (!strcmp(fileData[i].symbolTable[j].label, reservedLabel)) {
-                return 0;
+            SymbolIndexEntry* slot = findSymbolSlot(&index, entry->label);
+            if (slot->label != NULL) {
+                exitWithError("error: duplicate global label %s in %s and %s\n", entry->label,
+                    members[slot->file].fileName, members[i].fileName);
+            }
+            slot->label = entry->label;
+            slot->file = i;
+            symbols[symbol].member = i;
+            symbols[symbol].name = stringsSize;
+            length = strlen(entry->label) + 1;
+            while (stringsSize + length > stringsCapacity) {
+                stringsCapacity *= 2;
+                strings = realloc(strings, stringsCapacity);
             }
+            memcpy(strings + stringsSize, entry->label, length);
+            stringsSize += length;
+            symbol++;
         }
     }
-    //none found
-    return 1;
+
+    struct ArchiveHeader header = { { 'L', 'C', '2', 'A' }, ARCHIVE_VERSION, 0, memberCount, symbolCount, 0, stringsSize };
+    header.stringsOffset = sizeof(header) + memberCount * sizeof(struct ArchiveMember) +
+        symbolCount * sizeof(struct ArchiveSymbol);
+    uint32_t offset = alignUp(header.stringsOffset + stringsSize, 4);
+    for (int i = 0; i < memberCount; ++i) {
+        table[i].offset = offset;
+        offset = alignUp(offset + table[i].size, 4);
+    }
+
+    FILE* archiveFile = fopen(archiveName, "wb");
+    if (archiveFile == NULL) {
+        exitWithError("error in opening %s\n", archiveName);
+    }
+    fwrite(&header, sizeof(header), 1, archiveFile);
+    fwrite(table, sizeof(struct ArchiveMember), memberCount, archiveFile);
+    fwrite(symbols, sizeof(struct ArchiveSymbol), symbolCount, archiveFile);
+    writeAligned(archiveFile, strings, stringsSize);
+    for (int i = 0; i < memberCount; ++i) {
+        int descriptor = open(members[i].fileName, O_RDONLY);
+        void* bytes = table[i].size == 0 ? NULL : mmap(NULL, table[i].size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (descriptor < 0 || bytes == MAP_FAILED) {
+            exitWithError("error in opening %s\n", members[i].fileName);
+        }
+        writeAligned(archiveFile, bytes, table[i].size);
+        munmap(bytes, table[i].size);
+        close(descriptor);
+    }
+    if (fclose(archiveFile) != 0) {
+        exitWithError("error in writing %s\n", archiveName);
+    }
+    printf("archive: %d members, %d symbols\n", memberCount, symbolCount);
 }
 
-int isGlobalLabel(char* label) {
-    return isupper(label[0]);
+// writes bytes and pads them with zeros to the next 4-byte boundary
+void writeAligned(FILE* outputFile, const void* bytes, size_t size) {
+    static const char zeros[4] = { 0 };
+    fwrite(bytes, 1, size, outputFile);
+    fwrite(zeros, 1, alignUp(size, 4) - size, outputFile);
 }
 
-int needsResolution(const char* label, struct FileData* fileData, int objectFileIndex) {
-    for (int i = 0; i < fileData[objectFileIndex].symbolTableSize; ++i) {
-        if (!strcmp(fileData[objectFileIndex].symbolTable[i].label, label)) {
-            if (fileData[objectFileIndex].symbolTable[i].location == 'U') {
-                return 1;
-            }
-            else {
-                return 0;
-            }
+// Checks an archive's tables and loads its symbol index. Returns 0 if any
+// part is out of range.
+int openArchive(struct FileData* input, struct Archive* archive) {
+    const struct ArchiveHeader* header = (const struct ArchiveHeader*) input->archive;
+    size_t size = input->archiveSize;
+    if (header->version != ARCHIVE_VERSION ||
+        header->memberCount > size / sizeof(struct ArchiveMember) ||
+        header->symbolCount > size / sizeof(struct ArchiveSymbol) ||
+        sizeof(*header) + header->memberCount * sizeof(struct ArchiveMember) +
+            header->symbolCount * sizeof(struct ArchiveSymbol) > header->stringsOffset ||
+        header->stringsOffset > size || header->stringsSize > size - header->stringsOffset) {
+        return 0;
+    }
+    archive->fileName = input->fileName;
+    archive->bytes = input->archive;
+    archive->members = (const struct ArchiveMember*) (input->archive + sizeof(*header));
+    archive->memberCount = header->memberCount;
+    archive->strings = (const char*) input->archive + header->stringsOffset;
+    archive->stringsSize = header->stringsSize;
+    archive->extracted = calloc(header->memberCount + 1, 1);
+    for (uint32_t m = 0; m < header->memberCount; ++m) {
+        const struct ArchiveMember* member = &archive->members[m];
+        if (member->offset > size || member->size > size - member->offset ||
+            lookupString(archive->strings, archive->stringsSize, member->name) == NULL) {
+            return 0;
         }
     }
-    return -1;
+
+    const struct ArchiveSymbol* symbols = (const struct ArchiveSymbol*) (archive->members + header->memberCount);
+    allocateSymbolIndex(&archive->symbols, header->symbolCount);
+    for (uint32_t k = 0; k < header->symbolCount; ++k) {
+        const char* label = lookupString(archive->strings, archive->stringsSize, symbols[k].name);
+        if (label == NULL || symbols[k].member >= header->memberCount) {
+            return 0;
+        }
+        SymbolIndexEntry* slot = findSymbolSlot(&archive->symbols, label);
+        if (slot->label == NULL) {
+            slot->label = label;
+            slot->file = symbols[k].member;
+        }
+    }
+    return 1;
 }
 
-int resolveGlobalLabel(const char* label, struct FileData* files, int totalFiles,
-    int objectFileIndex, struct CombinedFiles* combined) {
-    int foundLabelObjIndex = -1;
-    int foundSymbolTableIndex = -1;
+// Takes the archives out of the inputs and appends the members needed to
+// define the globals the objects leave undefined. Extracted members can
+// leave more globals undefined, so this repeats, one parallel read per
+// round, until no archive defines any remaining one. A label is taken from
+// the first archive on the command line that defines it. Returns the new
+// number of files.
+int extractArchiveMembers(struct FileData** files, int totalFiles) {
+    struct Archive* archives = calloc(totalFiles, sizeof(Archive));
+    int archiveCount = 0;
+    int objectCount = 0;
+    int bound = 1;
     for (int i = 0; i < totalFiles; ++i) {
-        if (i == objectFileIndex) {
+        struct FileData* input = &(*files)[i];
+        if (input->archive != NULL) {
+            if (!openArchive(input, &archives[archiveCount])) {
+                exitWithError("error: %s: malformed archive\n", input->fileName);
+            }
+            bound += archives[archiveCount++].memberCount + ((const struct ArchiveHeader*) input->archive)->symbolCount;
             continue;
         }
-        for (int j = 0; j < files[i].symbolTableSize; ++j) {
-            if (files[i].symbolTable[j].location != 'U' && !strcmp(files[i].symbolTable[j].label, label)) {
-                foundLabelObjIndex = i;
-                foundSymbolTableIndex = j;
+        for (int j = 0; j < input->relocationTableSize; ++j) {
+            input->relocTable[j].file = objectCount;
+        }
+        (*files)[objectCount++] = *input;
+    }
+    if (archiveCount == 0) {
+        free(archives);
+        return totalFiles;
+    }
+
+    // globals defined so far, and labels still to look up
+    struct FileData* objects = *files;
+    for (int i = 0; i < objectCount; ++i) {
+        bound += objects[i].symbolTableSize;
+    }
+    struct SymbolIndex defined = { 0 };
+    allocateSymbolIndex(&defined, bound);
+    int pendingCapacity = bound;
+    const char** pending = malloc(pendingCapacity * sizeof(char*));
+    int pendingCount = 0;
+    int first = 0;
+    totalFiles = objectCount;
+    struct ArchiveExtraction extraction = { NULL, malloc(bound * sizeof(Archive*)), malloc(bound * sizeof(uint32_t)), 0 };
+
+    for (;;) {
+        for (int i = first; i < totalFiles; ++i) {
+            for (int j = 0; j < objects[i].symbolTableSize; ++j) {
+                SymbolTableEntry* symbol = &objects[i].symbolTable[j];
+                if (symbol->location == 'U') {
+                    if (pendingCount == pendingCapacity) {
+                        pendingCapacity *= 2;
+                        pending = realloc(pending, pendingCapacity * sizeof(char*));
+                    }
+                    pending[pendingCount++] = symbol->label;
+                    continue;
+                }
+                SymbolIndexEntry* slot = findSymbolSlot(&defined, symbol->label);
+                slot->label = symbol->label;
+                slot->file = i;
+            }
+        }
+
+        int round = 0;
+        for (int k = 0; k < pendingCount; ++k) {
+            if (lookupSymbol(&defined, pending[k]) != NULL) {
+                continue;
+            }
+            for (int a = 0; a < archiveCount; ++a) {
+                SymbolIndexEntry* entry = lookupSymbol(&archives[a].symbols, pending[k]);
+                if (entry == NULL) {
+                    continue;
+                }
+                if (!archives[a].extracted[entry->file]) {
+                    archives[a].extracted[entry->file] = 1;
+                    extraction.archives[round] = &archives[a];
+                    extraction.members[round++] = entry->file;
+                }
                 break;
             }
         }
-        if (foundLabelObjIndex != -1) {
+        pendingCount = 0;
+        if (round == 0) {
             break;
         }
+
+        objects = realloc(objects, (totalFiles + round) * sizeof(FileData));
+        memset(objects + totalFiles, 0, round * sizeof(FileData));
+        for (int k = 0; k < round; ++k) {
+            struct Archive* archive = extraction.archives[k];
+            const char* memberName = archive->strings + archive->members[extraction.members[k]].name;
+            char* fileName = malloc(strlen(archive->fileName) + strlen(memberName) + 3);
+            sprintf(fileName, "%s(%s)", archive->fileName, memberName);
+            objects[totalFiles + k].fileName = fileName;
+        }
+        extraction.files = objects;
+        extraction.firstFile = totalFiles;
+        runParallel(readMemberTask, &extraction, round);
+        reportObjectErrors(objects, totalFiles, round);
+        first = totalFiles;
+        totalFiles += round;
     }
-    if (foundLabelObjIndex == -1) {
-        if (!strcmp(label, "Stack")) {
-            return combined->textSize + combined->dataSize;
+
+    for (int a = 0; a < archiveCount; ++a) {
+        int count = 0;
+        for (uint32_t m = 0; m < archives[a].memberCount; ++m) {
+            count += archives[a].extracted[m];
         }
-        return -1;
+        printf("archive: %d of %d members linked from %s\n", count, archives[a].memberCount, archives[a].fileName);
     }
-    if (files[foundLabelObjIndex].symbolTable[foundSymbolTableIndex].location == 'D') {
-        int startDataOffsetObj = combined->textSize;
-        for (int i = 0; i < totalFiles; ++i) {
-            if (i == foundLabelObjIndex) {
-                return startDataOffsetObj + files[foundLabelObjIndex].symbolTable[foundSymbolTableIndex].offset;
-            }
-            startDataOffsetObj += files[i].dataSize;
+    free(pending);
+    *files = objects;
+    return totalFiles;
+}
+
+void readMemberTask(void* context, int task) {
+    struct ArchiveExtraction* extraction = context;
+    struct Archive* archive = extraction->archives[task];
+    const struct ArchiveMember* member = &archive->members[extraction->members[task]];
+    struct FileData* fileData = &extraction->files[extraction->firstFile + task];
+    if (!readObjectBytes(archive->bytes + member->offset, member->size, fileData, extraction->firstFile + task) ||
+        !validateObject(fileData)) {
+        return;
+    }
+    // the index bounds how many globals a link can define, see extractArchiveMembers
+    for (int j = 0; j < fileData->symbolTableSize; ++j) {
+        SymbolTableEntry* symbol = &fileData->symbolTable[j];
+        SymbolIndexEntry* entry = lookupSymbol(&archive->symbols, symbol->label);
+        if (symbol->location != 'U' && (entry == NULL || entry->file != (int) extraction->members[task])) {
+            objectError(fileData, 0, "archive symbol index is out of date");
+            return;
         }
-    } else if (files[foundLabelObjIndex].symbolTable[foundSymbolTableIndex].location == 'T') {
-        int codeOffset = 0;
-        for (int i = 0; i < totalFiles; ++i) {
-            if (i == foundLabelObjIndex) {
-                return codeOffset + files[foundLabelObjIndex].symbolTable[foundSymbolTableIndex].offset;
-            } else {
-                codeOffset += files[i].textSize;
-            }
+    }
+}
+
+int readTextObject(const char* bytes, size_t size, struct FileData* fileData, int fileIndex) {
+    struct Scanner scanner = { bytes, bytes + size, 1 };
+    int j;
+    int sizeText, sizeData, sizeSymbol, sizeReloc;
+    int sizePool = 0;
+    int textAlign = 1;
+    int dataAlign = 1;
+
+    // parse first line, the pool count and section alignments are optional
+    int* optional[] = { &sizePool, &textAlign, &dataAlign };
+    if (!scanInteger(&scanner, &sizeText) || !scanInteger(&scanner, &sizeData) ||
+        !scanInteger(&scanner, &sizeSymbol) || !scanInteger(&scanner, &sizeReloc)) {
+        return objectError(fileData, scanner.line, "malformed header");
+    }
+    for (j = 0; j < 3 && !atEndOfLine(&scanner); ++j) {
+        if (!scanInteger(&scanner, optional[j])) {
+            return objectError(fileData, scanner.line, "malformed header");
         }
     }
-    return -1;
+    if (!endLine(&scanner) ||
+        sizeText < 0 || sizeData < 0 || sizeSymbol < 0 || sizeReloc < 0 || sizePool < 0) {
+        return objectError(fileData, scanner.line, "malformed header");
+    }
+    // every record is a line of at least two bytes (the last may lack its
+    // newline), so larger counts cannot be honest and must not size the
+    // allocation below
+    size_t records = (size_t) sizeText + sizeData + sizeSymbol + sizeReloc + sizePool;
+    if (records > ((size_t) (scanner.end - scanner.cursor) + 1) / 2) {
+        return objectError(fileData, 1, "header counts exceed the file size");
+    }
+
+    fileData->textSize = sizeText;
+    fileData->dataSize = sizeData;
+    fileData->symbolTableSize = sizeSymbol;
+    fileData->relocationTableSize = sizeReloc;
+    fileData->textAlign = textAlign;
+    fileData->dataAlign = dataAlign;
+    if (!allocateFileData(fileData)) {
+        return 0;
+    }
+
+    // read in text
+    for (j = 0; j < sizeText; j++) {
+        if (!scanInteger(&scanner, &fileData->text[j]) || !endLine(&scanner)) {
+            return objectError(fileData, scanner.line, "malformed text word");
+        }
+    }
+
+    // read in data
+    for (j = 0; j < sizeData; j++) {
+        if (!scanInteger(&scanner, &fileData->data[j]) || !endLine(&scanner)) {
+            return objectError(fileData, scanner.line, "malformed data word");
+        }
+    }
+
+    // read in the symbol table
+    char type[2];
+    for (j = 0; j < sizeSymbol; j++) {
+        SymbolTableEntry* symbol = &fileData->symbolTable[j];
+        if (!scanToken(&scanner, symbol->label, sizeof(symbol->label)) ||
+            !scanToken(&scanner, type, sizeof(type)) ||
+            !scanInteger(&scanner, &symbol->offset) || !endLine(&scanner)) {
+            return objectError(fileData, scanner.line, "malformed symbol");
+        }
+        symbol->location = type[0];
+    }
+
+    // read in relocation table
+    for (j = 0; j < sizeReloc; j++) {
+        RelocationTableEntry* relocation = &fileData->relocTable[j];
+        if (!scanInteger(&scanner, &relocation->offset) ||
+            !scanToken(&scanner, relocation->inst, sizeof(relocation->inst)) ||
+            !scanToken(&scanner, relocation->label, sizeof(relocation->label)) || !endLine(&scanner)) {
+            return objectError(fileData, scanner.line, "malformed relocation");
+        }
+        relocation->kind = relocationKind(relocation->inst);
+        if (relocation->kind < 0) {
+            return objectError(fileData, scanner.line - 1, "unknown relocation type");
+        }
+        relocation->file = fileIndex;
+    }
+
+    // read in the offsets of poolable constants
+    for (j = 0; j < sizePool; j++) {
+        int offset;
+        if (!scanInteger(&scanner, &offset) || !endLine(&scanner)) {
+            return objectError(fileData, scanner.line, "malformed pool offset");
+        }
+        if (offset < 0 || offset >= sizeData) {
+            return objectError(fileData, scanner.line - 1, "pool offset out of range");
+        }
+        fileData->poolable[offset] = 1;
+    }
+    return 1;
 }
 
-void printOutput(struct CombinedFiles* combined, FILE *outputFile) {
-    for (int i = 0; i < combined->textSize; ++i) {
-        fprintf(outputFile, "%d\n", combined->text[i]);
+void skipSpaces(struct Scanner* scanner) {
+    while (scanner->cursor < scanner->end &&
+        (*scanner->cursor == ' ' || *scanner->cursor == '\t' || *scanner->cursor == '\r')) {
+        scanner->cursor++;
     }
+}
 
-    for (int i = 0; i < combined->dataSize; ++i) {
-        fprintf(outputFile, "%d\n", combined->data[i]);
+// reads a decimal int, rejecting anything that does not fit
+int scanInteger(struct Scanner* scanner, int* value) {
+    const char* start = scanner->cursor;
+    long long wide;
+    if (!scanWide(scanner, &wide) || wide < INT32_MIN || wide > INT32_MAX) {
+        scanner->cursor = start;
+        return 0;
     }
-    fclose(outputFile);
+    *value = wide;
+    return 1;
+}
+
+int scanWide(struct Scanner* scanner, long long* value) {
+    skipSpaces(scanner);
+    const char* c = scanner->cursor;
+    int negative = c < scanner->end && *c == '-';
+    if (c < scanner->end && (*c == '-' || *c == '+')) {
+        c++;
+    }
+    if (c == scanner->end || !isdigit((unsigned char) *c)) {
+        return 0;
+    }
+    long long magnitude = 0;
+    for (; c < scanner->end && isdigit((unsigned char) *c); ++c) {
+        if (magnitude > (LLONG_MAX - (*c - '0')) / 10) {
+            return 0;
+        }
+        magnitude = magnitude * 10 + (*c - '0');
+    }
+    *value = negative ? -magnitude : magnitude;
+    scanner->cursor = c;
+    return 1;
+}
+
+// consumes the rest of the line if it is exactly text
+int matchRestOfLine(struct Scanner* scanner, const char* text) {
+    skipSpaces(scanner);
+    size_t length = strlen(text);
+    if ((size_t) (scanner->end - scanner->cursor) < length || memcmp(scanner->cursor, text, length)) {
+        return 0;
+    }
+    scanner->cursor += length;
+    return endLine(scanner);
+}
+
+// reads a whitespace-delimited token that fits in size bytes with its terminator
+int scanToken(struct Scanner* scanner, char* token, int size) {
+    skipSpaces(scanner);
+    int length = 0;
+    while (scanner->cursor < scanner->end && !isspace((unsigned char) *scanner->cursor)) {
+        if (length + 1 >= size) {
+            return 0;
+        }
+        token[length++] = *scanner->cursor++;
+    }
+    token[length] = '\0';
+    return length > 0;
+}
+
+int atEndOfLine(struct Scanner* scanner) {
+    skipSpaces(scanner);
+    return scanner->cursor == scanner->end || *scanner->cursor == '\n';
+}
+
+// consumes the rest of the line, which must be blank
+int endLine(struct Scanner* scanner) {
+    if (!atEndOfLine(scanner)) {
+        return 0;
+    }
+    if (scanner->cursor < scanner->end) {
+        scanner->cursor++;
+        scanner->line++;
+    }
+    return 1;
+}
+
+const char* lookupString(const char* strings, uint32_t stringsSize, uint32_t offset) {
+    if (offset >= stringsSize || memchr(strings + offset, '\0', stringsSize - offset) == NULL) {
+        return NULL;
+    }
+    return strings + offset;
+}
+
+// Sizes the object's tables from its header counts. The word and entry
+// arrays share one allocation so each object is contiguous in memory.
+int allocateFileData(struct FileData* fileData) {
+    if (fileData->textAlign < 1 || fileData->textAlign > MAX_ALIGN || (fileData->textAlign & (fileData->textAlign - 1)) ||
+        fileData->dataAlign < 1 || fileData->dataAlign > MAX_ALIGN || (fileData->dataAlign & (fileData->dataAlign - 1))) {
+        return objectError(fileData, 1, "invalid section alignment");
+    }
+    size_t textBytes = (size_t) fileData->textSize * sizeof(int);
+    size_t dataBytes = (size_t) fileData->dataSize * sizeof(int);
+    size_t symbolBytes = (size_t) fileData->symbolTableSize * sizeof(SymbolTableEntry);
+    size_t relocationBytes = (size_t) fileData->relocationTableSize * sizeof(RelocationTableEntry);
+    char* block = calloc(1, 2 * textBytes + 2 * dataBytes + symbolBytes + relocationBytes + fileData->dataSize + 1);
+    if (block == NULL) {
+        return objectError(fileData, 0, "out of memory");
+    }
+    fileData->text = (int*) block;
+    fileData->data = (int*) (block + textBytes);
+    fileData->dataMap = (int*) (block + textBytes + dataBytes);
+    fileData->textMap = (int*) (block + textBytes + 2 * dataBytes);
+    block += 2 * textBytes + 2 * dataBytes;
+    fileData->symbolTable = (SymbolTableEntry*) block;
+    fileData->relocTable = (RelocationTableEntry*) (block + symbolBytes);
+    fileData->poolable = block + symbolBytes + relocationBytes;
+    return 1;
+}
+
+// records the first problem with an object and returns 0
+int objectError(struct FileData* fileData, int line, const char* message) {
+    if (fileData->error == NULL) {
+        fileData->error = message;
+        fileData->errorLine = line;
+    }
+    return 0;
+}
+
+// Checks every offset the link will use to index into this object, so the
+// later phases can trust them.
+int validateObject(struct FileData* fileData) {
+    for (int j = 0; j < fileData->symbolTableSize; ++j) {
+        SymbolTableEntry* symbol = &fileData->symbolTable[j];
+        if ((symbol->location == 'T' && (symbol->offset < 0 || symbol->offset >= fileData->textSize)) ||
+            (symbol->location == 'D' && (symbol->offset < 0 || symbol->offset >= fileData->dataSize)) ||
+            (symbol->location != 'T' && symbol->location != 'D' && symbol->location != 'U')) {
+            return objectError(fileData, 0, "symbol out of range");
+        }
+    }
+    int objectSize = fileData->textSize + fileData->dataSize;
+    for (int j = 0; j < fileData->relocationTableSize; ++j) {
+        RelocationTableEntry* relocation = &fileData->relocTable[j];
+        if (relocation->kind == RELOCATE_FILL) {
+            if (relocation->offset < 0 || relocation->offset >= fileData->dataSize) {
+                return objectError(fileData, 0, "relocation out of range");
+            }
+            int value = fileData->data[relocation->offset];
+            if (!isGlobalLabel(relocation->label) && (value < 0 || value >= objectSize)) {
+                return objectError(fileData, 0, ".fill label address out of range");
+            }
+            continue;
+        }
+        if (relocation->offset < 0 || relocation->offset >= fileData->textSize) {
+            return objectError(fileData, 0, "relocation out of range");
+        }
+        int word = fileData->text[relocation->offset];
+        int target = relocation->kind == RELOCATE_LITERAL ? word : word & BITMASK_BITS_ZERO_TO_FIFTEEN;
+        if (!isGlobalLabel(relocation->label) && (target < 0 || target >= objectSize)) {
+            return objectError(fileData, 0, "label address out of range");
+        }
+    }
+    return 1;
+}
+
+// returns 0 if the object is truncated or any record is out of range
+int readBinaryObject(const unsigned char* bytes, size_t size, struct FileData* fileData, int fileIndex) {
+    const struct ObjectHeader* header = (const struct ObjectHeader*) bytes;
+    if (header->version != OBJECT_VERSION ||
+        sizeof(struct ObjectHeader) + (size_t) header->sectionCount * sizeof(struct SectionHeader) > size) {
+        return 0;
+    }
+    const struct SectionHeader* sections = (const struct SectionHeader*) (bytes + sizeof(struct ObjectHeader));
+    const int32_t* text = NULL;
+    const int32_t* data = NULL;
+    const struct SymbolRecord* symbols = NULL;
+    const struct RelocationRecord* relocations = NULL;
+    const char* strings = NULL;
+    uint32_t stringsSize = 0;
+    const uint32_t* pool = NULL;
+    uint32_t poolSize = 0;
+    fileData->textSize = 0;
+    fileData->dataSize = 0;
+    fileData->textAlign = 1;
+    fileData->dataAlign = 1;
+    fileData->symbolTableSize = 0;
+    fileData->relocationTableSize = 0;
+
+    for (int i = 0; i < header->sectionCount; ++i) {
+        size_t recordSize = 1;
+        if (sections[i].type == SECTION_TEXT || sections[i].type == SECTION_DATA) {
+            recordSize = sizeof(int32_t);
+        } else if (sections[i].type == SECTION_SYMBOLS) {
+            recordSize = sizeof(struct SymbolRecord);
+        } else if (sections[i].type == SECTION_RELOCATIONS) {
+            recordSize = sizeof(struct RelocationRecord);
+        } else if (sections[i].type == SECTION_POOL) {
+            recordSize = sizeof(uint32_t);
+        }
+        if (sections[i].offset % 4 || sections[i].offset > size ||
+            (size - sections[i].offset) / recordSize < sections[i].count) {
+            return 0;
+        }
+        const void* payload = bytes + sections[i].offset;
+        if (sections[i].type == SECTION_STRINGS) {
+            strings = payload;
+            stringsSize = sections[i].count;
+            continue;
+        }
+        if (sections[i].type == SECTION_POOL) {
+            pool = payload;
+            poolSize = sections[i].count;
+            continue;
+        }
+        if (sections[i].count > INT32_MAX / sizeof(int)) {
+            return 0;
+        }
+        if ((sections[i].type == SECTION_TEXT || sections[i].type == SECTION_DATA) &&
+            (sections[i].align == 0 || (sections[i].align & (sections[i].align - 1)))) {
+            return 0;
+        }
+        if (sections[i].type == SECTION_TEXT) {
+            text = payload;
+            fileData->textSize = sections[i].count;
+            fileData->textAlign = sections[i].align;
+        } else if (sections[i].type == SECTION_DATA) {
+            data = payload;
+            fileData->dataSize = sections[i].count;
+            fileData->dataAlign = sections[i].align;
+        } else if (sections[i].type == SECTION_SYMBOLS) {
+            symbols = payload;
+            fileData->symbolTableSize = sections[i].count;
+        } else if (sections[i].type == SECTION_RELOCATIONS) {
+            relocations = payload;
+            fileData->relocationTableSize = sections[i].count;
+        }
+    }
+
+    if (!allocateFileData(fileData)) {
+        return 0;
+    }
+    // an object may omit any section, so only copy the ones it carries
+    if (text != NULL) {
+        memcpy(fileData->text, text, fileData->textSize * sizeof(int));
+    }
+    if (data != NULL) {
+        memcpy(fileData->data, data, fileData->dataSize * sizeof(int));
+    }
+
+    for (uint32_t j = 0; j < poolSize; ++j) {
+        if (pool[j] >= (uint32_t) fileData->dataSize) {
+            return 0;
+        }
+        fileData->poolable[pool[j]] = 1;
+    }
+
+    for (int j = 0; j < fileData->symbolTableSize; ++j) {
+        const char* label = lookupString(strings, stringsSize, symbols[j].name);
+        if (label == NULL || strlen(label) >= sizeof(fileData->symbolTable[j].label)) {
+            return 0;
+        }
+        strcpy(fileData->symbolTable[j].label, label);
+        fileData->symbolTable[j].location = symbols[j].type;
+        fileData->symbolTable[j].offset = symbols[j].offset;
+    }
+
+    for (int j = 0; j < fileData->relocationTableSize; ++j) {
+        const char* label = lookupString(strings, stringsSize, relocations[j].label);
+        if (label == NULL || strlen(label) >= sizeof(fileData->relocTable[j].label) ||
+            relocations[j].kind > RELOCATE_LITERAL) {
+            return 0;
+        }
+        fileData->relocTable[j].offset = relocations[j].offset;
+        fileData->relocTable[j].kind = relocations[j].kind;
+        strcpy(fileData->relocTable[j].inst, relocationNames[relocations[j].kind]);
+        strcpy(fileData->relocTable[j].label, label);
+        fileData->relocTable[j].file = fileIndex;
+    }
+    return 1;
+}
+
+int isGlobalLabel(const char* label) {
+    return isupper(label[0]);
+}
+
+// Inserts every defined global symbol. Two objects defining the same label,
+// or any object defining the reserved Stack label, are link errors.
+void buildSymbolIndex(struct FileData* files, int totalFiles, struct SymbolIndex* index) {
+    int defined = 1; // room for Stack
+    for (int i = 0; i < totalFiles; ++i) {
+        for (int j = 0; j < files[i].symbolTableSize; ++j) {
+            defined += files[i].symbolTable[j].location != 'U';
+        }
+    }
+    allocateSymbolIndex(index, defined);
+
+    int reservedUsed = 0;
+    for (int i = 0; i < totalFiles; ++i) {
+        for (int j = 0; j < files[i].symbolTableSize; ++j) {
+            SymbolTableEntry* symbol = &files[i].symbolTable[j];
+            if (symbol->location == 'U') {
+                continue;
+            }
+            SymbolIndexEntry* slot = findSymbolSlot(index, symbol->label);
+            if (slot->label != NULL) {
+                exitWithError("error: duplicate global labels found \n");
+            }
+            reservedUsed |= !strcmp(symbol->label, "Stack");
+            slot->label = symbol->label;
+            slot->file = i;
+            slot->symbol = j;
+        }
+    }
+    if (reservedUsed) {
+        exitWithError("error: reserved label Stack used \n");
+    }
+}
+
+void allocateSymbolIndex(struct SymbolIndex* index, int count) {
+    index->capacity = 16;
+    while (index->capacity < 2 * count) {
+        index->capacity *= 2;
+    }
+    index->slots = calloc(index->capacity, sizeof(SymbolIndexEntry));
+}
+
+// Fills in final addresses once text and data have been placed, and adds
+// Stack just past the end of the data.
+void resolveSymbolIndex(struct FileData* files, struct CombinedFiles* combined, struct SymbolIndex* index) {
+    for (int k = 0; k < index->capacity; ++k) {
+        SymbolIndexEntry* slot = &index->slots[k];
+        if (slot->label == NULL || slot->file < 0) {
+            continue;
+        }
+        SymbolTableEntry* symbol = &files[slot->file].symbolTable[slot->symbol];
+        if (symbol->location == 'D') {
+            slot->address = files[slot->file].dataMap[symbol->offset];
+        } else {
+            slot->address = files[slot->file].textMap[symbol->offset];
+        }
+    }
+    SymbolIndexEntry* stack = findSymbolSlot(index, "Stack");
+    stack->label = "Stack";
+    stack->file = -1;
+    stack->address = combined->textSize + combined->dataSize;
+}
+
+// 32-bit FNV-1a
+static uint32_t hashBytes(const void* bytes, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ ((const unsigned char*) bytes)[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// returns the slot holding label, or the empty slot it would go in
+SymbolIndexEntry* findSymbolSlot(struct SymbolIndex* index, const char* label) {
+    int mask = index->capacity - 1;
+    for (int k = hashBytes(label, strlen(label)) & mask; ; k = (k + 1) & mask) {
+        SymbolIndexEntry* slot = &index->slots[k];
+        if (slot->label == NULL || !strcmp(slot->label, label)) {
+            return slot;
+        }
+    }
+}
+
+SymbolIndexEntry* lookupSymbol(struct SymbolIndex* index, const char* label) {
+    SymbolIndexEntry* slot = findSymbolSlot(index, label);
+    return slot->label == NULL ? NULL : slot;
+}
+
+int alignUp(int address, int align) {
+    return (address + align - 1) / align * align;
+}
+
+// Places each object's text at the next multiple of its alignment, padding
+// the gaps with noops. The text is then padded out to the strictest data
+// alignment so that data offsets aligned within an object stay aligned.
+void layoutText(struct FileData* files, int totalFiles, struct CombinedFiles* combined) {
+    int dataAlign = 1;
+    size_t capacity = 0;
+    for (int i = 0; i < totalFiles; ++i) {
+        capacity += files[i].textSize + files[i].textAlign;
+        if (files[i].dataAlign > dataAlign) {
+            dataAlign = files[i].dataAlign;
+        }
+    }
+    combined->text = malloc((capacity + dataAlign) * sizeof(int));
+    combined->textSize = 0;
+    for (int i = 0; i < totalFiles; ++i) {
+        int start = alignUp(combined->textSize, files[i].textAlign);
+        for (; combined->textSize < start; ++combined->textSize) {
+            combined->text[combined->textSize] = NOOP_INSTRUCTION;
+        }
+        files[i].textStartingLine = start;
+        memcpy(combined->text + start, files[i].text, files[i].textSize * sizeof(int));
+        for (int o = 0; o < files[i].textSize; ++o) {
+            files[i].textMap[o] = start + o;
+        }
+        combined->textSize += files[i].textSize;
+    }
+    int end = alignUp(combined->textSize, dataAlign);
+    for (; combined->textSize < end; ++combined->textSize) {
+        combined->text[combined->textSize] = NOOP_INSTRUCTION;
+    }
+}
+
+// Places every object's data after the combined text and records the final
+// address of each word. With pooling, a constant the assembler marked as
+// mergeable shares the word of the first equal constant from any object.
+// Returns the number of words saved.
+int layoutData(struct FileData* files, int totalFiles, struct CombinedFiles* combined, int pool) {
+    int wordsSaved = 0;
+    size_t capacity = 1;
+    for (int i = 0; i < totalFiles; ++i) {
+        capacity += files[i].dataSize + files[i].dataAlign;
+    }
+    combined->data = malloc(capacity * sizeof(int));
+    combined->poolCapacity = 16;
+    while ((size_t) combined->poolCapacity < 2 * capacity) {
+        combined->poolCapacity *= 2;
+    }
+    combined->poolSlots = calloc(combined->poolCapacity, sizeof(int));
+    combined->dataSize = 0;
+    for (int i = 0; i < totalFiles; ++i) {
+        int start = alignUp(combined->dataSize, files[i].dataAlign);
+        for (; combined->dataSize < start; ++combined->dataSize) {
+            combined->data[combined->dataSize] = 0;
+        }
+        files[i].dataStartingLine = combined->textSize + start;
+        for (int j = 0; j < files[i].dataSize; ++j) {
+            wordsSaved += placeDataWord(&files[i], j, combined, pool);
+        }
+    }
+    return wordsSaved;
+}
+
+// appends one data word, or with pooling maps it onto an equal constant
+// already placed; returns 1 if it took no space
+int placeDataWord(struct FileData* fileData, int word, struct CombinedFiles* combined, int pool) {
+    if (pool && fileData->poolable[word]) {
+        int* slot = findPoolSlot(combined, fileData->data[word]);
+        if (*slot != 0) {
+            fileData->dataMap[word] = combined->textSize + *slot - 1;
+            return 1;
+        }
+        *slot = combined->dataSize + 1;
+    }
+    combined->data[combined->dataSize] = fileData->data[word];
+    fileData->dataMap[word] = combined->textSize + combined->dataSize;
+    combined->dataSize++;
+    return 0;
+}
+
+// returns the pool slot holding value, or the empty slot it would go in
+int* findPoolSlot(struct CombinedFiles* combined, int value) {
+    int mask = combined->poolCapacity - 1;
+    for (int k = hashBytes(&value, sizeof(value)) & mask; ; k = (k + 1) & mask) {
+        int* slot = &combined->poolSlots[k];
+        if (*slot == 0 || combined->data[*slot - 1] == value) {
+            return slot;
+        }
+    }
+}
+
+// Lays the program out again from a simulator profile of the default
+// layout: the chain holding the entry point stays first and chains holding
+// literal pool words follow in order, so lw still reaches them, then the
+// executed chains, most executions per word first, then the rest. Data
+// regions go by accesses per word the same way. Falls back to the default
+// layout when moving words could break the program.
+void profileLayout(struct FileData* files, int totalFiles, struct CombinedFiles* combined, int pool,
+    const char* profileName, struct SymbolIndex* symbols) {
+    struct Profile profile = { 0 };
+    readProfile(profileName, &profile);
+    if (profile.size != combined->textSize + combined->dataSize) {
+        exitWithError("error: profile %s was not taken from this link\n", profileName);
+    }
+    int hotCounts[2] = { 0 };
+    int unitCounts[2] = { 0 };
+    const char* reason = reorderByProfile(files, totalFiles, combined, pool, &profile, symbols, hotCounts, unitCounts);
+    if (reason != NULL) {
+        printf("profile layout: %s, keeping the default layout\n", reason);
+        free(combined->text);
+        free(combined->data);
+        free(combined->poolSlots);
+        layoutText(files, totalFiles, combined);
+        layoutData(files, totalFiles, combined, pool);
+    } else {
+        printf("profile layout: %d of %d text chains and %d of %d data regions are hot\n",
+            hotCounts[0], unitCounts[0], hotCounts[1], unitCounts[1]);
+    }
+    free(profile.executions);
+    free(profile.accesses);
+    free(profile.misses);
+}
+
+// Places text and data in profile order, filling in textMap and dataMap
+// and rewriting beq offsets. Returns why it could not, or NULL.
+const char* reorderByProfile(struct FileData* files, int totalFiles, struct CombinedFiles* combined, int pool,
+    struct Profile* profile, struct SymbolIndex* symbols, int* hotCounts, int* unitCounts) {
+    for (int i = 0; i < totalFiles; ++i) {
+        if (files[i].textAlign > 1 || files[i].dataAlign > 1) {
+            return "aligned sections cannot move";
+        }
+    }
+    struct GcObject* objects = calloc(totalFiles, sizeof(GcObject));
+    struct GcRegions regions = { 0 };
+    size_t words = 1;
+    for (int i = 0; i < totalFiles; ++i) {
+        words += files[i].textSize + files[i].dataSize;
+    }
+    regions.file = malloc(words * sizeof(int));
+    regions.start = malloc(words * sizeof(int));
+    regions.isData = malloc(words);
+    int* order = malloc(words * sizeof(int));
+    struct LayoutUnit* units = calloc(words, sizeof(LayoutUnit));
+    const char* reason = NULL;
+    for (int i = 0; i < totalFiles; ++i) {
+        findRegions(&files[i], i, &objects[i], &regions);
+        if (objects[i].keepAll) {
+            reason = "a beq leaves its object";
+        }
+    }
+
+    // text: a region starts a new chain unless the word before it in the
+    // same object can fall through into it; as with --gc-sections, no
+    // object runs on into the next
+    int orderSize = 0;
+    int unitCount = 0;
+    int lastFile = -1;
+    int lastWord = -1;
+    for (int i = 0; reason == NULL && i < totalFiles; ++i) {
+        for (int o = 0; o < files[i].textSize; ++o) {
+            int region = objects[i].textRegion[o];
+            if (orderSize == 0 || order[orderSize - 1] != region) {
+                if (lastFile != i || endsFlow(&files[i], &objects[i], lastWord)) {
+                    units[unitCount].first = orderSize;
+                    units[unitCount].index = unitCount;
+                    units[unitCount].group = unitCount == 0 ? 0 : 2;
+                    unitCount++;
+                }
+                units[unitCount - 1].count++;
+                order[orderSize++] = region;
+            }
+            struct LayoutUnit* unit = &units[unitCount - 1];
+            int address = files[i].textMap[o];
+            int relocation = objects[i].textRelocation[o];
+            unit->words++;
+            unit->heat += profile->executions[address];
+            unit->misses += profile->misses[address];
+            if (relocation >= 0 && files[i].relocTable[relocation].kind == RELOCATE_LITERAL) {
+                unit->group = 0;
+            }
+            lastFile = i;
+            lastWord = o;
+        }
+    }
+    int textUnits = unitCount;
+    for (int u = 0; u < textUnits; ++u) {
+        if (units[u].group != 0) {
+            units[u].group = units[u].heat > 0 ? 1 : 2;
+        }
+        hotCounts[0] += units[u].group == 1;
+    }
+    unitCounts[0] = textUnits;
+    qsort(units, textUnits, sizeof(LayoutUnit), compareLayoutUnits);
+
+    int* text = malloc((combined->textSize + 1) * sizeof(int));
+    int address = 0;
+    for (int u = 0; reason == NULL && u < textUnits; ++u) {
+        for (int k = units[u].first; k < units[u].first + units[u].count; ++k) {
+            int region = order[k];
+            int i = regions.file[region];
+            for (int o = regions.start[region]; o < files[i].textSize && objects[i].textRegion[o] == region; ++o) {
+                files[i].textMap[o] = address++;
+            }
+        }
+    }
+    for (int i = 0; reason == NULL && i < totalFiles; ++i) {
+        for (int o = 0; o < files[i].textSize; ++o) {
+            int word = files[i].text[o];
+            if (objects[i].textRelocation[o] < 0 && (word >> 22 & BITMASK_FOR_PARSING_MACHINE_CODE) == BEQ_OPCODE) {
+                int target = o + 1 + (short) (word & BITMASK_BITS_ZERO_TO_FIFTEEN);
+                int moved = target < files[i].textSize ? files[i].textMap[target] : files[i].textMap[target - 1] + 1;
+                int offset = moved - files[i].textMap[o] - 1;
+                if (offset < -MAX_OFFSET - 1 || offset > MAX_OFFSET) {
+                    reason = "a beq offset is out of range";
+                }
+                word = (word & ~BITMASK_BITS_ZERO_TO_FIFTEEN) | (offset & 0xFFFF);
+            }
+            text[files[i].textMap[o]] = word;
+        }
+    }
+    if (reason == NULL) {
+        free(combined->text);
+        combined->text = text;
+    } else {
+        free(text);
+    }
+
+    // data: every region is placed on its own
+    struct LayoutUnit* dataUnits = units + textUnits;
+    unitCount = 0;
+    for (int i = 0; reason == NULL && i < totalFiles; ++i) {
+        for (int d = 0; d < files[i].dataSize; ++d) {
+            int region = objects[i].dataRegion[d];
+            if (d == 0 || objects[i].dataRegion[d - 1] != region) {
+                dataUnits[unitCount].first = orderSize;
+                dataUnits[unitCount].count = 1;
+                dataUnits[unitCount].index = unitCount;
+                unitCount++;
+                order[orderSize++] = region;
+            }
+            struct LayoutUnit* unit = &dataUnits[unitCount - 1];
+            unit->words++;
+            unit->heat += profile->accesses[files[i].dataMap[d]];
+            unit->misses += profile->misses[files[i].dataMap[d]];
+        }
+    }
+    for (int u = 0; u < unitCount; ++u) {
+        dataUnits[u].group = dataUnits[u].heat > 0 ? 1 : 2;
+        hotCounts[1] += dataUnits[u].group == 1;
+    }
+    unitCounts[1] = unitCount;
+    qsort(dataUnits, unitCount, sizeof(LayoutUnit), compareLayoutUnits);
+    if (reason == NULL) {
+        combined->dataSize = 0;
+        memset(combined->poolSlots, 0, combined->poolCapacity * sizeof(int));
+    }
+    for (int u = 0; reason == NULL && u < unitCount; ++u) {
+        int region = order[dataUnits[u].first];
+        int i = regions.file[region];
+        for (int d = regions.start[region]; d < files[i].dataSize && objects[i].dataRegion[d] == region; ++d) {
+            placeDataWord(&files[i], d, combined, pool);
+        }
+    }
+
+    if (reason == NULL) {
+        resolveSymbolIndex(files, combined, symbols);
+        if (!lwTargetsInRange(files, totalFiles, symbols)) {
+            reason = "an lw or sw target would move out of range";
+        }
+    }
+    for (int i = 0; i < totalFiles; ++i) {
+        free(objects[i].textRegion);
+        free(objects[i].dataRegion);
+        free(objects[i].textRelocation);
+        free(objects[i].dataRelocation);
+    }
+    free(objects);
+    free(regions.file);
+    free(regions.start);
+    free(regions.isData);
+    free(order);
+    free(units);
+    return reason;
+}
+
+// Each line after the header is "address executions accesses misses";
+// addresses left out were never touched.
+void readProfile(const char* profileName, struct Profile* profile) {
+    int descriptor = open(profileName, O_RDONLY);
+    struct stat info;
+    if (descriptor < 0 || fstat(descriptor, &info) != 0) {
+        exitWithError("error in opening %s\n", profileName);
+    }
+    const char* bytes = info.st_size > 0 ?
+        mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0) : MAP_FAILED;
+    close(descriptor);
+    struct Scanner scanner = { bytes, bytes + info.st_size, 1 };
+    char magic[sizeof(PROFILE_MAGIC)];
+    int version;
+    int valid = bytes != MAP_FAILED && scanToken(&scanner, magic, sizeof(magic)) && !strcmp(magic, PROFILE_MAGIC) &&
+        scanInteger(&scanner, &version) && version == PROFILE_VERSION &&
+        scanInteger(&scanner, &profile->size) && endLine(&scanner) && profile->size >= 0;
+    if (valid) {
+        profile->executions = calloc(profile->size + 1, sizeof(long long));
+        profile->accesses = calloc(profile->size + 1, sizeof(long long));
+        profile->misses = calloc(profile->size + 1, sizeof(long long));
+    }
+    while (valid && scanner.cursor < scanner.end) {
+        int address;
+        long long executions, accesses, misses;
+        valid = scanInteger(&scanner, &address) && scanWide(&scanner, &executions) &&
+            scanWide(&scanner, &accesses) && scanWide(&scanner, &misses) && endLine(&scanner) &&
+            address >= 0 && address < profile->size;
+        if (valid) {
+            profile->executions[address] = executions;
+            profile->accesses[address] = accesses;
+            profile->misses[address] = misses;
+        }
+    }
+    if (!valid) {
+        exitWithError("error: %s:%d: malformed profile\n", profileName, scanner.line);
+    }
+    munmap((void*) bytes, info.st_size);
+}
+
+// pinned units in place, then hot ones by heat and then misses per word,
+// then cold ones in place
+int compareLayoutUnits(const void* first, const void* second) {
+    const struct LayoutUnit* a = first;
+    const struct LayoutUnit* b = second;
+    if (a->group != b->group) {
+        return a->group - b->group;
+    }
+    if (a->group == 1) {
+        // cross-multiplied, so per-word rates compare exactly
+        long double left = (long double) a->heat * b->words;
+        long double right = (long double) b->heat * a->words;
+        if (left == right) {
+            left = (long double) a->misses * b->words;
+            right = (long double) b->misses * a->words;
+        }
+        if (left != right) {
+            return left > right ? -1 : 1;
+        }
+    }
+    return a->index - b->index;
+}
+
+// whether every lw and sw still reaches its label from register 0
+int lwTargetsInRange(struct FileData* files, int totalFiles, struct SymbolIndex* symbols) {
+    for (int i = 0; i < totalFiles; ++i) {
+        for (int j = 0; j < files[i].relocationTableSize; ++j) {
+            RelocationTableEntry* relocation = &files[i].relocTable[j];
+            if (relocation->kind != RELOCATE_LW && relocation->kind != RELOCATE_SW) {
+                continue;
+            }
+            SymbolIndexEntry* entry = isGlobalLabel(relocation->label) ? lookupSymbol(symbols, relocation->label) : NULL;
+            int address;
+            if (entry != NULL && entry->file != i) {
+                address = entry->address;
+            } else if (isGlobalLabel(relocation->label) && entry == NULL) {
+                continue; // reported when relocations are applied
+            } else {
+                int local = files[i].text[relocation->offset] & BITMASK_BITS_ZERO_TO_FIFTEEN;
+                address = local >= files[i].textSize ?
+                    files[i].dataMap[local - files[i].textSize] : files[i].textMap[local];
+            }
+            if (!offsetInRange(address)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// lw and sw address from register 0, so a label past MAX_OFFSET cannot be
+// encoded; the assembler's relaxation goes through the literal pool instead
+int offsetInRange(int offset) {
+    return offset <= MAX_OFFSET;
+}
+
+// returns the RELOCATION_KIND named by inst, or -1
+int relocationKind(const char* inst) {
+    for (int kind = RELOCATE_LW; kind <= RELOCATE_LITERAL; ++kind) {
+        if (!strcmp(inst, relocationNames[kind])) {
+            return kind;
+        }
+    }
+    return -1;
+}
+
+// Splits every object's relocations into tasks and patches them in
+// parallel. Layout is final by now, so the result does
+// not depend on the number of threads.
+void applyRelocations(struct FileData* files, int totalFiles, struct CombinedFiles* combined, struct SymbolIndex* symbols) {
+    struct RelocationPool pool = { files, combined, symbols, NULL };
+    int taskCount = 0;
+    int capacity = 0;
+    for (int i = 0; i < totalFiles; ++i) {
+        capacity += (files[i].relocationTableSize + RELOCATION_TASK_SIZE - 1) / RELOCATION_TASK_SIZE;
+    }
+    pool.tasks = calloc(capacity + 1, sizeof(RelocationTask));
+    for (int i = 0; i < totalFiles; ++i) {
+        for (int first = 0; first < files[i].relocationTableSize; first += RELOCATION_TASK_SIZE) {
+            struct RelocationTask* task = &pool.tasks[taskCount++];
+            task->file = i;
+            task->first = first;
+            task->last = first + RELOCATION_TASK_SIZE < files[i].relocationTableSize ?
+                first + RELOCATION_TASK_SIZE : files[i].relocationTableSize;
+        }
+    }
+
+    runParallel(runRelocationTask, &pool, taskCount);
+
+    for (int t = 0; t < taskCount; ++t) {
+        if (pool.tasks[t].errorFormat != NULL) {
+            const char* errorFormat = pool.tasks[t].errorFormat;
+            const char* errorLabel = pool.tasks[t].errorLabel;
+            free(pool.tasks);
+            exitWithError(errorFormat, errorLabel);
+        }
+    }
+    free(pool.tasks);
+}
+
+void runRelocationTask(void* context, int taskIndex) {
+    struct RelocationPool* pool = context;
+    struct RelocationTask* task = &pool->tasks[taskIndex];
+    struct FileData* file = &pool->files[task->file];
+    struct CombinedFiles* combined = pool->combined;
+    for (int j = task->first; j < task->last; j++) {
+        RelocationTableEntry* relocation = &file->relocTable[j];
+        // a global label defined in this object relocates like a local one
+        int isLocal = !isGlobalLabel(relocation->label);
+        int globalLabelOffset = -1;
+        if (!isLocal) {
+            SymbolIndexEntry* entry = lookupSymbol(pool->symbols, relocation->label);
+            if (entry == NULL) {
+                task->errorFormat = "error resolving global label %s\n";
+                task->errorLabel = relocation->label;
+                return;
+            }
+            isLocal = entry->file == task->file;
+            globalLabelOffset = entry->address;
+        }
+        if (relocation->kind == RELOCATE_LITERAL) {
+            // whole-word label address in a relaxed sequence's literal pool
+            int* literal = &combined->text[file->textMap[relocation->offset]];
+            if (!isLocal) {
+                *literal = globalLabelOffset;
+            } else if (*literal >= file->textSize) {
+                *literal = file->dataMap[*literal - file->textSize];
+            } else {
+                *literal = file->textMap[*literal];
+            }
+        } else if (relocation->kind != RELOCATE_FILL) {
+            int* instruction = &combined->text[file->textMap[relocation->offset]];
+            int arg2 = *instruction & BITMASK_BITS_ZERO_TO_FIFTEEN;
+            int labelOffset = globalLabelOffset;
+            if (isLocal) {
+                labelOffset = arg2 >= file->textSize ? file->dataMap[arg2 - file->textSize] : file->textMap[arg2];
+            }
+            if (!offsetInRange(labelOffset)) {
+                task->errorFormat = "error: address of %s out of range for lw/sw\n";
+                task->errorLabel = relocation->label;
+                return;
+            }
+            *instruction = (*instruction & ~BITMASK_BITS_ZERO_TO_FIFTEEN) | (labelOffset & 0xFFFF);
+        } else {
+            int* fill = &combined->data[file->dataMap[relocation->offset] - combined->textSize];
+            if (!isLocal) {
+                *fill = globalLabelOffset;
+            } else if (*fill >= file->textSize) {
+                *fill = file->dataMap[*fill - file->textSize];
+            } else {
+                *fill = file->textMap[*fill];
+            }
+        }
+    }
+}
+
+// Runs every task on a thread per online processor, or inline when there
+// is only one processor or one task. Returns once all tasks are done.
+void runParallel(void (*run)(void* context, int task), void* context, int taskCount) {
+    struct ParallelJob job = { run, context, taskCount, 0 };
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount > taskCount) {
+        threadCount = taskCount;
+    }
+    if (threadCount <= 1) {
+        parallelWorker(&job);
+        return;
+    }
+    pthread_t* threads = malloc(threadCount * sizeof(pthread_t));
+    for (long t = 0; t < threadCount; ++t) {
+        if (pthread_create(&threads[t], NULL, parallelWorker, &job) != 0) {
+            exitWithError("error: could not start worker thread\n");
+        }
+    }
+    for (long t = 0; t < threadCount; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+}
+
+void* parallelWorker(void* argument) {
+    struct ParallelJob* job = argument;
+    for (;;) {
+        int task = atomic_fetch_add(&job->nextTask, 1);
+        if (task >= job->taskCount) {
+            return NULL;
+        }
+        job->run(job->context, task);
+    }
+}
+
+// Tries to bring a previous -i link up to date by re-patching only the
+// objects whose files changed. That works as long as every changed object
+// keeps its section sizes, alignments and the set of globals it defines:
+// its words are rewritten in place and so are the words of other objects
+// that refer to its globals. Returns NULL on success, otherwise why a full
+// link is needed.
+const char* incrementalLink(struct FileData* files, int totalFiles, const char* outFileString, const char* stateName,
+    int* repatched) {
+    struct LinkState state;
+    if (!readLinkState(stateName, files, totalFiles, &state)) {
+        return "no usable link state";
+    }
+    // the output is only opened for writing once nothing can fall back to
+    // a full link
+    struct stat outInfo;
+    if (stat(outFileString, &outInfo) != 0 ||
+        outInfo.st_size != (off_t) (FIXED_WORD_WIDTH + 1) * (state.textSize + state.dataSize)) {
+        return "output does not match link state";
+    }
+
+    char* changed = calloc(totalFiles, 1);
+    for (int i = 0; i < totalFiles; ++i) {
+        struct FileData* previous = &state.files[i];
+        if (stat(files[i].fileName, &files[i].status) != 0) {
+            return "an object cannot be opened";
+        }
+        if (sameFile(&files[i].status, &previous->status)) {
+            files[i].textSize = previous->textSize;
+            files[i].dataSize = previous->dataSize;
+            files[i].textAlign = previous->textAlign;
+            files[i].dataAlign = previous->dataAlign;
+        } else if (!readObjectFile(&files[i], i) || !validateObject(&files[i])) {
+            return "an object cannot be read";
+        } else if (files[i].textSize != previous->textSize || files[i].dataSize != previous->dataSize ||
+            files[i].textAlign != previous->textAlign || files[i].dataAlign != previous->dataAlign) {
+            return "section sizes changed";
+        } else {
+            changed[i] = 1;
+            (*repatched)++;
+        }
+        files[i].textStartingLine = previous->textStartingLine;
+        files[i].dataStartingLine = previous->dataStartingLine;
+    }
+
+    // a changed object must define exactly the globals it did before; their
+    // addresses may move within its sections
+    for (int i = 0; i < totalFiles; ++i) {
+        if (!changed[i]) {
+            continue;
+        }
+        int exports = 0;
+        for (int j = 0; j < files[i].symbolTableSize; ++j) {
+            SymbolTableEntry* symbol = &files[i].symbolTable[j];
+            if (symbol->location == 'U') {
+                continue;
+            }
+            SymbolIndexEntry* entry = lookupSymbol(&state.symbols, symbol->label);
+            if (entry == NULL || entry->file != i) {
+                return "exported symbols changed";
+            }
+            exports++;
+        }
+        if (exports != state.exportCounts[i]) {
+            return "exported symbols changed";
+        }
+        // without pooling an object's words are consecutive
+        for (int j = 0; j < files[i].textSize; ++j) {
+            files[i].textMap[j] = files[i].textStartingLine + j;
+        }
+        for (int j = 0; j < files[i].dataSize; ++j) {
+            files[i].dataMap[j] = files[i].dataStartingLine + j;
+        }
+        for (int j = 0; j < files[i].symbolTableSize; ++j) {
+            SymbolTableEntry* symbol = &files[i].symbolTable[j];
+            if (symbol->location != 'U') {
+                SymbolIndexEntry* entry = lookupSymbol(&state.symbols, symbol->label);
+                entry->address = symbol->location == 'D' ?
+                    files[i].dataMap[symbol->offset] : files[i].textMap[symbol->offset];
+            }
+        }
+    }
+
+    // patch the changed objects in a sparse image of the executable; the
+    // unchanged objects were not read and have no relocations to apply
+    struct CombinedFiles combined = { 0 };
+    combined.textSize = state.textSize;
+    combined.dataSize = state.dataSize;
+    combined.text = calloc(state.textSize + 1, sizeof(int));
+    combined.data = calloc(state.dataSize + 1, sizeof(int));
+    for (int i = 0; i < totalFiles; ++i) {
+        if (changed[i]) {
+            memcpy(combined.text + files[i].textStartingLine, files[i].text, files[i].textSize * sizeof(int));
+            memcpy(combined.data + files[i].dataStartingLine - state.textSize, files[i].data, files[i].dataSize * sizeof(int));
+        }
+    }
+    applyRelocations(files, totalFiles, &combined, &state.symbols);
+
+    // words elsewhere that refer to a changed object's globals; checked
+    // before anything is written so a failure leaves the output intact
+    int* siteWords = malloc((state.siteCount + 1) * sizeof(int));
+    for (int k = 0; k < state.siteCount; ++k) {
+        struct LinkSite* site = &state.sites[k];
+        SymbolIndexEntry* entry = lookupSymbol(&state.symbols, site->label);
+        siteWords[k] = 0;
+        if (changed[site->file] || entry == NULL || entry->file < 0 || !changed[entry->file]) {
+            continue;
+        }
+        if (site->kind == RELOCATE_LITERAL || site->kind == RELOCATE_FILL) {
+            siteWords[k] = entry->address;
+        } else if (!offsetInRange(entry->address)) {
+            exitWithError("error: address of %s out of range for lw/sw\n", site->label);
+        } else {
+            siteWords[k] = site->highBits | (entry->address & 0xFFFF);
+        }
+    }
+
+    int outDescriptor = open(outFileString, O_RDWR);
+    if (outDescriptor < 0) {
+        exitWithError("error in opening %s\n", outFileString);
+    }
+    for (int i = 0; i < totalFiles; ++i) {
+        if (changed[i] &&
+            (!writeWords(outDescriptor, combined.text + files[i].textStartingLine, files[i].textSize, files[i].textStartingLine) ||
+            !writeWords(outDescriptor, combined.data + files[i].dataStartingLine - state.textSize, files[i].dataSize, files[i].dataStartingLine))) {
+            exitWithError("error in writing %s\n", outFileString);
+        }
+    }
+    int kept = 0;
+    for (int k = 0; k < state.siteCount; ++k) {
+        struct LinkSite* site = &state.sites[k];
+        if (changed[site->file]) {
+            continue;
+        }
+        SymbolIndexEntry* entry = lookupSymbol(&state.symbols, site->label);
+        if (entry != NULL && entry->file >= 0 && changed[entry->file] &&
+            !writeWords(outDescriptor, &siteWords[k], 1, site->address)) {
+            exitWithError("error in writing %s\n", outFileString);
+        }
+        state.sites[kept++] = *site;
+    }
+    close(outDescriptor);
+
+    int siteCount = collectLinkSites(files, totalFiles, changed, &combined, &state.symbols, &state.sites, kept);
+    writeLinkState(stateName, files, totalFiles, &combined, &state.symbols, state.sites, siteCount);
+    return NULL;
+}
+
+// Loads the state of the previous -i link into state, which must have been
+// made from the same object files in the same order. Returns 0 if there is
+// none or it does not match.
+int readLinkState(const char* stateName, struct FileData* files, int totalFiles, struct LinkState* state) {
+    int descriptor = open(stateName, O_RDONLY);
+    struct stat info;
+    if (descriptor < 0 || fstat(descriptor, &info) != 0 || info.st_size == 0) {
+        if (descriptor >= 0) {
+            close(descriptor);
+        }
+        return 0;
+    }
+    const char* bytes = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (bytes == MAP_FAILED) {
+        return 0;
+    }
+    struct Scanner scanner = { bytes, bytes + info.st_size, 1 };
+    char magic[sizeof(LINK_STATE_MAGIC)];
+    int version, fileCount, symbolCount;
+    int valid = scanToken(&scanner, magic, sizeof(magic)) && !strcmp(magic, LINK_STATE_MAGIC) &&
+        scanInteger(&scanner, &version) && version == LINK_STATE_VERSION &&
+        scanInteger(&scanner, &fileCount) && fileCount == totalFiles &&
+        scanInteger(&scanner, &state->textSize) && scanInteger(&scanner, &state->dataSize) &&
+        scanInteger(&scanner, &symbolCount) && scanInteger(&scanner, &state->siteCount) && endLine(&scanner) &&
+        state->textSize >= 0 && state->dataSize >= 0 && symbolCount >= 0 && state->siteCount >= 0;
+    if (!valid) {
+        munmap((void*) bytes, info.st_size);
+        return 0;
+    }
+
+    state->files = calloc(totalFiles, sizeof(FileData));
+    state->exportCounts = calloc(totalFiles, sizeof(int));
+    for (int i = 0; valid && i < totalFiles; ++i) {
+        struct FileData* previous = &state->files[i];
+        long long seconds, nanoseconds, size, inode;
+        valid = scanInteger(&scanner, &previous->textSize) && scanInteger(&scanner, &previous->dataSize) &&
+            scanInteger(&scanner, &previous->textAlign) && scanInteger(&scanner, &previous->dataAlign) &&
+            scanInteger(&scanner, &previous->textStartingLine) && scanInteger(&scanner, &previous->dataStartingLine) &&
+            scanWide(&scanner, &seconds) && scanWide(&scanner, &nanoseconds) &&
+            scanWide(&scanner, &size) && scanWide(&scanner, &inode) &&
+            matchRestOfLine(&scanner, files[i].fileName) &&
+            previous->textSize >= 0 && previous->dataSize >= 0 &&
+            previous->textStartingLine >= 0 && previous->textStartingLine <= state->textSize - previous->textSize &&
+            previous->dataStartingLine >= state->textSize &&
+            previous->dataStartingLine <= state->textSize + state->dataSize - previous->dataSize;
+        previous->status.st_mtim.tv_sec = seconds;
+        previous->status.st_mtim.tv_nsec = nanoseconds;
+        previous->status.st_size = size;
+        previous->status.st_ino = inode;
+    }
+
+    allocateSymbolIndex(&state->symbols, symbolCount + 1);
+    state->labels = calloc(symbolCount + 1, MAX_LABEL_LENGTH);
+    for (int k = 0; valid && k < symbolCount; ++k) {
+        int file, address;
+        valid = scanToken(&scanner, state->labels[k], MAX_LABEL_LENGTH) &&
+            scanInteger(&scanner, &file) && scanInteger(&scanner, &address) && endLine(&scanner) &&
+            file >= 0 && file < totalFiles;
+        SymbolIndexEntry* slot = findSymbolSlot(&state->symbols, state->labels[k]);
+        if (valid && slot->label == NULL) {
+            slot->label = state->labels[k];
+            slot->file = file;
+            slot->address = address;
+            state->exportCounts[file]++;
+        }
+    }
+    SymbolIndexEntry* stack = findSymbolSlot(&state->symbols, "Stack");
+    stack->label = "Stack";
+    stack->file = -1;
+    stack->address = state->textSize + state->dataSize;
+
+    state->sites = calloc(state->siteCount + 1, sizeof(LinkSite));
+    for (int k = 0; valid && k < state->siteCount; ++k) {
+        struct LinkSite* site = &state->sites[k];
+        valid = scanInteger(&scanner, &site->file) && scanInteger(&scanner, &site->address) &&
+            scanInteger(&scanner, &site->kind) && scanInteger(&scanner, &site->highBits) &&
+            scanToken(&scanner, site->label, sizeof(site->label)) && endLine(&scanner) &&
+            site->file >= 0 && site->file < totalFiles &&
+            site->address >= 0 && site->address < state->textSize + state->dataSize &&
+            site->kind >= RELOCATE_LW && site->kind <= RELOCATE_LITERAL;
+    }
+    munmap((void*) bytes, info.st_size);
+    return valid;
+}
+
+void writeLinkState(const char* stateName, struct FileData* files, int totalFiles,
+    struct CombinedFiles* combined, struct SymbolIndex* symbols, struct LinkSite* sites, int siteCount) {
+    int symbolCount = 0;
+    for (int k = 0; k < symbols->capacity; ++k) {
+        symbolCount += symbols->slots[k].label != NULL && symbols->slots[k].file >= 0;
+    }
+
+    // written beside the real name and renamed, so a crash never leaves a
+    // half-written state behind
+    char* temporaryName = malloc(strlen(stateName) + 5);
+    sprintf(temporaryName, "%s.tmp", stateName);
+    FILE* stateFile = fopen(temporaryName, "w");
+    if (stateFile == NULL) {
+        exitWithError("error in opening %s\n", temporaryName);
+    }
+    fprintf(stateFile, "%s %d %d %d %d %d %d\n", LINK_STATE_MAGIC, LINK_STATE_VERSION, totalFiles,
+        combined->textSize, combined->dataSize, symbolCount, siteCount);
+    for (int i = 0; i < totalFiles; ++i) {
+        fprintf(stateFile, "%d %d %d %d %d %d %lld %lld %lld %llu %s\n", files[i].textSize, files[i].dataSize,
+            files[i].textAlign, files[i].dataAlign, files[i].textStartingLine, files[i].dataStartingLine,
+            (long long) files[i].status.st_mtim.tv_sec, (long long) files[i].status.st_mtim.tv_nsec,
+            (long long) files[i].status.st_size, (unsigned long long) files[i].status.st_ino, files[i].fileName);
+    }
+    for (int k = 0; k < symbols->capacity; ++k) {
+        SymbolIndexEntry* slot = &symbols->slots[k];
+        if (slot->label != NULL && slot->file >= 0) {
+            fprintf(stateFile, "%s %d %d\n", slot->label, slot->file, slot->address);
+        }
+    }
+    for (int k = 0; k < siteCount; ++k) {
+        fprintf(stateFile, "%d %d %d %d %s\n", sites[k].file, sites[k].address, sites[k].kind,
+            sites[k].highBits, sites[k].label);
+    }
+    if (fclose(stateFile) != 0 || rename(temporaryName, stateName) != 0) {
+        exitWithError("error in writing %s\n", stateName);
+    }
+    free(temporaryName);
+}
+
+// Appends the cross-object relocation sites of every object in include, or
+// of all objects when include is NULL, to sites after its first siteCount
+// entries. Returns the new count.
+int collectLinkSites(struct FileData* files, int totalFiles, const char* include, struct CombinedFiles* combined,
+    struct SymbolIndex* symbols, struct LinkSite** sites, int siteCount) {
+    int capacity = siteCount;
+    for (int i = 0; i < totalFiles; ++i) {
+        if (include == NULL || include[i]) {
+            capacity += files[i].relocationTableSize;
+        }
+    }
+    *sites = realloc(*sites, (capacity + 1) * sizeof(LinkSite));
+    for (int i = 0; i < totalFiles; ++i) {
+        if (include != NULL && !include[i]) {
+            continue;
+        }
+        for (int j = 0; j < files[i].relocationTableSize; ++j) {
+            RelocationTableEntry* relocation = &files[i].relocTable[j];
+            SymbolIndexEntry* entry = isGlobalLabel(relocation->label) ? lookupSymbol(symbols, relocation->label) : NULL;
+            if (entry == NULL || entry->file == i) {
+                continue;
+            }
+            struct LinkSite* site = &(*sites)[siteCount++];
+            site->file = i;
+            site->kind = relocation->kind;
+            site->address = relocation->kind == RELOCATE_FILL ?
+                files[i].dataMap[relocation->offset] : files[i].textMap[relocation->offset];
+            site->highBits = relocation->kind == RELOCATE_LW || relocation->kind == RELOCATE_SW ?
+                combined->text[site->address] & ~BITMASK_BITS_ZERO_TO_FIFTEEN : 0;
+            strcpy(site->label, relocation->label);
+        }
+    }
+    return siteCount;
+}
+
+// an object is taken as unchanged while its size, inode and modification
+// time are, as make does
+int sameFile(struct stat* first, struct stat* second) {
+    return first->st_mtim.tv_sec == second->st_mtim.tv_sec && first->st_mtim.tv_nsec == second->st_mtim.tv_nsec &&
+        first->st_size == second->st_size && first->st_ino == second->st_ino;
+}
+
+// rewrites count fixed-width words of a -i output starting at address
+int writeWords(int descriptor, const int* words, int count, int address) {
+    size_t length = (size_t) count * (FIXED_WORD_WIDTH + 1);
+    char* buffer = malloc(length + 1);
+    for (int k = 0; k < count; ++k) {
+        sprintf(buffer + (size_t) k * (FIXED_WORD_WIDTH + 1), "%*d\n", FIXED_WORD_WIDTH, words[k]);
+    }
+    ssize_t written = pwrite(descriptor, buffer, length, (off_t) address * (FIXED_WORD_WIDTH + 1));
+    free(buffer);
+    return written == (ssize_t) length;
+}
+
+char* linkStateName(const char* outFileString) {
+    char* stateName = malloc(strlen(outFileString) + 7);
+    sprintf(stateName, "%s.state", outFileString);
+    return stateName;
+}
+
+// Drops every region not reachable from the entry point, the first word
+// of the first object with text, or from a --keep label. Edges come from
+// relocations, beq targets and fall-through into the next region of the
+// same object, which is cut by halt and by beq with equal registers. A
+// jalr does not cut it, since a call returns to the word after it.
+// Objects are compacted in place before layout, so the rest of the link is
+// unchanged. Code that reaches a region only through a computed address
+// is not seen and must be kept explicitly.
+void collectGarbage(struct FileData* files, int totalFiles, char** keep, int keepCount) {
+    struct GcObject* objects = calloc(totalFiles, sizeof(GcObject));
+    struct GcRegions regions = { 0 };
+    size_t words = 1;
+    for (int i = 0; i < totalFiles; ++i) {
+        words += files[i].textSize + files[i].dataSize;
+    }
+    regions.file = malloc(words * sizeof(int));
+    regions.start = malloc(words * sizeof(int));
+    regions.isData = malloc(words);
+    for (int i = 0; i < totalFiles; ++i) {
+        findRegions(&files[i], i, &objects[i], &regions);
+    }
+    char* live = calloc(regions.count + 1, 1);
+    int* worklist = malloc((regions.count + 1) * sizeof(int));
+    int worklistSize = 0;
+
+    struct SymbolIndex symbols = { 0 };
+    buildSymbolIndex(files, totalFiles, &symbols);
+    for (int i = 0; i < totalFiles; ++i) {
+        if (objects[i].keepAll) {
+            for (int o = 0; o < files[i].textSize; ++o) {
+                markRegion(live, worklist, &worklistSize, objects[i].textRegion[o]);
+            }
+            for (int d = 0; d < files[i].dataSize; ++d) {
+                markRegion(live, worklist, &worklistSize, objects[i].dataRegion[d]);
+            }
+        }
+    }
+    for (int i = 0; i < totalFiles; ++i) {
+        if (files[i].textSize > 0) {
+            markRegion(live, worklist, &worklistSize, objects[i].textRegion[0]);
+            break;
+        }
+    }
+    for (int k = 0; k < keepCount; ++k) {
+        if (!isGlobalLabel(keep[k])) {
+            // objects only record global symbols, so a local has no address here
+            exitWithError("error: kept label %s is local; only global labels can be kept\n", keep[k]);
+        }
+        SymbolIndexEntry* entry = lookupSymbol(&symbols, keep[k]);
+        if (entry == NULL) {
+            exitWithError("error: kept label %s is not defined\n", keep[k]);
+        }
+        SymbolTableEntry* symbol = &files[entry->file].symbolTable[entry->symbol];
+        markRegion(live, worklist, &worklistSize, symbol->location == 'D' ?
+            objects[entry->file].dataRegion[symbol->offset] : objects[entry->file].textRegion[symbol->offset]);
+    }
+
+    while (worklistSize > 0) {
+        int region = worklist[--worklistSize];
+        int i = regions.file[region];
+        struct FileData* file = &files[i];
+        struct GcObject* object = &objects[i];
+        int isData = regions.isData[region];
+        int* regionOf = isData ? object->dataRegion : object->textRegion;
+        int* relocationOf = isData ? object->dataRelocation : object->textRelocation;
+        int size = isData ? file->dataSize : file->textSize;
+        int end = regions.start[region];
+        for (; end < size && regionOf[end] == region; ++end) {
+            int relocation = relocationOf[end];
+            if (relocation >= 0) {
+                const char* label = file->relocTable[relocation].label;
+                SymbolIndexEntry* entry = isGlobalLabel(label) ? lookupSymbol(&symbols, label) : NULL;
+                if (!isGlobalLabel(label) || (entry != NULL && entry->file == i)) {
+                    markRegion(live, worklist, &worklistSize, regionOfLocal(file, object, localTarget(file, relocation)));
+                } else if (entry != NULL && entry->file >= 0) {
+                    SymbolTableEntry* symbol = &files[entry->file].symbolTable[entry->symbol];
+                    markRegion(live, worklist, &worklistSize, symbol->location == 'D' ?
+                        objects[entry->file].dataRegion[symbol->offset] : objects[entry->file].textRegion[symbol->offset]);
+                }
+                continue;
+            }
+            int opcode = file->text[end] >> 22 & BITMASK_FOR_PARSING_MACHINE_CODE;
+            int target = end + 1 + (short) (file->text[end] & BITMASK_BITS_ZERO_TO_FIFTEEN);
+            if (!isData && opcode == BEQ_OPCODE && target >= 0 && target < size) {
+                markRegion(live, worklist, &worklistSize, object->textRegion[target]);
+            }
+        }
+        if (!isData && end < size && !endsFlow(file, object, end - 1)) {
+            markRegion(live, worklist, &worklistSize, object->textRegion[end]);
+        }
+    }
+
+    for (int i = 0; i < totalFiles; ++i) {
+        int textSize = files[i].textSize;
+        int dataSize = files[i].dataSize;
+        if (!objects[i].keepAll) {
+            compactObject(&files[i], i, &objects[i], live, &symbols);
+        }
+        int removed = textSize - files[i].textSize + dataSize - files[i].dataSize;
+        if (!quiet) {
+            printf("gc-sections: %s: removed %d text and %d data words (%d bytes)\n", files[i].fileName,
+                textSize - files[i].textSize, dataSize - files[i].dataSize, removed * 4);
+        }
+    }
+    for (int i = 0; i < totalFiles; ++i) {
+        free(objects[i].textRegion);
+        free(objects[i].dataRegion);
+        free(objects[i].textRelocation);
+        free(objects[i].dataRelocation);
+    }
+    free(objects);
+    free(regions.file);
+    free(regions.start);
+    free(regions.isData);
+    free(symbols.slots);
+    free(worklist);
+    free(live);
+}
+
+// Numbers the object's regions after those already in regions. An object
+// with aligned sections or a beq leaving its text keeps every region, since
+// moving its words would break it.
+void findRegions(struct FileData* fileData, int fileIndex, struct GcObject* object, struct GcRegions* regions) {
+    object->textRegion = calloc(fileData->textSize + 1, sizeof(int));
+    object->dataRegion = calloc(fileData->dataSize + 1, sizeof(int));
+    object->textRelocation = malloc((fileData->textSize + 1) * sizeof(int));
+    object->dataRelocation = malloc((fileData->dataSize + 1) * sizeof(int));
+    object->keepAll = fileData->textAlign > 1 || fileData->dataAlign > 1;
+    memset(object->textRelocation, -1, (fileData->textSize + 1) * sizeof(int));
+    memset(object->dataRelocation, -1, (fileData->dataSize + 1) * sizeof(int));
+
+    // mark where regions start, then number them in order
+    int* textStarts = object->textRegion;
+    int* dataStarts = object->dataRegion;
+    textStarts[0] = dataStarts[0] = 1;
+    for (int j = 0; j < fileData->symbolTableSize; ++j) {
+        SymbolTableEntry* symbol = &fileData->symbolTable[j];
+        if (symbol->location == 'T') {
+            textStarts[symbol->offset] = 1;
+        } else if (symbol->location == 'D') {
+            dataStarts[symbol->offset] = 1;
+        }
+    }
+    for (int j = 0; j < fileData->relocationTableSize; ++j) {
+        RelocationTableEntry* relocation = &fileData->relocTable[j];
+        if (relocation->kind == RELOCATE_FILL) {
+            object->dataRelocation[relocation->offset] = j;
+        } else {
+            object->textRelocation[relocation->offset] = j;
+        }
+        if (!isGlobalLabel(relocation->label)) {
+            int target = localTarget(fileData, j);
+            if (target < fileData->textSize) {
+                textStarts[target] = 1;
+            } else {
+                dataStarts[target - fileData->textSize] = 1;
+            }
+        }
+    }
+    for (int o = 0; o < fileData->textSize; ++o) {
+        int word = fileData->text[o];
+        if (object->textRelocation[o] < 0 && (word >> 22 & BITMASK_FOR_PARSING_MACHINE_CODE) == BEQ_OPCODE) {
+            // a relaxed branch's skip may land just past the end
+            int target = o + 1 + (short) (word & BITMASK_BITS_ZERO_TO_FIFTEEN);
+            if (target < 0 || target > fileData->textSize) {
+                object->keepAll = 1;
+            }
+        }
+    }
+
+    for (int o = 0; o < fileData->textSize; ++o) {
+        if (textStarts[o]) {
+            regions->file[regions->count] = fileIndex;
+            regions->start[regions->count] = o;
+            regions->isData[regions->count++] = 0;
+        }
+        object->textRegion[o] = regions->count - 1;
+    }
+    for (int d = 0; d < fileData->dataSize; ++d) {
+        if (dataStarts[d]) {
+            regions->file[regions->count] = fileIndex;
+            regions->start[regions->count] = d;
+            regions->isData[regions->count++] = 1;
+        }
+        object->dataRegion[d] = regions->count - 1;
+    }
+}
+
+// the object-relative address a relocation refers to when its label is
+// defined in the same object
+int localTarget(struct FileData* fileData, int relocation) {
+    RelocationTableEntry* entry = &fileData->relocTable[relocation];
+    if (entry->kind == RELOCATE_FILL) {
+        return fileData->data[entry->offset];
+    }
+    int word = fileData->text[entry->offset];
+    return entry->kind == RELOCATE_LITERAL ? word : word & BITMASK_BITS_ZERO_TO_FIFTEEN;
+}
+
+int regionOfLocal(struct FileData* fileData, struct GcObject* object, int address) {
+    return address < fileData->textSize ?
+        object->textRegion[address] : object->dataRegion[address - fileData->textSize];
+}
+
+void markRegion(char* live, int* worklist, int* worklistSize, int region) {
+    if (!live[region]) {
+        live[region] = 1;
+        worklist[(*worklistSize)++] = region;
+    }
+}
+
+// whether execution never falls through the text word at address: a halt,
+// a beq with equal registers or a literal pool word
+int endsFlow(struct FileData* fileData, struct GcObject* object, int address) {
+    int word = fileData->text[address];
+    int opcode = word >> 22 & BITMASK_FOR_PARSING_MACHINE_CODE;
+    if (object->textRelocation[address] >= 0) {
+        return fileData->relocTable[object->textRelocation[address]].kind == RELOCATE_LITERAL;
+    }
+    return opcode == HALT_OPCODE ||
+        (opcode == BEQ_OPCODE && (word >> 19 & BITMASK_FOR_PARSING_MACHINE_CODE) == (word >> 16 & BITMASK_FOR_PARSING_MACHINE_CODE));
+}
+
+// Removes the dead regions' words, symbols and relocations and rewrites
+// the object-relative addresses and beq offsets of the words that remain.
+// Words only move down, so it works in place; dataMap holds the new data
+// offsets until layout fills it in.
+void compactObject(struct FileData* fileData, int fileIndex, struct GcObject* object, char* live, struct SymbolIndex* symbols) {
+    int* textMap = malloc((fileData->textSize + 1) * sizeof(int));
+    int* dataMap = fileData->dataMap;
+    int textSize = 0;
+    int dataSize = 0;
+    for (int o = 0; o < fileData->textSize; ++o) {
+        textMap[o] = live[object->textRegion[o]] ? textSize++ : -1;
+    }
+    textMap[fileData->textSize] = textSize;
+    for (int d = 0; d < fileData->dataSize; ++d) {
+        dataMap[d] = live[object->dataRegion[d]] ? dataSize++ : -1;
+    }
+
+    for (int o = 0; o < fileData->textSize; ++o) {
+        if (textMap[o] < 0) {
+            continue;
+        }
+        int word = fileData->text[o];
+        int relocation = object->textRelocation[o];
+        if (relocation >= 0) {
+            RelocationTableEntry* entry = &fileData->relocTable[relocation];
+            // a global's own object refers to it by its local address too
+            SymbolIndexEntry* global = isGlobalLabel(entry->label) ? lookupSymbol(symbols, entry->label) : NULL;
+            int local = !isGlobalLabel(entry->label) || (global != NULL && global->file == fileIndex);
+            if (local && entry->kind == RELOCATE_LITERAL) {
+                word = relocateLocal(fileData, textMap, textSize, word);
+            } else if (local) {
+                word = (word & ~BITMASK_BITS_ZERO_TO_FIFTEEN) |
+                    relocateLocal(fileData, textMap, textSize, word & BITMASK_BITS_ZERO_TO_FIFTEEN);
+            }
+        } else if ((word >> 22 & BITMASK_FOR_PARSING_MACHINE_CODE) == BEQ_OPCODE) {
+            int target = o + 1 + (short) (word & BITMASK_BITS_ZERO_TO_FIFTEEN);
+            word = (word & ~BITMASK_BITS_ZERO_TO_FIFTEEN) | ((textMap[target] - textMap[o] - 1) & 0xFFFF);
+        }
+        fileData->text[textMap[o]] = word;
+    }
+    for (int d = 0; d < fileData->dataSize; ++d) {
+        if (dataMap[d] < 0) {
+            continue;
+        }
+        int word = fileData->data[d];
+        int relocation = object->dataRelocation[d];
+        if (relocation >= 0) {
+            const char* label = fileData->relocTable[relocation].label;
+            SymbolIndexEntry* global = isGlobalLabel(label) ? lookupSymbol(symbols, label) : NULL;
+            if (!isGlobalLabel(label) || (global != NULL && global->file == fileIndex)) {
+                word = relocateLocal(fileData, textMap, textSize, word);
+            }
+        }
+        fileData->data[dataMap[d]] = word;
+        fileData->poolable[dataMap[d]] = fileData->poolable[d];
+    }
+
+    int kept = 0;
+    for (int j = 0; j < fileData->relocationTableSize; ++j) {
+        RelocationTableEntry entry = fileData->relocTable[j];
+        int* map = entry.kind == RELOCATE_FILL ? dataMap : textMap;
+        if (map[entry.offset] >= 0) {
+            entry.offset = map[entry.offset];
+            fileData->relocTable[kept++] = entry;
+        }
+    }
+    fileData->relocationTableSize = kept;
+    kept = 0;
+    for (int j = 0; j < fileData->symbolTableSize; ++j) {
+        SymbolTableEntry entry = fileData->symbolTable[j];
+        if (entry.location != 'U') {
+            int* map = entry.location == 'D' ? dataMap : textMap;
+            if (map[entry.offset] < 0) {
+                continue;
+            }
+            entry.offset = map[entry.offset];
+        }
+        fileData->symbolTable[kept++] = entry;
+    }
+    fileData->symbolTableSize = kept;
+    fileData->textSize = textSize;
+    fileData->dataSize = dataSize;
+    free(textMap);
+}
+
+// maps an object-relative address of a live word to its compacted address
+int relocateLocal(struct FileData* fileData, int* textMap, int textSize, int address) {
+    if (address < fileData->textSize) {
+        return textMap[address];
+    }
+    return textSize + fileData->dataMap[address - fileData->textSize];
+}
+
+// width is 0 for the compact format and FIXED_WORD_WIDTH for -i
+void printOutput(struct CombinedFiles* combined, FILE *outputFile, int width) {
+    for (int i = 0; i < combined->textSize; ++i) {
+        fprintf(outputFile, "%*d\n", width, combined->text[i]);
+    }
+
+    for (int i = 0; i < combined->dataSize; ++i) {
+        fprintf(outputFile, "%*d\n", width, combined->data[i]);
+    }
+    fclose(outputFile);
+}
+
+double monotonicSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// charges the time since *start to phase and starts the next piece
+void endPhase(int phase, double* start) {
+    double now = monotonicSeconds();
+    phaseSeconds[phase] += now - *start;
+    phaseRan[phase] = 1;
+    *start = now;
+}
+
+// Prints the time of every phase that ran and the peak resident memory,
+// one line each or as a single JSON object for scripts to collect.
+void printTiming(int json) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double total = 0;
+    if (json) {
+        printf("{");
+    }
+    for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+        if (!phaseRan[phase]) {
+            continue;
+        }
+        total += phaseSeconds[phase];
+        if (json) {
+            printf("\"%s\": %.6f, ", phaseNames[phase], phaseSeconds[phase]);
+        } else {
+            printf("timing: %-11s %10.6f s\n", phaseNames[phase], phaseSeconds[phase]);
+        }
+    }
+    if (json) {
+        printf("\"total\": %.6f, \"peakMemoryKiB\": %ld}\n", total, usage.ru_maxrss);
+    } else {
+        printf("timing: %-11s %10.6f s\n", "total", total);
+        printf("timing: peak memory %ld KiB\n", usage.ru_maxrss);
+    }
+}
+
+// Lists where every object's sections ended up, its relocation counts, and
+// every global symbol by address, ending with Stack.
+void writeLinkMap(const char* mapName, const char* outFileString, struct FileData* files, int totalFiles,
+    struct CombinedFiles* combined, struct SymbolIndex* symbols) {
+    FILE* mapFile = fopen(mapName, "w");
+    if (mapFile == NULL) {
+        exitWithError("error in opening %s\n", mapName);
+    }
+    fprintf(mapFile, "link map of %s\n", outFileString);
+    fprintf(mapFile, "text %d words at 0, data %d words at %d\n", combined->textSize, combined->dataSize,
+        combined->textSize);
+    for (int i = 0; i < totalFiles; ++i) {
+        int counts[RELOCATE_LITERAL + 1] = { 0 };
+        for (int j = 0; j < files[i].relocationTableSize; ++j) {
+            counts[files[i].relocTable[j].kind]++;
+        }
+        fprintf(mapFile, "\nobject %s\n", files[i].fileName);
+        writeRuns(mapFile, "text", files[i].textMap, files[i].textSize);
+        writeRuns(mapFile, "data", files[i].dataMap, files[i].dataSize);
+        fprintf(mapFile, "    relocations %d:", files[i].relocationTableSize);
+        for (int kind = RELOCATE_LW; kind <= RELOCATE_LITERAL; ++kind) {
+            fprintf(mapFile, " %s %d", relocationNames[kind], counts[kind]);
+        }
+        fprintf(mapFile, "\n");
+    }
+
+    SymbolIndexEntry** sorted = malloc((symbols->capacity + 1) * sizeof(SymbolIndexEntry*));
+    int symbolCount = 0;
+    for (int k = 0; k < symbols->capacity; ++k) {
+        if (symbols->slots[k].label != NULL && symbols->slots[k].file >= 0) {
+            sorted[symbolCount++] = &symbols->slots[k];
+        }
+    }
+    qsort(sorted, symbolCount, sizeof(SymbolIndexEntry*), compareSymbolAddresses);
+    fprintf(mapFile, "\nsymbols\n");
+    for (int k = 0; k < symbolCount; ++k) {
+        SymbolTableEntry* symbol = &files[sorted[k]->file].symbolTable[sorted[k]->symbol];
+        fprintf(mapFile, "    %-6s %6d %c %s\n", sorted[k]->label, sorted[k]->address, symbol->location,
+            files[sorted[k]->file].fileName);
+    }
+    fprintf(mapFile, "    %-6s %6d\n", "Stack", lookupSymbol(symbols, "Stack")->address);
+    free(sorted);
+    if (fclose(mapFile) != 0) {
+        exitWithError("error in writing %s\n", mapName);
+    }
+}
+
+// Prints a section's final addresses as runs of consecutive words, since
+// --profile can scatter a section and pooling can share words.
+void writeRuns(FILE* mapFile, const char* section, const int* map, int size) {
+    if (size == 0) {
+        fprintf(mapFile, "    %s none\n", section);
+    }
+    for (int start = 0, end = 0; start < size; start = end) {
+        for (end = start + 1; end < size && map[end] == map[end - 1] + 1; ++end) {
+        }
+        fprintf(mapFile, "    %s %d-%d (%d words)\n", section, map[start], map[end - 1], end - start);
+    }
+}
+
+int compareSymbolAddresses(const void* first, const void* second) {
+    const SymbolIndexEntry* a = *(SymbolIndexEntry* const*) first;
+    const SymbolIndexEntry* b = *(SymbolIndexEntry* const*) second;
+    if (a->address != b->address) {
+        return a->address < b->address ? -1 : 1;
+    }
+    return strcmp(a->label, b->label);
 }
@@ -3,13 +3,30 @@
  * EECS 370 LC-2K Instruction-level simulator
  */
 
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 #include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef LC2K_LIBRARY
+#define LC2K_INTERNAL
+#include "lc2k.h"
+#endif
 
-#define NUMMEMORY 65536 /* maximum number of words in memory */
+#define NUMMEMORY 65536 /* minimum number of words in memory */
 #define NUMREGS 8 /* number of machine registers */
 #define MAXLINELENGTH 1000
 #define MIN_OFFSET -32768
@@ -18,12 +35,39 @@
 #define BITMASK_BITS_ZERO_TO_FIFTEEN 0xFFFF
 #define MAX_CACHE_SIZE 256
 #define MAX_BLOCK_SIZE 256
+#define PROFILE_MAGIC "LC2K-PROFILE"
+#define PROFILE_VERSION 1
+#define MAX_JOB_ID 64
+#define MAX_CORES 64
+#define CORE_ID_REGISTER 7 /* set at startup when running with -cores */
+#define CORE_COUNT_REGISTER 6
+#define MAX_PREFETCH_DEGREE 16
+#define STRIDE_TABLE_SIZE 64
+#define NUM_STREAM_BUFFERS 4
+#define MAX_WRITE_BUFFER 64
+#define MAX_VICTIM_CACHE 64
+#define MAX_TLB_LEVELS 3
+#define MAX_TLB_ENTRIES 4096
+#define MAX_PREDICTOR_BITS 20
+#define MAX_BTB_ENTRIES 65536
+#define MAX_RAS_DEPTH 256
+#define WRITE_BUFFER_DRAIN_TIME 4 /* accesses it takes to write one buffer entry to memory */
+#define PREFETCH_LATENCY 8 /* accesses a prefetch takes to arrive; used ones that arrive later were late */
+#define BRANCH_PENALTY 3 /* cycles squashed when a beq or jalr resolves in MEM against its prediction */
+#define PIPELINE_DEPTH 5
+#define MAX_DRAM_BANKS 64
+#define BATCH_WIDTH 8 /* lanes executed at once; an AVX2 register holds 8 words */
+#define BATCH_LANES 64 /* default lanes in the batch pool */
+#define MAX_BATCH_LANES 1024
+#define DIVERGENCE_LIMIT 32 /* steps lanes may stay scattered before they are regrouped */
+#define EMPTY_LANE INT_MAX /* the pc of a batch lane with no instance */
 
 typedef struct stateStruct {
     int pc;
-    int mem[NUMMEMORY];
+    int *mem;
     int reg[NUMREGS];
     int numMemory;
+    int memorySize; /* power of two, at least NUMMEMORY */
 } stateType;
 
 typedef struct instructionData {
@@ -34,8 +78,8 @@ typedef struct instructionData {
 } instructionInfo;
 
 enum cacheOperation {
-    read,
-    save
+    cacheRead,
+    cacheSave
 };
 
 enum actionType
@@ -44,13 +88,35 @@ enum actionType
     processorToCache,
     memoryToCache,
     cacheToMemory,
-    cacheToNowhere
+    cacheToNowhere,
+    memoryToCacheByPrefetch,
+    memoryToStreamBuffer,
+    streamBufferToCache,
+    streamBufferToNowhere,
+    processorToMemory,
+    processorToWriteBuffer,
+    cacheToWriteBuffer,
+    writeBufferToMemory,
+    cacheToVictimCache,
+    victimCacheToCache,
+    victimCacheToMemory,
+    victimCacheToNowhere
+};
+
+enum prefetcherType {
+    noPrefetcher,
+    nextLinePrefetcher,
+    stridePrefetcher,
+    streamPrefetcher
 };
 
 typedef struct blockStruct
 {
     int data[MAX_BLOCK_SIZE];
     bool isDirty;
+    bool isShared; /* clean and possibly held by other cores too */
+    bool isPrefetched; /* filled by a prefetch and not used yet */
+    long long prefetchTime;
     int lruLabel;
     int set;
     int tag;
@@ -65,13 +131,397 @@ typedef struct cacheStruct
     int numSets;
 } cacheStruct;
 
-/* Global Cache variable */
-cacheStruct cache;
-int blockAccessTimestamp = 0;
+/* The cache being accessed and its counters, one copy per thread so that
+   each server worker simulates its own machine. With -cores, cache points
+   at the current core's cache in coreCaches. */
+_Thread_local cacheStruct *cache = NULL;
+_Thread_local int blockAccessTimestamp = 0;
+
+/* per-address counts for -profile, NULL when not profiling */
+_Thread_local long long *profileExecutions = NULL;
+_Thread_local long long *profileAccesses = NULL;
+_Thread_local long long *profileMisses = NULL;
+_Thread_local long long cacheHits = 0;
+_Thread_local long long cacheMisses = 0;
+_Thread_local bool quiet = false; /* -compare runs without logging cache actions */
+_Thread_local long long instructionLimit = 0; /* 0 for none; server jobs can set one */
+_Thread_local int storeHighWater = 0; /* one past the highest address stored to */
+_Thread_local jmp_buf *jobErrorJump = NULL; /* set while a server job runs */
+_Thread_local const char *jobError;
+
+/*
+ * With -cores, each core's cache follows MESI by snooping the others:
+ *  -    Modified: isDirty
+ *  -    Exclusive: valid, clean and not isShared
+ *  -    Shared: valid and isShared
+ *  -    Invalid: tag is 0xdeadbeef
+ */
+typedef struct coreStats {
+    long long instructions;
+    long long hits;
+    long long misses;
+    long long upgrades; /* writes to a Shared block, invalidating the other copies */
+    long long invalidations; /* copies in this cache invalidated by other cores */
+    long long interventions; /* Modified or Exclusive blocks this cache gave up to other cores */
+} coreStats;
+
+/* -prefetch: per-PC stride detection, and stream buffers that hold the
+   addresses of blocks fetched ahead of a miss outside the cache */
+typedef struct strideEntry {
+    int pc;
+    int lastAddress;
+    int stride;
+    int confidence;
+} strideEntry;
+
+typedef struct streamBuffer {
+    int blocks[MAX_PREFETCH_DEGREE]; /* block heads, oldest first */
+    long long prefetchTimes[MAX_PREFETCH_DEGREE];
+    int count;
+    int next; /* the block head to fetch after the last */
+    long long lastUsed;
+} streamBuffer;
+
+typedef struct prefetchStats {
+    long long issued;
+    long long useful; /* used before they were evicted */
+    long long late; /* used sooner than PREFETCH_LATENCY accesses after they were issued */
+    long long lead; /* total accesses from issue to first use, over the useful ones */
+    long long unused; /* evicted without being used */
+} prefetchStats;
+
+_Thread_local enum prefetcherType prefetcher = noPrefetcher;
+_Thread_local int prefetchDegree = 1;
+_Thread_local int prefetchDistance = 1;
+_Thread_local int accessPC = -1; /* the pc of the lw or sw accessing memory, -1 for fetches */
+_Thread_local long long accessCount = 0;
+_Thread_local prefetchStats prefetchStatistics;
+_Thread_local strideEntry strideTable[STRIDE_TABLE_SIZE];
+_Thread_local streamBuffer streamBuffers[NUM_STREAM_BUFFERS];
+
+/* -write through keeps blocks clean by writing every store to memory as
+   well; -no-write-allocate sends store misses to memory without filling
+   a block. Either way, with -write-buffer the writes wait in a coalescing
+   buffer of one entry per block, which drains an entry every
+   WRITE_BUFFER_DRAIN_TIME accesses. */
+typedef struct writeBufferEntry {
+    int blockHead;
+    bool isWritten[MAX_BLOCK_SIZE];
+    int data[MAX_BLOCK_SIZE];
+} writeBufferEntry;
+
+typedef struct trafficStats {
+    long long wordsRead; /* from memory into the cache or a stream buffer */
+    long long wordsWritten; /* into memory */
+    long long bufferedWrites;
+    long long coalescedWrites; /* buffered into an entry already waiting for their block */
+    long long stalls; /* writes that found the buffer full */
+    long long stallTime; /* accesses spent waiting for an entry to drain */
+} trafficStats;
+
+_Thread_local bool writeThrough = false;
+_Thread_local bool writeAllocate = true;
+_Thread_local writeBufferEntry *writeBuffer = NULL;
+_Thread_local int writeBufferSize = 0;
+_Thread_local int writeBufferCount = 0;
+_Thread_local long long lastDrain = 0; /* when the oldest entry started draining */
+_Thread_local trafficStats traffic;
+
+/* -victim keeps the last blocks evicted from the cache in a small fully
+   associative victim cache, where a miss can find them again */
+typedef struct victimEntry {
+    int blockHead;
+    bool isDirty;
+    int lruLabel;
+    int data[MAX_BLOCK_SIZE];
+} victimEntry;
+
+typedef struct victimStats {
+    long long hits;
+    long long misses;
+    long long insertions;
+    long long writebacks; /* dirty blocks it evicted to memory */
+} victimStats;
+
+/* -classify sorts every miss of the cache into compulsory (the block's
+   first use), capacity (a fully associative LRU cache of the same size
+   would miss too) and conflict (it would have hit) */
+typedef struct missClassifier {
+    int *blocks; /* the shadow fully associative cache */
+    long long *lastUsed;
+    int count;
+    int size;
+    long long time;
+    bool *seen; /* by block head */
+    long long compulsory;
+    long long capacity;
+    long long conflict;
+} missClassifier;
+
+_Thread_local victimEntry *victimCache = NULL;
+_Thread_local int victimCacheSize = 0;
+_Thread_local int victimCacheCount = 0;
+_Thread_local victimStats victimStatistics;
+_Thread_local bool classifyMisses = false;
+_Thread_local missClassifier classifier;
+
+/*
+ * -mmu translates every fetch, lw and sw through a page table stored in
+ * simulated memory just past the program's address space, one entry per
+ * page holding (frame << 1) | valid. Pages map to the frames of the same
+ * number. The TLB levels given with -tlb are looked up in order; when all
+ * of them miss, the walk loads the page table entry through the cache
+ * like any other access, and the levels that missed are filled.
+ */
+enum tlbReplacement {
+    tlbLRU,
+    tlbFIFO,
+    tlbRandom
+};
+const char *tlbReplacementNames[] = { "lru", "fifo", "random" };
+
+typedef struct tlbEntry {
+    int page; /* -1 when empty */
+    int frame;
+    long long lastUsed;
+    long long filled;
+} tlbEntry;
+
+typedef struct tlbLevel {
+    tlbEntry *entries;
+    int numEntries;
+    int ways;
+    enum tlbReplacement replacement;
+    long long hits;
+    long long misses;
+} tlbLevel;
+
+typedef struct mmuStats {
+    long long walks;
+    long long walkAccesses; /* page table entries loaded */
+    long long walkMisses; /* of those, the ones that missed in the cache */
+} mmuStats;
+
+_Thread_local bool mmuEnabled = false;
+_Thread_local int pageSize = 0;
+_Thread_local int pageBits = 0;
+_Thread_local int virtualSize = 0;
+_Thread_local int pageTableBase = 0;
+_Thread_local tlbLevel tlbLevels[MAX_TLB_LEVELS];
+_Thread_local int tlbLevelCount = 0;
+_Thread_local long long tlbTime = 0;
+_Thread_local unsigned int tlbRandomState = 1;
+_Thread_local mmuStats mmuStatistics;
+
+/*
+ * -predict guesses each beq's direction before it resolves, with 2-bit
+ * saturating counters for the dynamic predictors:
+ *  -    bimodal: a counter per pc
+ *  -    gshare: a counter per pc XOR the global history of directions
+ *  -    tournament: both, and a counter per pc choosing between them
+ * -btb and -ras guess each jalr's target. A jalr through the register
+ * the newest return-address stack entry was linked in is a return and
+ * takes its target from the stack; any other jalr is a call, pushes
+ * its return address and is looked up in the branch target buffer.
+ */
+enum predictorType {
+    noPredictor,
+    takenPredictor,
+    notTakenPredictor,
+    bimodalPredictor,
+    gsharePredictor,
+    tournamentPredictor
+};
+const char *predictorNames[] = { "none", "taken", "nottaken", "bimodal", "gshare", "tournament" };
+
+typedef struct btbEntry {
+    int pc; /* -1 when empty */
+    int target;
+} btbEntry;
+
+typedef struct returnEntry {
+    int address;
+    int linkRegister;
+} returnEntry;
+
+typedef struct branchStats {
+    long long executed;
+    long long taken;
+    long long mispredicted;
+} branchStats;
+
+_Thread_local enum predictorType predictor = noPredictor;
+_Thread_local int predictorBits = 10;
+_Thread_local int historyBits = 0; /* 0 for as many as predictorBits */
+_Thread_local unsigned char *bimodalCounters = NULL;
+_Thread_local unsigned char *gshareCounters = NULL;
+_Thread_local unsigned char *chooserCounters = NULL;
+_Thread_local unsigned int branchHistory = 0;
+_Thread_local btbEntry *branchTargetBuffer = NULL;
+_Thread_local int btbSize = 0;
+_Thread_local returnEntry *returnStack = NULL;
+_Thread_local int rasDepth = 0;
+_Thread_local int rasCount = 0;
+_Thread_local int rasTop = 0;
+_Thread_local branchStats *branchStatistics = NULL; /* by pc, for beq and jalr */
+_Thread_local branchStats beqTotals;
+_Thread_local branchStats jalrTotals;
+_Thread_local long long returnPredictions = 0;
+
+/*
+ * -pipeline times the run on the classic 5-stage pipeline (IF ID EX MEM
+ * WB) with full forwarding. Every instruction takes a cycle, plus:
+ *  -    load-use: one bubble when an instruction reads the register the
+ *       lw just before it loads
+ *  -    branch: BRANCH_PENALTY cycles when a beq or jalr resolves in MEM
+ *       against its prediction; without -predict, beq is predicted not
+ *       taken, and without -btb or -ras, jalr is always mispredicted
+ *  -    fetch and data misses: the pipeline stalls missPenalty cycles for
+ *       each access that misses in the cache, or bufferPenalty cycles if
+ *       the victim cache or a stream buffer supplies the block
+ * Stalls are charged independently, so overlapping ones are counted twice.
+ */
+typedef struct pipelineStats {
+    long long instructions;
+    long long cycles;
+    long long loadUse;
+    long long branch;
+    long long jump;
+    long long fetchMiss;
+    long long dataMiss;
+} pipelineStats;
+
+_Thread_local bool pipelineEnabled = false;
+_Thread_local int missPenalty = 20;
+_Thread_local int bufferPenalty = 2;
+_Thread_local long long bufferHits = 0; /* misses supplied by the victim cache or a stream buffer */
+_Thread_local int loadDestination = -1; /* the register the previous instruction loaded, if it was lw */
+_Thread_local pipelineStats pipelineStatistics;
+
+/*
+ * -dram times every transfer between the cache and memory on DRAM banks.
+ * Rows of dramRowSize words are interleaved across the banks, and each
+ * bank keeps its last row open in its row buffer with the open page
+ * policy, or precharges after every access with the closed one. Reaching
+ * a row costs
+ *  -    tCAS on a row buffer hit
+ *  -    tRCD + tCAS on a precharged bank
+ *  -    tRP + tRCD + tCAS on a conflict with another open row
+ * and the words then follow in bursts of burstLength, two to a cycle, the
+ * last burst padded. Fills and writebacks the processor waits for are
+ * demand accesses; prefetches and write buffer drains only use bandwidth.
+ */
+typedef struct dramStats {
+    long long accesses;
+    long long rowHits;
+    long long rowMisses; /* to a precharged bank */
+    long long rowConflicts;
+    long long wordsRead;
+    long long wordsWritten;
+    long long busCycles; /* spent transferring bursts */
+    long long demandAccesses;
+    long long demandCycles;
+} dramStats;
+
+_Thread_local bool dramEnabled = false;
+_Thread_local int dramBanks = 8;
+_Thread_local int dramRowSize = 1024;
+_Thread_local bool closedPage = false;
+_Thread_local int tRCD = 14;
+_Thread_local int tCAS = 14;
+_Thread_local int tRP = 14;
+_Thread_local int burstLength = 8;
+_Thread_local int openRows[MAX_DRAM_BANKS]; /* -1 when precharged */
+_Thread_local dramStats dramStatistics;
+
+_Thread_local int coreCount = 1;
+_Thread_local int currentCore = 0;
+_Thread_local cacheStruct *coreCaches = NULL;
+_Thread_local coreStats *coreStatistics = NULL;
+
+/* a job read from a server client, waiting in the queue for a worker */
+typedef struct serverJob {
+    char id[MAX_JOB_ID];
+    int blockSize;
+    int numSets;
+    int blocksPerSet;
+    long long limit;
+    int *words;
+    int size;
+    double queued;
+    struct serverConnection *connection;
+    struct serverJob *next;
+} serverJob;
+
+/* a client of the server; results go back to it as its jobs finish */
+typedef struct serverConnection {
+    FILE *in;
+    FILE *out;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int pending;
+} serverConnection;
+
+/* the server's job queue, shared by every connection and worker */
+serverJob *queueHead = NULL;
+serverJob *queueTail = NULL;
+bool queueClosed = false;
+pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queueReady = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Batch mode runs one program on many inputs, each instance with its own
+ * memory, in a pool of lanes held as structure of arrays. Every step
+ * executes the instruction at the lowest pc of any lane for all the lanes
+ * there, BATCH_WIDTH at a time, with the lanes elsewhere masked off; lanes
+ * a beq splits up wait until the lowest of them catch up and run together
+ * again. When lanes stay scattered across the pool for DIVERGENCE_LIMIT
+ * steps, they are regrouped by pc so that each group fills whole vectors.
+ * A lane whose instance halts takes the next input.
+ */
+typedef struct batchInput {
+    int *assignments; /* address, value pairs */
+    int count;
+} batchInput;
+
+typedef struct batchResult {
+    long long instructions;
+    int pc;
+    int reg[NUMREGS];
+    const char *error;
+    int *changed; /* address, value pairs of the words that differ from the program */
+    int changedCount;
+} batchResult;
+
+typedef struct batchPool {
+    int lanes; /* a multiple of BATCH_WIDTH */
+    int memorySize;
+    int *image; /* the program, zero past its end */
+    int imageSize;
+    int *memory; /* the instances' memories, memorySize words each */
+    int *pc; /* by lane, EMPTY_LANE when the lane has no instance */
+    int *reg[NUMREGS];
+    int *base; /* where the lane's memory starts in memory */
+    int *highWater; /* one past the highest address the lane's instance stored to or was given */
+    int *instance;
+    int *recent; /* instructions since they were last added to instructions */
+    long long *instructions;
+    long long limit;
+    batchInput *inputs;
+    batchResult *results;
+    int instanceCount;
+    int nextInstance;
+    bool retired; /* a lane emptied this step */
+    int scatteredSteps;
+    long long steps;
+    long long laneInstructions;
+    long long vectorSteps; /* BATCH_WIDTH lanes executed at once, however many were masked off */
+} batchPool;
 
 void printState(stateType *);
 int convertNum(int);
 void exitProgram(const char* message);
+static void exitWithError(const char* format, ...);
 int isValidRegister(int reg);
 void initializeCache(void);
 int load(int, stateType *);
@@ -84,6 +534,70 @@ bool existsInCache(int, int);
 int loadFromCache(int, int, int);
 void saveToCache(int, int, int, int);
 int evictLRU(int, stateType *);
+void loadProgram(const char *, stateType *);
+void reserveWord(stateType *);
+void flushCache(stateType *);
+int runProgram(stateType *);
+void writeProfile(const char *, stateType *);
+bool isValidCacheConfiguration(int, int, int);
+void resetCache(void);
+double monotonicSeconds(void);
+int runServer(int, char *[]);
+void serveConnection(serverConnection *);
+int readJob(serverConnection *, serverJob *, int *);
+void enqueueJob(serverJob *);
+serverJob *dequeueJob(void);
+void *serverWorker(void *);
+void *serverClient(void *);
+const char *simulateJob(serverJob *, stateType *, int *);
+bool executeInstruction(stateType *);
+void runCores(stateType *, int, int);
+blockStruct *findBlock(cacheStruct *, int, int);
+bool snoopOtherCaches(stateType *, int, int, bool);
+blockStruct *fillBlock(int, int, int, bool, enum actionType, const int *, stateType *);
+void prefetchBlock(int, stateType *);
+void usePrefetch(long long);
+void trainPrefetcher(int, bool, bool, stateType *);
+bool takeFromStreamBuffer(int);
+void fetchIntoStreamBuffer(streamBuffer *, stateType *);
+void allocateStreamBuffer(int, stateType *);
+void printPrefetchStatistics(void);
+void resetPrefetcher(void);
+void writeToMemory(int, const int *, int, enum actionType, stateType *);
+void drainWriteBufferEntry(int, stateType *);
+void drainWriteBuffer(stateType *, bool);
+void printTraffic(void);
+void insertVictim(blockStruct *, stateType *);
+bool takeFromVictimCache(int, int *, bool *);
+void classifyAccess(int, bool);
+void resetMissAnalysis(stateType *);
+void printMissAnalysis(void);
+int translate(int, stateType *);
+int lookupTLB(tlbLevel *, int);
+void fillTLB(tlbLevel *, int, int);
+int walkPageTable(int, stateType *);
+void initializeMMU(stateType *);
+void printMMUStatistics(void);
+bool observeBranch(int, bool);
+bool observeJump(int, int, int, int);
+void updateCounter(unsigned char *, bool);
+void initializePredictors(stateType *);
+void printBranchStatistics(stateType *);
+long long memoryStallCycles(void);
+void timeInstruction(instructionInfo *, long long, long long, bool);
+void printPipelineStatistics(void);
+void accessDRAM(int, int, bool, bool);
+void initializeDRAM(void);
+void printDRAMStatistics(void);
+int runBatch(int, char *[]);
+void readBatchInputs(const char *, batchPool *);
+void fillLane(batchPool *, int);
+void retireLane(batchPool *, int, const char *);
+int retireLanes(batchPool *, int, int, const char *);
+bool stepBatch(batchPool *);
+int executeBatchVector(batchPool *, int, int, int);
+void regroupLanes(batchPool *);
+int laneComparator(const void *, const void *);
 
 /*
  * Log the specifics of each cache action.
@@ -96,9 +610,24 @@ int evictLRU(int, stateType *);
  *  -    memoryToCache: reading data from the memory to the cache
  *  -    cacheToMemory: evicting cache data and writing it to the memory
  *  -    cacheToNowhere: evicting cache data and throwing it away
+ *  -    memoryToCacheByPrefetch: reading data from the memory to the cache ahead of use
+ *  -    memoryToStreamBuffer: fetching a block into a stream buffer ahead of use
+ *  -    streamBufferToCache: moving a stream buffer's oldest block into the cache on a miss
+ *  -    streamBufferToNowhere: dropping a stream buffer's blocks to follow a new stream
+ *  -    processorToMemory: writing a store through, or around, the cache to the memory
+ *  -    processorToWriteBuffer: the same, into the write buffer
+ *  -    cacheToWriteBuffer: evicting cache data into the write buffer
+ *  -    writeBufferToMemory: draining write buffer data to the memory
+ *  -    cacheToVictimCache: evicting cache data into the victim cache
+ *  -    victimCacheToCache: moving a block back from the victim cache on a miss
+ *  -    victimCacheToMemory: evicting victim cache data and writing it to the memory
+ *  -    victimCacheToNowhere: evicting victim cache data and throwing it away
  */
 void printAction(int address, int size, enum actionType type)
 {
+    if (quiet) {
+        return;
+    }
     printf("@@@ transferring word [%d-%d] ", address, address + size - 1);
 
     if (type == cacheToProcessor) {
@@ -116,6 +645,42 @@ void printAction(int address, int size, enum actionType type)
     else if (type == cacheToNowhere) {
         printf("from the cache to nowhere\n");
     }
+    else if (type == memoryToCacheByPrefetch) {
+        printf("from the memory to the cache by prefetch\n");
+    }
+    else if (type == memoryToStreamBuffer) {
+        printf("from the memory to a stream buffer\n");
+    }
+    else if (type == streamBufferToCache) {
+        printf("from a stream buffer to the cache\n");
+    }
+    else if (type == streamBufferToNowhere) {
+        printf("from a stream buffer to nowhere\n");
+    }
+    else if (type == processorToMemory) {
+        printf("from the processor to the memory\n");
+    }
+    else if (type == processorToWriteBuffer) {
+        printf("from the processor to the write buffer\n");
+    }
+    else if (type == cacheToWriteBuffer) {
+        printf("from the cache to the write buffer\n");
+    }
+    else if (type == writeBufferToMemory) {
+        printf("from the write buffer to the memory\n");
+    }
+    else if (type == cacheToVictimCache) {
+        printf("from the cache to the victim cache\n");
+    }
+    else if (type == victimCacheToCache) {
+        printf("from the victim cache to the cache\n");
+    }
+    else if (type == victimCacheToMemory) {
+        printf("from the victim cache to the memory\n");
+    }
+    else if (type == victimCacheToNowhere) {
+        printf("from the victim cache to nowhere\n");
+    }
 }
 
 /*
@@ -125,12 +690,12 @@ void printCache()
 {
   printf("\n@@@\ncache:\n");
 
-  for (int set = 0; set < cache.numSets; ++set) {
+  for (int set = 0; set < cache->numSets; ++set) {
     printf("\tset %i:\n", set);
-    for (int block = 0; block < cache.blocksPerSet; ++block) {
+    for (int block = 0; block < cache->blocksPerSet; ++block) {
       printf("\t\t[ %i ]: {", block);
-      for (int index = 0; index < cache.blockSize; ++index) {
-        printf(" %i", cache.blocks[set * cache.blocksPerSet + block].data[index]);
+      for (int index = 0; index < cache->blockSize; ++index) {
+        printf(" %i", cache->blocks[set * cache->blocksPerSet + block].data[index]);
       }
       printf(" }\n");
     }
@@ -163,7 +728,24 @@ int convertNum(int num) {
 }
 
 void exitProgram(const char* message) {
-    printf("\n%s\n", message);
+    /* a server job fails on its own without taking the server down */
+    if (jobErrorJump != NULL) {
+        jobError = message;
+        longjmp(*jobErrorJump, 1);
+    }
+    exitWithError("\n%s\n", message);
+}
+
+/* Prints an error and exits; inside the library the message goes back to
+   the lc2k call instead, see lc2k.h. */
+static void exitWithError(const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+#ifdef LC2K_LIBRARY
+    lc2kFail(format, arguments);
+#endif
+    vprintf(format, arguments);
+    va_end(arguments);
     exit(1);
 }
 
@@ -172,80 +754,250 @@ int isValidRegister(int reg) {
 }
 
 void initializeCache() {
+    if (cache == NULL) {
+        cache = malloc(sizeof(cacheStruct));
+    }
     for (int i = 0; i < MAX_CACHE_SIZE; i++) {
-        cache.blocks[i].lruLabel = 0;
-        cache.blocks[i].set = 0;
-        cache.blocks[i].tag = 0xdeadbeef;
-        cache.blocks[i].isDirty = false;
+        cache->blocks[i].lruLabel = 0;
+        cache->blocks[i].set = 0;
+        cache->blocks[i].tag = 0xdeadbeef;
+        cache->blocks[i].isDirty = false;
+        cache->blocks[i].isShared = false;
+        cache->blocks[i].isPrefetched = false;
         for (int j = 0; j < MAX_BLOCK_SIZE; j++) {
-            cache.blocks[i].data[j] = 0;
+            cache->blocks[i].data[j] = 0;
         }
     }
 }
 
+/* empties the blocks the current shape uses for the next run; their data
+   is overwritten when a block is filled, so unlike initializeCache this
+   leaves it alone */
+void resetCache() {
+    for (int i = 0; i < cache->numSets * cache->blocksPerSet; i++) {
+        cache->blocks[i].lruLabel = 0;
+        cache->blocks[i].set = 0;
+        cache->blocks[i].tag = 0xdeadbeef;
+        cache->blocks[i].isDirty = false;
+        cache->blocks[i].isShared = false;
+        cache->blocks[i].isPrefetched = false;
+    }
+    blockAccessTimestamp = 0;
+}
+
+/* block size and number of sets index the cache by bit fields, so both
+   must be powers of two */
+bool isValidCacheConfiguration(int blockSize, int numSets, int blocksPerSet) {
+    return blockSize >= 1 && blockSize <= MAX_BLOCK_SIZE && !(blockSize & (blockSize - 1)) &&
+           numSets >= 1 && !(numSets & (numSets - 1)) && blocksPerSet >= 1 &&
+           numSets * blocksPerSet <= MAX_CACHE_SIZE;
+}
+
 int load(int addr, stateType *state) {
-    return performCacheOperation(read, addr, 0, state);
+    if (mmuEnabled) {
+        addr = translate(addr, state);
+    }
+    return performCacheOperation(cacheRead, addr, 0, state);
 }
 
 void store(int addr, int val, stateType *state) {
-    performCacheOperation(save, addr, val, state);
+    if (mmuEnabled) {
+        addr = translate(addr, state);
+    }
+    performCacheOperation(cacheSave, addr, val, state);
+    if (addr >= storeHighWater) {
+        storeHighWater = addr + 1;
+    }
 }
 
 int getBlockHead(int addr) {
-    return ((addr/cache.blockSize) * cache.blockSize);
+    return ((addr/cache->blockSize) * cache->blockSize);
 }
 
 int performCacheOperation(enum cacheOperation op, int addr, int val, stateType *state) {
-    int blockOffset = addr & generateMask(logBase2(cache.blockSize));
-    int setIndex = (addr >> (int)logBase2(cache.blockSize)) & generateMask(logBase2(cache.numSets));
-    int tag = addr >> (int)(logBase2(cache.blockSize) + logBase2(cache.numSets));
+    if (addr < 0 || addr >= state->memorySize) {
+        exitProgram("Memory address out of bounds");
+    }
+    accessCount++;
+    if (writeBufferCount > 0) {
+        drainWriteBuffer(state, false);
+    }
+    int blockOffset = addr & generateMask(logBase2(cache->blockSize));
+    int setIndex = (addr >> (int)logBase2(cache->blockSize)) & generateMask(logBase2(cache->numSets));
+    int tag = addr >> (int)(logBase2(cache->blockSize) + logBase2(cache->numSets));
+    int data = val;
+    if (classifyMisses) {
+        classifyAccess(getBlockHead(addr), existsInCache(tag, setIndex));
+    }
     if (existsInCache(tag, setIndex)) {
-        if (op == read) {
+        cacheHits++;
+        bool prefetchHit = false;
+        if (prefetcher != noPrefetcher) {
+            blockStruct *block = findBlock(cache, tag, setIndex);
+            if (block->isPrefetched) {
+                usePrefetch(block->prefetchTime);
+                block->isPrefetched = false;
+                prefetchHit = true;
+            }
+        }
+        if (op == cacheRead) {
             printAction(addr, 1, cacheToProcessor);
-            int data = loadFromCache(tag, setIndex, blockOffset);
-            return data;
+            data = loadFromCache(tag, setIndex, blockOffset);
         } else {
+            if (coreCount > 1) {
+                blockStruct *block = findBlock(cache, tag, setIndex);
+                if (block->isShared) {
+                    coreStatistics[currentCore].upgrades++;
+                    snoopOtherCaches(state, tag, setIndex, true);
+                    block->isShared = false;
+                }
+            }
             printAction(addr, 1, processorToCache);
             saveToCache(tag, val, setIndex, blockOffset);
-            return val;
+            if (writeThrough) {
+                findBlock(cache, tag, setIndex)->isDirty = false;
+                writeToMemory(addr, &val, 1, processorToMemory, state);
+            }
+        }
+        if (prefetcher != noPrefetcher) {
+            trainPrefetcher(addr, false, prefetchHit, state);
         }
+        return data;
     }
-    bool foundValidBlock = false;
+    
+    /* a miss the victim cache or stream buffers can supply counts as a hit */
     int memBlockHead = getBlockHead(addr);
-    while (!foundValidBlock) {
-        int blockSetOffset = setIndex * cache.blocksPerSet;
+    enum actionType fillType = memoryToCache;
+    bool allocate = op == cacheRead || writeAllocate;
+    int victimData[MAX_BLOCK_SIZE];
+    bool victimDirty = false;
+    if (victimCacheSize > 0 && takeFromVictimCache(memBlockHead, victimData, &victimDirty)) {
+        fillType = victimCacheToCache;
+        allocate = true;
+        cacheHits++;
+        bufferHits++;
+    } else if (prefetcher == streamPrefetcher && allocate && takeFromStreamBuffer(memBlockHead)) {
+        fillType = streamBufferToCache;
+        cacheHits++;
+        bufferHits++;
+    } else {
+        cacheMisses++;
+        if (profileMisses != NULL) {
+            profileMisses[addr]++;
+        }
+    }
+    if (!allocate) {
+        writeToMemory(addr, &val, 1, processorToMemory, state);
+    } else {
+        bool isShared = coreCount > 1 && snoopOtherCaches(state, tag, setIndex, op == cacheSave);
+        blockStruct *block = fillBlock(memBlockHead, tag, setIndex, isShared, fillType,
+                                       fillType == victimCacheToCache ? victimData : NULL, state);
+        block->isDirty = victimDirty;
+        if (op == cacheRead) {
+            printAction(addr, 1, cacheToProcessor);
+            data = block->data[blockOffset];
+        } else {
+            printAction(addr, 1, processorToCache);
+            block->data[blockOffset] = val;
+            block->isDirty = !writeThrough;
+            if (writeThrough) {
+                writeToMemory(addr, &val, 1, processorToMemory, state);
+            }
+        }
+    }
+    if (prefetcher != noPrefetcher) {
+        trainPrefetcher(addr, fillType == memoryToCache, fillType == streamBufferToCache, state);
+    }
+    return data;
+}
+
+/* Brings the block at memBlockHead into its set, evicting the least
+   recently used block if the set is full, and logs the transfer as type.
+   The data comes from source, or from memory if source is NULL. */
+blockStruct *fillBlock(int memBlockHead, int tag, int setIndex, bool isShared, enum actionType type,
+                       const int *source, stateType *state) {
+    for (;;) {
+        int blockSetOffset = setIndex * cache->blocksPerSet;
         //printf("block set offset %d\n", blockSetOffset);
-        for (int i = blockSetOffset; i < blockSetOffset + cache.blocksPerSet; i++) {
-            if (cache.blocks[i].tag == 0xdeadbeef) {
+        for (int i = blockSetOffset; i < blockSetOffset + cache->blocksPerSet; i++) {
+            if (cache->blocks[i].tag == 0xdeadbeef) {
                 //printf("found deadbeef\n");
 
-                printAction(memBlockHead, cache.blockSize, memoryToCache);
-                int currentBlock = 0;
-                for (int j = memBlockHead; j < memBlockHead + cache.blockSize; j++) {
-                    cache.blocks[i].data[currentBlock++] = state->mem[j];
+                /* memory is only current once the block's buffered writes reach it */
+                for (int entry = 0; entry < writeBufferCount; entry++) {
+                    if (writeBuffer[entry].blockHead == memBlockHead) {
+                        drainWriteBufferEntry(entry, state);
+                        break;
+                    }
                 }
-                foundValidBlock = true;
-                cache.blocks[i].tag = tag;
-                cache.blocks[i].set = memBlockHead;
-                blockAccessTimestamp++;
-                cache.blocks[i].lruLabel = blockAccessTimestamp;
-                if (op == read) {
-                    printAction(addr, 1, cacheToProcessor);
-                    return cache.blocks[i].data[blockOffset];
+                if (type != streamBufferToCache && source == NULL) {
+                    traffic.wordsRead += cache->blockSize;
+                    if (dramEnabled) {
+                        accessDRAM(memBlockHead, cache->blockSize, false, type == memoryToCache);
+                    }
+                }
+                printAction(memBlockHead, cache->blockSize, type);
+                if (source != NULL) {
+                    memcpy(cache->blocks[i].data, source, cache->blockSize * sizeof(int));
                 } else {
-                    printAction(addr, 1, processorToCache);
-                    cache.blocks[i].data[blockOffset] = val;
-                    cache.blocks[i].isDirty = true;
-                    return val;
+                    int currentBlock = 0;
+                    for (int j = memBlockHead; j < memBlockHead + cache->blockSize; j++) {
+                        cache->blocks[i].data[currentBlock++] = state->mem[j];
+                    }
                 }
+                cache->blocks[i].tag = tag;
+                cache->blocks[i].set = memBlockHead;
+                cache->blocks[i].isShared = isShared;
+                cache->blocks[i].isPrefetched = false;
+                blockAccessTimestamp++;
+                cache->blocks[i].lruLabel = blockAccessTimestamp;
+                return &cache->blocks[i];
             }
         }
-        if (!foundValidBlock) {
-            //printf("evicting");
-            evictLRU(setIndex, state);
+        //printf("evicting");
+        evictLRU(setIndex, state);
+    }
+}
+
+/* the block of a cache holding tag in set setIndex, or NULL */
+blockStruct *findBlock(cacheStruct *target, int tag, int setIndex) {
+    int blockSetOffset = setIndex * target->blocksPerSet;
+    for (int i = blockSetOffset; i < blockSetOffset + target->blocksPerSet; i++) {
+        if (target->blocks[i].tag == tag) {
+            return &target->blocks[i];
         }
     }
-    return -1;
+    return NULL;
+}
+
+/* Tells the other cores' caches about the current core's miss on, or
+   write to, a block. A Modified copy is written back so memory holds the
+   current data. For a write every other copy is invalidated; for a read
+   they are all left Shared. Returns whether any other copy remains. */
+bool snoopOtherCaches(stateType *state, int tag, int setIndex, bool exclusive) {
+    bool isShared = false;
+    for (int core = 0; core < coreCount; core++) {
+        blockStruct *block = core == currentCore ? NULL : findBlock(&coreCaches[core], tag, setIndex);
+        if (block == NULL) {
+            continue;
+        }
+        if (block->isDirty || !block->isShared) {
+            coreStatistics[core].interventions++;
+        }
+        if (block->isDirty) {
+            memcpy(state->mem + block->set, block->data, cache->blockSize * sizeof(int));
+            block->isDirty = false;
+        }
+        if (exclusive) {
+            block->tag = 0xdeadbeef;
+            block->isShared = false;
+            coreStatistics[core].invalidations++;
+        } else {
+            block->isShared = true;
+            isShared = true;
+        }
+    }
+    return isShared;
 }
 
 double logBase2(int n) {
@@ -257,9 +1009,9 @@ int generateMask(double bits) {
 }
 
 bool existsInCache(int tag, int setIndex) {
-    int blockSetOffset = setIndex * cache.blocksPerSet;
-    for (int i = blockSetOffset; i < blockSetOffset + cache.blocksPerSet; i++) {
-        if (cache.blocks[i].tag == tag) {
+    int blockSetOffset = setIndex * cache->blocksPerSet;
+    for (int i = blockSetOffset; i < blockSetOffset + cache->blocksPerSet; i++) {
+        if (cache->blocks[i].tag == tag) {
             return true;
         }
     }
@@ -267,25 +1019,25 @@ bool existsInCache(int tag, int setIndex) {
 }
 
 int loadFromCache(int tag, int setIndex, int blockOffset) {
-    int blockSetOffset = setIndex * cache.blocksPerSet;
-    for (int i = blockSetOffset; i < blockSetOffset + cache.blocksPerSet; i++) {
-        if (cache.blocks[i].tag == tag) {
+    int blockSetOffset = setIndex * cache->blocksPerSet;
+    for (int i = blockSetOffset; i < blockSetOffset + cache->blocksPerSet; i++) {
+        if (cache->blocks[i].tag == tag) {
             blockAccessTimestamp++;
-            cache.blocks[i].lruLabel = blockAccessTimestamp;
-            return cache.blocks[i].data[blockOffset];
+            cache->blocks[i].lruLabel = blockAccessTimestamp;
+            return cache->blocks[i].data[blockOffset];
         }
     }
     return -1;
 }
 
 void saveToCache(int tag, int value, int setIndex, int blockOffset) {
-    int blockSetOffset = setIndex * cache.blocksPerSet;
-    for (int i = blockSetOffset; i < blockSetOffset + cache.blocksPerSet; i++) {
-        if (cache.blocks[i].tag == tag) {
-            cache.blocks[i].data[blockOffset] = value;
-            cache.blocks[i].isDirty = true;
+    int blockSetOffset = setIndex * cache->blocksPerSet;
+    for (int i = blockSetOffset; i < blockSetOffset + cache->blocksPerSet; i++) {
+        if (cache->blocks[i].tag == tag) {
+            cache->blocks[i].data[blockOffset] = value;
+            cache->blocks[i].isDirty = true;
             blockAccessTimestamp++;
-            cache.blocks[i].lruLabel = blockAccessTimestamp;
+            cache->blocks[i].lruLabel = blockAccessTimestamp;
             break;
         }
     }
@@ -298,173 +1050,2154 @@ int blockComparator(const void *block1, const void *block2) {
 }
 
 int evictLRU(int setIndex, stateType *state) {
-    int blockSetOffset = setIndex * cache.blocksPerSet;
-    qsort(&cache.blocks[blockSetOffset], cache.blocksPerSet, sizeof(blockStruct), blockComparator);
-    int memBlockHead = cache.blocks[blockSetOffset].set;
-    cache.blocks[blockSetOffset].tag = 0xdeadbeef;
-    if (cache.blocks[blockSetOffset].isDirty) {
-        printAction(memBlockHead, cache.blockSize, cacheToMemory);
-        int currentBlock = 0;
-        for (int j = memBlockHead; j < memBlockHead + cache.blockSize; j++) {
-            state->mem[j] = cache.blocks[blockSetOffset].data[currentBlock++];
-        }
-        cache.blocks[blockSetOffset].isDirty = false;
+    int blockSetOffset = setIndex * cache->blocksPerSet;
+    qsort(&cache->blocks[blockSetOffset], cache->blocksPerSet, sizeof(blockStruct), blockComparator);
+    int memBlockHead = cache->blocks[blockSetOffset].set;
+    cache->blocks[blockSetOffset].tag = 0xdeadbeef;
+    if (cache->blocks[blockSetOffset].isPrefetched) {
+        prefetchStatistics.unused++;
+    }
+    if (victimCacheSize > 0) {
+        insertVictim(&cache->blocks[blockSetOffset], state);
+        cache->blocks[blockSetOffset].isDirty = false;
+        return 0;
+    }
+    if (cache->blocks[blockSetOffset].isDirty) {
+        writeToMemory(memBlockHead, cache->blocks[blockSetOffset].data, cache->blockSize, cacheToMemory, state);
+        cache->blocks[blockSetOffset].isDirty = false;
         return 0;
     } else {
-        printAction(memBlockHead, cache.blockSize, cacheToNowhere);
+        printAction(memBlockHead, cache->blockSize, cacheToNowhere);
         return 0;
     }
 }
 
+/* Writes size words starting at address, all in one block, to memory:
+   straight there, logged as type, or into the write buffer if there is
+   one. */
+void writeToMemory(int address, const int *data, int size, enum actionType type, stateType *state) {
+    if (writeBufferSize == 0) {
+        printAction(address, size, type);
+        memcpy(state->mem + address, data, size * sizeof(int));
+        traffic.wordsWritten += size;
+        if (dramEnabled) {
+            accessDRAM(address, size, true, true);
+        }
+        return;
+    }
+    
+    printAction(address, size, type == processorToMemory ? processorToWriteBuffer : cacheToWriteBuffer);
+    traffic.bufferedWrites++;
+    int blockHead = getBlockHead(address);
+    writeBufferEntry *entry = NULL;
+    for (int i = 0; i < writeBufferCount; i++) {
+        if (writeBuffer[i].blockHead == blockHead) {
+            entry = &writeBuffer[i];
+            traffic.coalescedWrites++;
+            break;
+        }
+    }
+    if (entry == NULL) {
+        if (writeBufferCount == writeBufferSize) {
+            /* the store waits for the oldest entry to finish draining */
+            long long wait = lastDrain + WRITE_BUFFER_DRAIN_TIME - accessCount;
+            traffic.stalls++;
+            traffic.stallTime += wait > 0 ? wait : 0;
+            drainWriteBufferEntry(0, state);
+            lastDrain = accessCount;
+        }
+        if (writeBufferCount == 0) {
+            lastDrain = accessCount;
+        }
+        entry = &writeBuffer[writeBufferCount++];
+        entry->blockHead = blockHead;
+        memset(entry->isWritten, 0, sizeof(entry->isWritten));
+    }
+    for (int i = 0; i < size; i++) {
+        entry->isWritten[address - blockHead + i] = true;
+        entry->data[address - blockHead + i] = data[i];
+    }
+}
 
-/*
- !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
- !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
- !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
- !!!!!!!!!!!!        MAIN FUNCTION       !!!!!!!!!!!!
- !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
- !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
- !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
- !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
- */
+/* writes one entry's words to memory, logging each run of them */
+void drainWriteBufferEntry(int index, stateType *state) {
+    writeBufferEntry *entry = &writeBuffer[index];
+    for (int i = 0; i < cache->blockSize; i++) {
+        if (!entry->isWritten[i]) {
+            continue;
+        }
+        int run = i;
+        while (run < cache->blockSize && entry->isWritten[run]) {
+            state->mem[entry->blockHead + run] = entry->data[run];
+            run++;
+        }
+        printAction(entry->blockHead + i, run - i, writeBufferToMemory);
+        traffic.wordsWritten += run - i;
+        if (dramEnabled) {
+            accessDRAM(entry->blockHead + i, run - i, true, false);
+        }
+        i = run;
+    }
+    writeBufferCount--;
+    memmove(entry, entry + 1, (writeBufferCount - index) * sizeof(writeBufferEntry));
+}
 
+/* drains the entries whose time has come, oldest first, or all of them */
+void drainWriteBuffer(stateType *state, bool all) {
+    while (writeBufferCount > 0 && (all || accessCount - lastDrain >= WRITE_BUFFER_DRAIN_TIME)) {
+        drainWriteBufferEntry(0, state);
+        lastDrain += WRITE_BUFFER_DRAIN_TIME;
+    }
+}
 
-int main(int argc, char *argv[]) {
-    char line[MAXLINELENGTH];
-    stateType state = {0};
-    FILE *filePtr;
-    
-    if (argc != 5) {
-        printf("error: usage: %s <machine-code file> blockSizeInWords numberOfSets blocksPerSet\n", argv[0]);
-        exit(1);
+void printTraffic() {
+    printf("%s, %s: %lld words read from memory, %lld words written to memory\n",
+           writeThrough ? "write-through" : "write-back", writeAllocate ? "write-allocate" : "no-write-allocate",
+           traffic.wordsRead, traffic.wordsWritten);
+    if (writeBufferSize > 0) {
+        printf("write buffer of %d: %lld writes, %lld coalesced, %lld stalls for %lld accesses\n", writeBufferSize,
+               traffic.bufferedWrites, traffic.coalescedWrites, traffic.stalls, traffic.stallTime);
     }
-    
-    filePtr = fopen(argv[1], "r");
-    if (filePtr == NULL) {
-        printf("error: can't open file %s", argv[1]);
-        perror("fopen");
-        exit(1);
+}
+
+/* moves a block evicted from the cache into the victim cache, evicting
+   the victim cache's least recently used block if it is full */
+void insertVictim(blockStruct *block, stateType *state) {
+    victimEntry *entry = &victimCache[0];
+    if (victimCacheCount < victimCacheSize) {
+        entry = &victimCache[victimCacheCount++];
+    } else {
+        for (int i = 1; i < victimCacheCount; i++) {
+            if (victimCache[i].lruLabel < entry->lruLabel) {
+                entry = &victimCache[i];
+            }
+        }
+        if (entry->isDirty) {
+            writeToMemory(entry->blockHead, entry->data, cache->blockSize, victimCacheToMemory, state);
+            victimStatistics.writebacks++;
+        } else {
+            printAction(entry->blockHead, cache->blockSize, victimCacheToNowhere);
+        }
     }
-    
-    /* read the entire machine-code file into memory */
-    for (state.numMemory = 0; fgets(line, MAXLINELENGTH, filePtr) != NULL;
-         state.numMemory++) {
-        
-        if (sscanf(line, "%d", state.mem+state.numMemory) != 1) {
-            printf("error in reading address %d\n", state.numMemory);
-            exit(1);
+    printAction(block->set, cache->blockSize, cacheToVictimCache);
+    entry->blockHead = block->set;
+    entry->isDirty = block->isDirty;
+    memcpy(entry->data, block->data, cache->blockSize * sizeof(int));
+    blockAccessTimestamp++;
+    entry->lruLabel = blockAccessTimestamp;
+    victimStatistics.insertions++;
+}
+
+/* on a miss, takes the block out of the victim cache if it is there */
+bool takeFromVictimCache(int memBlockHead, int *data, bool *isDirty) {
+    for (int i = 0; i < victimCacheCount; i++) {
+        if (victimCache[i].blockHead == memBlockHead) {
+            memcpy(data, victimCache[i].data, cache->blockSize * sizeof(int));
+            *isDirty = victimCache[i].isDirty;
+            victimCache[i] = victimCache[--victimCacheCount];
+            victimStatistics.hits++;
+            return true;
         }
-        //printf("memory[%d]=%d\n", state.numMemory, state.mem[state.numMemory]);
     }
-    
-    initializeCache();
-    cache.blockSize = atoi(argv[2]);
-    cache.numSets = atoi(argv[3]);
-    cache.blocksPerSet = atoi(argv[4]);
-    
-    for (int i = 0; i < NUMREGS; i++) {
-        state.reg[i] = 0;
+    victimStatistics.misses++;
+    return false;
+}
+
+/* sorts a miss of the cache into the 3Cs, and runs every access through
+   the shadow cache */
+void classifyAccess(int memBlockHead, bool hit) {
+    missClassifier *shadow = &classifier;
+    int found = -1;
+    int leastRecent = 0;
+    for (int i = 0; i < shadow->count; i++) {
+        if (shadow->blocks[i] == memBlockHead) {
+            found = i;
+            break;
+        }
+        if (shadow->lastUsed[i] < shadow->lastUsed[leastRecent]) {
+            leastRecent = i;
+        }
     }
-    state.pc = 0;
-    int done = 0;
-    int totalInstructions = 0;
-    int haltInstruction = 0;
-    instructionInfo instructionDetails;
-    
-    //printState(&state);
-    
-    while (!done) {
-        //int value = state.mem[state.pc];
-        int value = load(state.pc, &state);
-        instructionDetails.opcode = value >> 22 & BITMASK_FOR_PARSING_MACHINE_CODE;
-        instructionDetails.arg0 = value >> 19 & BITMASK_FOR_PARSING_MACHINE_CODE;
-        instructionDetails.arg1 = value >> 16 & BITMASK_FOR_PARSING_MACHINE_CODE;
-        instructionDetails.arg2 = value & BITMASK_BITS_ZERO_TO_FIFTEEN;
-        totalInstructions++;
-        state.pc++;
-        if (state.pc >= NUMMEMORY) {
-            exitProgram("Program counter out of bounds");
+    if (!hit) {
+        if (!shadow->seen[memBlockHead]) {
+            shadow->compulsory++;
+        } else if (found < 0) {
+            shadow->capacity++;
+        } else {
+            shadow->conflict++;
         }
-        
-        
-        switch (instructionDetails.opcode) {
-            case 0:
-            case 1: {
-                if (!isValidRegister(instructionDetails.arg0) || !isValidRegister(instructionDetails.arg1) ||
-                    !isValidRegister(instructionDetails.arg2)) {
-                    exitProgram("Invalid register");
-                }
-                if (instructionDetails.opcode == 0) {
-                    state.reg[instructionDetails.arg2] = state.reg[instructionDetails.arg0] +
-                    state.reg[instructionDetails.arg1];
-                } else if (instructionDetails.opcode == 1) {
-                    state.reg[instructionDetails.arg2] = ~(state.reg[instructionDetails.arg0] |
-                                                           state.reg[instructionDetails.arg1]);
-                } else {
-                    exitProgram("Invalid RType opcode");
-                }
-                break;
-            }
-            case 2:
-            case 3:
-            case 4: {
-                int offset = convertNum(instructionDetails.arg2);
-                
-                if (offset < MIN_OFFSET || offset > MAX_OFFSET) {
-                    exitProgram("Offset out of bounds");
-                }
-                if (!isValidRegister(instructionDetails.arg0) || !isValidRegister(instructionDetails.arg1)) {
-                    exitProgram("Invalid register");
-                }
-                if (instructionDetails.opcode == 2) {
-                    //state.reg[instructionDetails.arg1] = state.mem[state.reg[instructionDetails.arg0] + offset];
-                    int data = load(state.reg[instructionDetails.arg0] + offset, &state);
-                    state.reg[instructionDetails.arg1] = data;
-                } else if (instructionDetails.opcode == 3) {
-                    //state.mem[state.reg[instructionDetails.arg0] + offset] = state.reg[instructionDetails.arg1];
-                    store(state.reg[instructionDetails.arg0] + offset, state.reg[instructionDetails.arg1], &state);
-                } else if (instructionDetails.opcode == 4) {
-                    if (state.reg[instructionDetails.arg0] == state.reg[instructionDetails.arg1]) {
-                        state.pc += offset;
-                    }
-                } else {
-                    exitProgram("Invalid IType opcode");
-                }
-                break;
-            }
-            case 5: {
-                if (instructionDetails.opcode == 5) {
-                    state.reg[instructionDetails.arg1] = state.pc;
-                    state.pc = state.reg[instructionDetails.arg0];
-                } else {
-                    exitProgram("Invalid JType opcode");
-                }
-                break;
-            }
-            case 6: {
-                haltInstruction = 1;
-                done = 1;
-                break;
-            }
-            case 7: {
-                break;
-            }
-                
-            default:
-                exitProgram("Unsupported opcode");
+    }
+    shadow->seen[memBlockHead] = true;
+    if (found < 0) {
+        found = shadow->count < shadow->size ? shadow->count++ : leastRecent;
+        shadow->blocks[found] = memBlockHead;
+    }
+    shadow->lastUsed[found] = ++shadow->time;
+}
+
+/* empties the victim cache and shadow cache and clears their counts */
+void resetMissAnalysis(stateType *state) {
+    free(victimCache);
+    victimCache = calloc(victimCacheSize, sizeof(victimEntry));
+    victimCacheCount = 0;
+    memset(&victimStatistics, 0, sizeof(victimStatistics));
+    if (classifyMisses) {
+        free(classifier.blocks);
+        free(classifier.lastUsed);
+        free(classifier.seen);
+        memset(&classifier, 0, sizeof(classifier));
+        classifier.size = cache->numSets * cache->blocksPerSet;
+        classifier.blocks = malloc(classifier.size * sizeof(int));
+        classifier.lastUsed = malloc(classifier.size * sizeof(long long));
+        classifier.seen = calloc(state->memorySize, sizeof(bool));
+    }
+}
+
+void printMissAnalysis() {
+    if (victimCacheSize > 0) {
+        printf("victim cache of %d: %lld hits, %lld misses, %lld blocks in, %lld written back\n", victimCacheSize,
+               victimStatistics.hits, victimStatistics.misses, victimStatistics.insertions,
+               victimStatistics.writebacks);
+    }
+    if (classifyMisses) {
+        missClassifier *shadow = &classifier;
+        printf("%lld cache misses: %lld compulsory, %lld capacity, %lld conflict\n",
+               shadow->compulsory + shadow->capacity + shadow->conflict, shadow->compulsory, shadow->capacity,
+               shadow->conflict);
+    }
+}
+
+/* turns a program address into a physical one */
+int translate(int addr, stateType *state) {
+    if (addr < 0 || addr >= virtualSize) {
+        exitProgram("Memory address out of bounds");
+    }
+    int page = addr >> pageBits;
+    int frame = -1;
+    int level = 0;
+    tlbTime++;
+    for (; level < tlbLevelCount && frame < 0; level++) {
+        frame = lookupTLB(&tlbLevels[level], page);
+    }
+    if (frame < 0) {
+        frame = walkPageTable(page, state);
+        level++;
+    }
+    for (int i = 0; i < level - 1; i++) {
+        fillTLB(&tlbLevels[i], page, frame);
+    }
+    return (frame << pageBits) | (addr & (pageSize - 1));
+}
+
+/* the frame a TLB level holds for page, or -1 */
+int lookupTLB(tlbLevel *tlb, int page) {
+    tlbEntry *set = tlb->entries + (page % (tlb->numEntries / tlb->ways)) * tlb->ways;
+    for (int i = 0; i < tlb->ways; i++) {
+        if (set[i].page == page) {
+            set[i].lastUsed = tlbTime;
+            tlb->hits++;
+            return set[i].frame;
         }
-        
-        
-        if (!haltInstruction) {
-            //printState(&state);
+    }
+    tlb->misses++;
+    return -1;
+}
+
+void fillTLB(tlbLevel *tlb, int page, int frame) {
+    tlbEntry *set = tlb->entries + (page % (tlb->numEntries / tlb->ways)) * tlb->ways;
+    tlbEntry *victim = NULL;
+    for (int i = 0; i < tlb->ways && victim == NULL; i++) {
+        if (set[i].page < 0) {
+            victim = &set[i];
         }
     }
-    
-    /*printf("machine halted\n");
-    printf("total of %d instructions executed\n", totalInstructions);
-    printf("final state of machine:\n");
-    printState(&state);*/
-    
-    return(0);
+    if (victim == NULL && tlb->replacement == tlbRandom) {
+        tlbRandomState ^= tlbRandomState << 13;
+        tlbRandomState ^= tlbRandomState >> 17;
+        tlbRandomState ^= tlbRandomState << 5;
+        victim = &set[tlbRandomState % tlb->ways];
+    } else if (victim == NULL) {
+        victim = &set[0];
+        for (int i = 1; i < tlb->ways; i++) {
+            long long age = tlb->replacement == tlbLRU ? set[i].lastUsed : set[i].filled;
+            if (age < (tlb->replacement == tlbLRU ? victim->lastUsed : victim->filled)) {
+                victim = &set[i];
+            }
+        }
+    }
+    victim->page = page;
+    victim->frame = frame;
+    victim->lastUsed = victim->filled = tlbTime;
+}
+
+/* loads page's entry from the page table through the cache */
+int walkPageTable(int page, stateType *state) {
+    long long misses = cacheMisses;
+    int pc = accessPC;
+    mmuStatistics.walks++;
+    mmuStatistics.walkAccesses++;
+    accessPC = -1;
+    int entry = performCacheOperation(cacheRead, pageTableBase + page, 0, state);
+    accessPC = pc;
+    mmuStatistics.walkMisses += cacheMisses - misses;
+    if (!(entry & 1)) {
+        exitProgram("Page fault");
+    }
+    return entry >> 1;
 }
 
+/* puts the page table past the end of the program's memory and empties
+   the TLBs */
+void initializeMMU(stateType *state) {
+    int pages = state->memorySize / pageSize;
+    virtualSize = state->memorySize;
+    pageTableBase = state->memorySize;
+    state->mem = realloc(state->mem, (state->memorySize + pages) * sizeof(int));
+    for (int page = 0; page < pages; page++) {
+        state->mem[pageTableBase + page] = (page << 1) | 1;
+    }
+    state->memorySize += pages;
+    for (pageBits = 0; (1 << pageBits) < pageSize; pageBits++) {
+    }
+    for (int level = 0; level < tlbLevelCount; level++) {
+        tlbLevel *tlb = &tlbLevels[level];
+        for (int i = 0; i < tlb->numEntries; i++) {
+            tlb->entries[i].page = -1;
+        }
+        tlb->hits = tlb->misses = 0;
+    }
+    tlbTime = 0;
+    memset(&mmuStatistics, 0, sizeof(mmuStatistics));
+}
+
+void printMMUStatistics() {
+    printf("mmu: pages of %d words, page table at %d\n", pageSize, pageTableBase);
+    for (int level = 0; level < tlbLevelCount; level++) {
+        tlbLevel *tlb = &tlbLevels[level];
+        printf("tlb level %d (%d entries, %d-way, %s): %lld hits, %lld misses\n", level + 1, tlb->numEntries,
+               tlb->ways, tlbReplacementNames[tlb->replacement], tlb->hits, tlb->misses);
+    }
+    printf("page walks: %lld, %lld memory accesses, %lld missed in the cache\n", mmuStatistics.walks,
+           mmuStatistics.walkAccesses, mmuStatistics.walkMisses);
+}
+
+/* predicts a beq at pc, counts the outcome and trains the predictor;
+   returns whether the prediction was wrong */
+bool observeBranch(int pc, bool taken) {
+    unsigned int mask = (1u << predictorBits) - 1;
+    unsigned int index = pc & mask;
+    unsigned int globalIndex = (pc ^ branchHistory) & mask;
+    bool bimodalGuess = bimodalCounters != NULL && bimodalCounters[index] >= 2;
+    bool gshareGuess = gshareCounters != NULL && gshareCounters[globalIndex] >= 2;
+    bool prediction;
+    
+    switch (predictor) {
+        case takenPredictor:
+            prediction = true;
+            break;
+        case bimodalPredictor:
+            prediction = bimodalGuess;
+            break;
+        case gsharePredictor:
+            prediction = gshareGuess;
+            break;
+        case tournamentPredictor:
+            prediction = chooserCounters[index] >= 2 ? gshareGuess : bimodalGuess;
+            break;
+        default:
+            prediction = false;
+    }
+    
+    branchStats *statistics = &branchStatistics[pc];
+    statistics->executed++;
+    beqTotals.executed++;
+    if (taken) {
+        statistics->taken++;
+        beqTotals.taken++;
+    }
+    if (prediction != taken) {
+        statistics->mispredicted++;
+        beqTotals.mispredicted++;
+    }
+    
+    if (bimodalCounters != NULL) {
+        updateCounter(&bimodalCounters[index], taken);
+    }
+    if (gshareCounters != NULL) {
+        updateCounter(&gshareCounters[globalIndex], taken);
+        branchHistory = ((branchHistory << 1) | taken) & ((1u << historyBits) - 1);
+    }
+    if (chooserCounters != NULL && bimodalGuess != gshareGuess) {
+        updateCounter(&chooserCounters[index], gshareGuess == taken);
+    }
+    return prediction != taken;
+}
+
+/* predicts the target of a jalr at pc through register regA, linking in
+   regB, and counts whether it was right; returns whether it was wrong */
+bool observeJump(int pc, int target, int regA, int regB) {
+    int prediction = -1;
+    if (rasCount > 0 && returnStack[rasTop].linkRegister == regA) {
+        prediction = returnStack[rasTop].address;
+        rasTop = (rasTop + rasDepth - 1) % rasDepth;
+        rasCount--;
+        returnPredictions++;
+    } else {
+        if (btbSize > 0) {
+            btbEntry *entry = &branchTargetBuffer[pc % btbSize];
+            if (entry->pc == pc) {
+                prediction = entry->target;
+            }
+            entry->pc = pc;
+            entry->target = target;
+        }
+        if (rasDepth > 0) {
+            /* a full stack loses its oldest entry */
+            rasTop = (rasTop + 1) % rasDepth;
+            returnStack[rasTop].address = pc + 1;
+            returnStack[rasTop].linkRegister = regB;
+            if (rasCount < rasDepth) {
+                rasCount++;
+            }
+        }
+    }
+    
+    branchStats *statistics = &branchStatistics[pc];
+    statistics->executed++;
+    statistics->taken++;
+    jalrTotals.executed++;
+    jalrTotals.taken++;
+    if (prediction != target) {
+        statistics->mispredicted++;
+        jalrTotals.mispredicted++;
+    }
+    return prediction != target;
+}
+
+/* moves a 2-bit saturating counter towards taken or not taken */
+void updateCounter(unsigned char *counter, bool taken) {
+    if (taken && *counter < 3) {
+        (*counter)++;
+    } else if (!taken && *counter > 0) {
+        (*counter)--;
+    }
+}
+
+/* sizes the predictor tables, each counter starting weakly not taken,
+   and clears the counts */
+void initializePredictors(stateType *state) {
+    int entries = 1 << predictorBits;
+    free(bimodalCounters);
+    free(gshareCounters);
+    free(chooserCounters);
+    bimodalCounters = gshareCounters = chooserCounters = NULL;
+    if (predictor == bimodalPredictor || predictor == tournamentPredictor) {
+        bimodalCounters = malloc(entries);
+        memset(bimodalCounters, 1, entries);
+    }
+    if (predictor == gsharePredictor || predictor == tournamentPredictor) {
+        gshareCounters = malloc(entries);
+        memset(gshareCounters, 1, entries);
+    }
+    if (predictor == tournamentPredictor) {
+        chooserCounters = malloc(entries);
+        memset(chooserCounters, 1, entries);
+    }
+    if (historyBits == 0) {
+        historyBits = predictorBits;
+    }
+    branchHistory = 0;
+    
+    free(branchTargetBuffer);
+    branchTargetBuffer = malloc(btbSize * sizeof(btbEntry));
+    for (int i = 0; i < btbSize; i++) {
+        branchTargetBuffer[i].pc = -1;
+    }
+    free(returnStack);
+    returnStack = malloc(rasDepth * sizeof(returnEntry));
+    rasCount = rasTop = 0;
+    
+    free(branchStatistics);
+    branchStatistics = calloc(state->memorySize, sizeof(branchStats));
+    memset(&beqTotals, 0, sizeof(beqTotals));
+    memset(&jalrTotals, 0, sizeof(jalrTotals));
+    returnPredictions = 0;
+}
+
+void printBranchStatistics(stateType *state) {
+    if (predictor != noPredictor) {
+        printf("beq prediction (%s", predictorNames[predictor]);
+        if (predictor >= bimodalPredictor) {
+            printf(", %d counters", 1 << predictorBits);
+        }
+        if (predictor >= gsharePredictor) {
+            printf(", %d history bits", historyBits);
+        }
+        printf("): %lld executed, %lld taken, %lld mispredicted, accuracy %.1f%%\n", beqTotals.executed,
+               beqTotals.taken, beqTotals.mispredicted,
+               beqTotals.executed ? 100.0 * (beqTotals.executed - beqTotals.mispredicted) / beqTotals.executed : 0.0);
+    }
+    if (btbSize > 0 || rasDepth > 0) {
+        printf("jalr prediction (%d btb entries, %d return stack entries): %lld executed, %lld returns, "
+               "%lld mispredicted, accuracy %.1f%%\n", btbSize, rasDepth, jalrTotals.executed, returnPredictions,
+               jalrTotals.mispredicted,
+               jalrTotals.executed ? 100.0 * (jalrTotals.executed - jalrTotals.mispredicted) / jalrTotals.executed
+                                   : 0.0);
+    }
+    for (int pc = 0; pc < state->memorySize; pc++) {
+        branchStats *statistics = &branchStatistics[pc];
+        if (statistics->executed > 0) {
+            printf("branch at %d: %lld executed, %lld taken, %lld mispredicted, accuracy %.1f%%\n", pc,
+                   statistics->executed, statistics->taken, statistics->mispredicted,
+                   100.0 * (statistics->executed - statistics->mispredicted) / statistics->executed);
+        }
+    }
+}
+
+/* the stall cycles of every access so far; the difference across an
+   access is what it stalled the pipeline */
+long long memoryStallCycles() {
+    long long memoryCycles = dramEnabled ? dramStatistics.demandCycles : cacheMisses * missPenalty;
+    return memoryCycles + (bufferHits * bufferPenalty);
+}
+
+/* adds the cycles of one instruction, given its fetch and data stalls and
+   whether it was a mispredicted beq or jalr */
+void timeInstruction(instructionInfo *instruction, long long fetchStall, long long dataStall, bool mispredicted) {
+    pipelineStats *statistics = &pipelineStatistics;
+    int opcode = instruction->opcode;
+    bool readsRegA = opcode <= 5;
+    bool readsRegB = opcode <= 1 || opcode == 3 || opcode == 4;
+    long long cycles = 1;
+    
+    if (loadDestination >= 0 && ((readsRegA && instruction->arg0 == loadDestination) ||
+                                 (readsRegB && instruction->arg1 == loadDestination))) {
+        statistics->loadUse++;
+        cycles++;
+    }
+    loadDestination = opcode == 2 ? instruction->arg1 : -1;
+    if (mispredicted) {
+        if (opcode == 4) {
+            statistics->branch += BRANCH_PENALTY;
+        } else {
+            statistics->jump += BRANCH_PENALTY;
+        }
+        cycles += BRANCH_PENALTY;
+    }
+    statistics->fetchMiss += fetchStall;
+    statistics->dataMiss += dataStall;
+    statistics->instructions++;
+    statistics->cycles += cycles + fetchStall + dataStall;
+}
+
+void printPipelineStatistics() {
+    pipelineStats *statistics = &pipelineStatistics;
+    /* the last instruction leaves WB PIPELINE_DEPTH - 1 cycles after it is fetched */
+    long long cycles = statistics->cycles + PIPELINE_DEPTH - 1;
+    printf("pipeline (miss penalty %d, buffer penalty %d): %lld instructions, %lld cycles, CPI %.3f\n", missPenalty,
+           bufferPenalty, statistics->instructions, cycles,
+           statistics->instructions ? (double) cycles / statistics->instructions : 0.0);
+    printf("stall cycles: %lld load-use, %lld beq mispredictions, %lld jalr mispredictions, "
+           "%lld fetch misses, %lld data misses, %lld filling the pipeline\n", statistics->loadUse,
+           statistics->branch, statistics->jump, statistics->fetchMiss, statistics->dataMiss,
+           (long long) PIPELINE_DEPTH - 1);
+}
+
+/* times a transfer of size words starting at address to or from DRAM,
+   splitting it at row boundaries */
+void accessDRAM(int address, int size, bool isWrite, bool isDemand) {
+    dramStats *statistics = &dramStatistics;
+    while (size > 0) {
+        int row = address / dramRowSize;
+        int bank = row % dramBanks;
+        int words = dramRowSize - (address % dramRowSize);
+        if (words > size) {
+            words = size;
+        }
+        
+        long long cycles = tCAS;
+        if (openRows[bank] == row) {
+            statistics->rowHits++;
+        } else if (openRows[bank] < 0) {
+            statistics->rowMisses++;
+            cycles += tRCD;
+        } else {
+            statistics->rowConflicts++;
+            cycles += tRP + tRCD;
+        }
+        openRows[bank] = closedPage ? -1 : row;
+        int bursts = (words + burstLength - 1) / burstLength;
+        long long transfer = (long long) bursts * ((burstLength + 1) / 2);
+        cycles += transfer;
+        
+        statistics->accesses++;
+        statistics->busCycles += transfer;
+        if (isWrite) {
+            statistics->wordsWritten += words;
+        } else {
+            statistics->wordsRead += words;
+        }
+        if (isDemand) {
+            statistics->demandAccesses++;
+            statistics->demandCycles += cycles;
+        }
+        address += words;
+        size -= words;
+    }
+}
+
+void initializeDRAM() {
+    for (int bank = 0; bank < MAX_DRAM_BANKS; bank++) {
+        openRows[bank] = -1;
+    }
+    memset(&dramStatistics, 0, sizeof(dramStatistics));
+}
+
+void printDRAMStatistics() {
+    dramStats *statistics = &dramStatistics;
+    long long accesses = cacheHits + cacheMisses;
+    long long rowAccesses = statistics->rowHits + statistics->rowMisses + statistics->rowConflicts;
+    /* the run takes a cycle per access plus its memory stalls, unless the
+       pipeline timed it */
+    long long cycles = pipelineEnabled ? pipelineStatistics.cycles + PIPELINE_DEPTH - 1
+                                       : accesses + memoryStallCycles();
+    printf("dram (%d banks, rows of %d words, %s page, tRCD %d tCAS %d tRP %d, bursts of %d): "
+           "%lld accesses, %lld row hits, %lld row misses, %lld row conflicts, row buffer hit rate %.1f%%\n",
+           dramBanks, dramRowSize, closedPage ? "closed" : "open", tRCD, tCAS, tRP, burstLength,
+           statistics->accesses, statistics->rowHits, statistics->rowMisses, statistics->rowConflicts,
+           rowAccesses ? 100.0 * statistics->rowHits / rowAccesses : 0.0);
+    printf("average memory access time: %.2f cycles (%lld accesses, %lld demand dram accesses for %lld cycles)\n",
+           accesses ? 1.0 + (double) memoryStallCycles() / accesses : 0.0, accesses, statistics->demandAccesses,
+           statistics->demandCycles);
+    printf("bandwidth: %lld words read, %lld words written in %lld bus cycles of %lld, %.1f%% of peak\n",
+           statistics->wordsRead, statistics->wordsWritten, statistics->busCycles, cycles,
+           cycles ? 100.0 * statistics->busCycles / cycles : 0.0);
+}
+
+/* fetches the block holding address into the cache ahead of use, unless
+   it is already there or outside memory */
+void prefetchBlock(int address, stateType *state) {
+    if (address < 0 || address >= state->memorySize) {
+        return;
+    }
+    int setIndex = (address >> (int)logBase2(cache->blockSize)) & generateMask(logBase2(cache->numSets));
+    int tag = address >> (int)(logBase2(cache->blockSize) + logBase2(cache->numSets));
+    if (existsInCache(tag, setIndex)) {
+        return;
+    }
+    /* a block in the victim cache may be newer than memory */
+    for (int i = 0; i < victimCacheCount; i++) {
+        if (victimCache[i].blockHead == getBlockHead(address)) {
+            return;
+        }
+    }
+    blockStruct *block = fillBlock(getBlockHead(address), tag, setIndex, false, memoryToCacheByPrefetch, NULL, state);
+    block->isPrefetched = true;
+    block->prefetchTime = accessCount;
+    prefetchStatistics.issued++;
+}
+
+/* counts the first use of a block prefetched at prefetchTime */
+void usePrefetch(long long prefetchTime) {
+    long long lead = accessCount - prefetchTime;
+    prefetchStatistics.useful++;
+    prefetchStatistics.lead += lead;
+    if (lead < PREFETCH_LATENCY) {
+        prefetchStatistics.late++;
+    }
+}
+
+/*
+ * Lets the prefetcher see an access to addr, after the access is done.
+ * missed is whether it went to memory; prefetchHit whether it was the
+ * first use of a prefetched block.
+ *  -    next-line: on a miss or a first use of a prefetched block, fetches
+ *       the prefetchDegree blocks starting prefetchDistance blocks ahead
+ *  -    stride: once a lw or sw has moved by the same stride twice in a
+ *       row, fetches prefetchDegree strides starting prefetchDistance ahead
+ *  -    stream: on a miss, points the least recently used stream buffer
+ *       prefetchDistance blocks ahead and fills it with prefetchDegree
+ *       blocks; a buffer that supplied a block fetches one more
+ */
+void trainPrefetcher(int addr, bool missed, bool prefetchHit, stateType *state) {
+    if (prefetcher == nextLinePrefetcher) {
+        if (missed || prefetchHit) {
+            for (int i = 0; i < prefetchDegree; i++) {
+                prefetchBlock(getBlockHead(addr) + (prefetchDistance + i) * cache->blockSize, state);
+            }
+        }
+    } else if (prefetcher == stridePrefetcher) {
+        if (accessPC < 0) {
+            return;
+        }
+        strideEntry *entry = &strideTable[accessPC % STRIDE_TABLE_SIZE];
+        if (entry->pc != accessPC) {
+            entry->pc = accessPC;
+            entry->lastAddress = addr;
+            entry->stride = 0;
+            entry->confidence = 0;
+            return;
+        }
+        int stride = addr - entry->lastAddress;
+        if (stride != 0 && stride == entry->stride) {
+            entry->confidence++;
+        } else {
+            entry->stride = stride;
+            entry->confidence = 0;
+        }
+        entry->lastAddress = addr;
+        if (entry->confidence > 0) {
+            for (int i = 0; i < prefetchDegree; i++) {
+                prefetchBlock(addr + (prefetchDistance + i) * stride, state);
+            }
+        }
+    } else if (prefetcher == streamPrefetcher) {
+        if (missed) {
+            allocateStreamBuffer(getBlockHead(addr), state);
+        } else if (prefetchHit) {
+            for (int i = 0; i < NUM_STREAM_BUFFERS; i++) {
+                if (streamBuffers[i].lastUsed == accessCount) {
+                    fetchIntoStreamBuffer(&streamBuffers[i], state);
+                }
+            }
+        }
+    }
+}
+
+/* on a miss, takes the block from the stream buffer holding it as its
+   oldest block, if any */
+bool takeFromStreamBuffer(int memBlockHead) {
+    for (int i = 0; i < NUM_STREAM_BUFFERS; i++) {
+        streamBuffer *buffer = &streamBuffers[i];
+        if (buffer->count > 0 && buffer->blocks[0] == memBlockHead) {
+            usePrefetch(buffer->prefetchTimes[0]);
+            buffer->count--;
+            memmove(buffer->blocks, buffer->blocks + 1, buffer->count * sizeof(int));
+            memmove(buffer->prefetchTimes, buffer->prefetchTimes + 1, buffer->count * sizeof(long long));
+            buffer->lastUsed = accessCount;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The buffer only keeps the block's address; its data is read from memory
+   when it moves into the cache, so stores made meanwhile are not lost. */
+void fetchIntoStreamBuffer(streamBuffer *buffer, stateType *state) {
+    if (buffer->next < 0 || buffer->next >= state->memorySize) {
+        return;
+    }
+    printAction(buffer->next, cache->blockSize, memoryToStreamBuffer);
+    buffer->blocks[buffer->count] = buffer->next;
+    buffer->prefetchTimes[buffer->count] = accessCount;
+    buffer->count++;
+    buffer->next += cache->blockSize;
+    traffic.wordsRead += cache->blockSize;
+    if (dramEnabled) {
+        accessDRAM(buffer->blocks[buffer->count - 1], cache->blockSize, false, false);
+    }
+    prefetchStatistics.issued++;
+}
+
+void allocateStreamBuffer(int memBlockHead, stateType *state) {
+    int start = memBlockHead + prefetchDistance * cache->blockSize;
+    /* a miss just behind a stream some buffer already follows, such as a
+       conflict miss on a block used before, needs no new stream */
+    for (int i = 0; i < NUM_STREAM_BUFFERS; i++) {
+        for (int j = 0; j < streamBuffers[i].count; j++) {
+            if (streamBuffers[i].blocks[j] == start) {
+                streamBuffers[i].lastUsed = accessCount;
+                return;
+            }
+        }
+    }
+    streamBuffer *buffer = &streamBuffers[0];
+    for (int i = 1; i < NUM_STREAM_BUFFERS; i++) {
+        if (streamBuffers[i].lastUsed < buffer->lastUsed) {
+            buffer = &streamBuffers[i];
+        }
+    }
+    for (int i = 0; i < buffer->count; i++) {
+        printAction(buffer->blocks[i], cache->blockSize, streamBufferToNowhere);
+        prefetchStatistics.unused++;
+    }
+    buffer->count = 0;
+    buffer->next = start;
+    buffer->lastUsed = accessCount;
+    while (buffer->count < prefetchDegree && buffer->next < state->memorySize) {
+        fetchIntoStreamBuffer(buffer, state);
+    }
+}
+
+/* forgets the strides, streams and counts of an earlier run */
+void resetPrefetcher() {
+    for (int i = 0; i < STRIDE_TABLE_SIZE; i++) {
+        strideTable[i].pc = -1;
+    }
+    memset(streamBuffers, 0, sizeof(streamBuffers));
+    memset(&prefetchStatistics, 0, sizeof(prefetchStatistics));
+    accessCount = 0;
+}
+
+/* accuracy is the share of prefetches that were used, coverage the share
+   of would-be misses they removed */
+void printPrefetchStatistics() {
+    prefetchStats *statistics = &prefetchStatistics;
+    printf("prefetch: %lld issued, %lld useful, %lld evicted unused\n", statistics->issued, statistics->useful,
+           statistics->unused);
+    printf("prefetch accuracy %.1f%%, coverage %.1f%%, %lld of %lld useful prefetches late "
+           "(average lead %.1f accesses)\n",
+           statistics->issued ? 100.0 * statistics->useful / statistics->issued : 0.0,
+           statistics->useful + cacheMisses ? 100.0 * statistics->useful / (statistics->useful + cacheMisses) : 0.0,
+           statistics->late, statistics->useful,
+           statistics->useful ? (double) statistics->lead / statistics->useful : 0.0);
+}
+
+/*
+ !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+ !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+ !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+ !!!!!!!!!!!!        MAIN FUNCTION       !!!!!!!!!!!!
+ !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+ !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+ !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+ !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+ */
+
+
+#ifndef LC2K_LIBRARY
+int main(int argc, char *argv[]) {
+    stateType state = {0};
+    const char *profileName = NULL;
+    const char *compareName = NULL;
+    int cores = 0;
+    int quantum = 1;
+    const char *prefetcherNames[] = { "none", "nextline", "stride", "stream" };
+    bool reportTraffic = false;
+    
+    if (argc >= 2 && !strcmp(argv[1], "-server")) {
+        return runServer(argc, argv);
+    }
+    if (argc >= 2 && !strcmp(argv[1], "-batch")) {
+        return runBatch(argc, argv);
+    }
+    
+    for (int i = 5; i < argc; i++) {
+        if (!strcmp(argv[i], "-profile") && i + 1 < argc) {
+            profileName = argv[++i];
+        } else if (!strcmp(argv[i], "-compare") && i + 1 < argc) {
+            compareName = argv[++i];
+        } else if (!strcmp(argv[i], "-cores") && i + 1 < argc) {
+            cores = atoi(argv[++i]);
+            if (cores < 1 || cores > MAX_CORES) {
+                argc = 0;
+            }
+        } else if (!strcmp(argv[i], "-prefetch") && i + 1 < argc) {
+            i++;
+            for (int type = noPrefetcher; type <= streamPrefetcher; type++) {
+                if (!strcmp(argv[i], prefetcherNames[type])) {
+                    prefetcher = type;
+                }
+            }
+            if (strcmp(argv[i], prefetcherNames[prefetcher])) {
+                argc = 0;
+            }
+        } else if ((!strcmp(argv[i], "-degree") || !strcmp(argv[i], "-distance")) && i + 1 < argc) {
+            int setting = atoi(argv[i + 1]);
+            if (!strcmp(argv[i], "-degree")) {
+                prefetchDegree = setting;
+            } else {
+                prefetchDistance = setting;
+            }
+            if (setting < 1 || setting > MAX_PREFETCH_DEGREE) {
+                argc = 0;
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-write") && i + 1 < argc) {
+            i++;
+            writeThrough = !strcmp(argv[i], "through");
+            reportTraffic = true;
+            if (!writeThrough && strcmp(argv[i], "back")) {
+                argc = 0;
+            }
+        } else if (!strcmp(argv[i], "-no-write-allocate")) {
+            writeAllocate = false;
+            reportTraffic = true;
+        } else if (!strcmp(argv[i], "-write-buffer") && i + 1 < argc) {
+            writeBufferSize = atoi(argv[++i]);
+            reportTraffic = true;
+            if (writeBufferSize < 1 || writeBufferSize > MAX_WRITE_BUFFER) {
+                argc = 0;
+            }
+        } else if (!strcmp(argv[i], "-victim") && i + 1 < argc) {
+            victimCacheSize = atoi(argv[++i]);
+            if (victimCacheSize < 1 || victimCacheSize > MAX_VICTIM_CACHE) {
+                argc = 0;
+            }
+        } else if (!strcmp(argv[i], "-mmu") && i + 1 < argc) {
+            mmuEnabled = true;
+            pageSize = atoi(argv[++i]);
+            if (pageSize < 1 || pageSize > NUMMEMORY || (pageSize & (pageSize - 1))) {
+                argc = 0;
+            }
+        } else if (!strcmp(argv[i], "-tlb") && i + 1 < argc && tlbLevelCount < MAX_TLB_LEVELS) {
+            /* entries,ways,lru|fifo|random */
+            tlbLevel *tlb = &tlbLevels[tlbLevelCount++];
+            char replacement[16] = "lru";
+            int fields = sscanf(argv[++i], "%d,%d,%15s", &tlb->numEntries, &tlb->ways, replacement);
+            bool known = false;
+            for (int type = tlbLRU; type <= tlbRandom; type++) {
+                if (!strcmp(replacement, tlbReplacementNames[type])) {
+                    tlb->replacement = type;
+                    known = true;
+                }
+            }
+            if (fields < 2 || !known || tlb->numEntries < 1 || tlb->numEntries > MAX_TLB_ENTRIES || tlb->ways < 1 ||
+                tlb->numEntries % tlb->ways) {
+                argc = 0;
+            } else {
+                tlb->entries = malloc(tlb->numEntries * sizeof(tlbEntry));
+            }
+        } else if (!strcmp(argv[i], "-predict") && i + 1 < argc) {
+            i++;
+            for (int type = noPredictor; type <= tournamentPredictor; type++) {
+                if (!strcmp(argv[i], predictorNames[type])) {
+                    predictor = type;
+                }
+            }
+            if (strcmp(argv[i], predictorNames[predictor])) {
+                argc = 0;
+            }
+        } else if ((!strcmp(argv[i], "-predictor-bits") || !strcmp(argv[i], "-history")) && i + 1 < argc) {
+            int bits = atoi(argv[i + 1]);
+            if (!strcmp(argv[i], "-history")) {
+                historyBits = bits;
+            } else {
+                predictorBits = bits;
+            }
+            if (bits < 1 || bits > MAX_PREDICTOR_BITS) {
+                argc = 0;
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-btb") && i + 1 < argc) {
+            btbSize = atoi(argv[++i]);
+            if (btbSize < 1 || btbSize > MAX_BTB_ENTRIES) {
+                argc = 0;
+            }
+        } else if (!strcmp(argv[i], "-ras") && i + 1 < argc) {
+            rasDepth = atoi(argv[++i]);
+            if (rasDepth < 1 || rasDepth > MAX_RAS_DEPTH) {
+                argc = 0;
+            }
+        } else if (!strcmp(argv[i], "-pipeline")) {
+            pipelineEnabled = true;
+        } else if (!strcmp(argv[i], "-miss-penalty") && i + 1 < argc) {
+            /* memory[,victim cache or stream buffer] */
+            int fields = sscanf(argv[++i], "%d,%d", &missPenalty, &bufferPenalty);
+            pipelineEnabled = true;
+            if (fields < 1 || missPenalty < 0 || bufferPenalty < 0) {
+                argc = 0;
+            }
+        } else if (!strcmp(argv[i], "-dram") && i + 1 < argc) {
+            /* banks,row words,open|closed */
+            char policy[16] = "open";
+            int fields = sscanf(argv[++i], "%d,%d,%15s", &dramBanks, &dramRowSize, policy);
+            dramEnabled = true;
+            closedPage = !strcmp(policy, "closed");
+            if (fields < 2 || dramBanks < 1 || dramBanks > MAX_DRAM_BANKS || dramRowSize < 1 ||
+                (!closedPage && strcmp(policy, "open"))) {
+                argc = 0;
+            }
+        } else if (!strcmp(argv[i], "-dram-timing") && i + 1 < argc) {
+            /* tRCD,tCAS,tRP,burst length */
+            int fields = sscanf(argv[++i], "%d,%d,%d,%d", &tRCD, &tCAS, &tRP, &burstLength);
+            dramEnabled = true;
+            if (fields < 3 || tRCD < 0 || tCAS < 0 || tRP < 0 || burstLength < 1) {
+                argc = 0;
+            }
+        } else if (!strcmp(argv[i], "-classify")) {
+            classifyMisses = true;
+        } else if (!strcmp(argv[i], "-quantum") && i + 1 < argc) {
+            quantum = atoi(argv[++i]);
+            if (quantum < 1) {
+                argc = 0;
+            }
+        } else {
+            argc = 0;
+        }
+    }
+    if (cores > 0 && (compareName != NULL || prefetcher != noPrefetcher || reportTraffic || victimCacheSize > 0 ||
+                      classifyMisses || mmuEnabled || predictor != noPredictor || btbSize > 0 || rasDepth > 0 ||
+                      pipelineEnabled || dramEnabled)) {
+        argc = 0;
+    }
+    if (tlbLevelCount > 0 && !mmuEnabled) {
+        argc = 0;
+    }
+    if (argc < 5) {
+        printf("error: usage: %s <machine-code file> blockSizeInWords numberOfSets blocksPerSet "
+               "[-profile <profile file>] [-compare <machine-code file>] [-cores <count> [-quantum <instructions>]]\n"
+               "       [-prefetch nextline|stride|stream [-degree <blocks>] [-distance <blocks>]]\n"
+               "       [-write back|through] [-no-write-allocate] [-write-buffer <entries>]\n"
+               "       [-victim <entries>] [-classify] [-mmu <page size> [-tlb <entries>,<ways>[,lru|fifo|random]]...]\n"
+               "       [-predict taken|nottaken|bimodal|gshare|tournament [-predictor-bits <bits>] [-history <bits>]]\n"
+               "       [-btb <entries>] [-ras <entries>] [-pipeline] [-miss-penalty <memory cycles>[,<buffer cycles>]]\n"
+               "       [-dram <banks>,<row words>[,open|closed]] [-dram-timing <tRCD>,<tCAS>,<tRP>[,<burst length>]]\n"
+               "       %s -server [-socket <path>] [-workers <count>]\n"
+               "       %s -batch <machine-code file> <input file> [-lanes <count>] [-limit <instructions>]\n",
+               argv[0], argv[0], argv[0]);
+        exit(1);
+    }
+    
+    loadProgram(argv[1], &state);
+    if (mmuEnabled) {
+        initializeMMU(&state);
+    }
+    initializePredictors(&state);
+    initializeDRAM();
+    
+    initializeCache();
+    resetPrefetcher();
+    writeBuffer = calloc(writeBufferSize, sizeof(writeBufferEntry));
+    cache->blockSize = atoi(argv[2]);
+    cache->numSets = atoi(argv[3]);
+    cache->blocksPerSet = atoi(argv[4]);
+    resetMissAnalysis(&state);
+    
+    if (profileName != NULL) {
+        profileExecutions = calloc(state.memorySize, sizeof(long long));
+        profileAccesses = calloc(state.memorySize, sizeof(long long));
+        profileMisses = calloc(state.memorySize, sizeof(long long));
+    }
+    
+    /* cache actions from several cores would interleave unreadably, so
+       multi-core runs report counts instead */
+    if (cores > 0) {
+        quiet = true;
+        runCores(&state, cores, quantum);
+        coreStats total = {0};
+        for (int core = 0; core < cores; core++) {
+            coreStats *statistics = &coreStatistics[core];
+            printf("core %d: %lld instructions, %lld hits, %lld misses, %lld upgrades, %lld invalidations, "
+                   "%lld interventions\n", core, statistics->instructions, statistics->hits, statistics->misses,
+                   statistics->upgrades, statistics->invalidations, statistics->interventions);
+            total.instructions += statistics->instructions;
+            total.upgrades += statistics->upgrades;
+            total.invalidations += statistics->invalidations;
+            total.interventions += statistics->interventions;
+        }
+        printf("total: %lld instructions, %lld hits, %lld misses, %lld upgrades, %lld invalidations, "
+               "%lld interventions\n", total.instructions, cacheHits, cacheMisses, total.upgrades,
+               total.invalidations, total.interventions);
+        if (profileName != NULL) {
+            writeProfile(profileName, &state);
+        }
+        return(0);
+    }
+    
+    quiet = compareName != NULL;
+    int totalInstructions = runProgram(&state);
+    if (profileName != NULL) {
+        writeProfile(profileName, &state);
+    }
+    if (prefetcher != noPrefetcher) {
+        printPrefetchStatistics();
+    }
+    if (reportTraffic) {
+        printTraffic();
+    }
+    printMissAnalysis();
+    if (mmuEnabled) {
+        printMMUStatistics();
+    }
+    if (predictor != noPredictor || btbSize > 0 || rasDepth > 0) {
+        printBranchStatistics(&state);
+    }
+    if (pipelineEnabled) {
+        printPipelineStatistics();
+    }
+    if (dramEnabled) {
+        printDRAMStatistics();
+    }
+    
+    /* run the other layout of the program on a cold cache of the same
+       shape, e.g. a relink with the linker's --profile, and compare */
+    if (compareName != NULL) {
+        long long hits = cacheHits;
+        long long misses = cacheMisses;
+        stateType other = {0};
+        loadProgram(compareName, &other);
+        if (mmuEnabled) {
+            initializeMMU(&other);
+        }
+        initializePredictors(&other);
+        initializeDRAM();
+        initializeCache();
+        blockAccessTimestamp = 0;
+        cacheHits = cacheMisses = 0;
+        profileExecutions = profileAccesses = profileMisses = NULL;
+        resetPrefetcher();
+        memset(&traffic, 0, sizeof(traffic));
+        resetMissAnalysis(&other);
+        int otherInstructions = runProgram(&other);
+        printf("%s: %d instructions, %lld hits, %lld misses\n", argv[1], totalInstructions, hits, misses);
+        printf("%s: %d instructions, %lld hits, %lld misses\n", compareName, otherInstructions,
+               cacheHits, cacheMisses);
+        printf("misses changed by %lld (%.1f%%)\n", cacheMisses - misses,
+               misses ? 100.0 * (cacheMisses - misses) / misses : 0.0);
+    }
+    
+    return(0);
+}
+#endif
+
+/* reads the machine-code file into memory, growing it for programs past
+   NUMMEMORY so there is as much room again for the stack */
+void loadProgram(const char *fileName, stateType *state) {
+    char line[MAXLINELENGTH];
+    FILE *filePtr = fopen(fileName, "r");
+    if (filePtr == NULL) {
+        printf("error: can't open file %s", fileName);
+        perror("fopen");
+        exit(1);
+    }
+    
+    state->memorySize = NUMMEMORY;
+    state->mem = calloc(state->memorySize, sizeof(int));
+    for (state->numMemory = 0; fgets(line, MAXLINELENGTH, filePtr) != NULL;
+         state->numMemory++) {
+        
+        reserveWord(state);
+        if (sscanf(line, "%d", state->mem+state->numMemory) != 1) {
+            exitWithError("error in reading address %d\n", state->numMemory);
+        }
+        //printf("memory[%d]=%d\n", state->numMemory, state->mem[state->numMemory]);
+    }
+    
+    fclose(filePtr);
+}
+
+/* makes room for word numMemory with as much room again for the stack */
+void reserveWord(stateType *state) {
+    if (2 * state->numMemory >= state->memorySize) {
+        state->mem = realloc(state->mem, 2 * state->memorySize * sizeof(int));
+        memset(state->mem + state->memorySize, 0, state->memorySize * sizeof(int));
+        state->memorySize *= 2;
+    }
+}
+
+/* writes every dirty block back to memory without logging it */
+void flushCache(stateType *state) {
+    for (int i = 0; i < cache->numSets * cache->blocksPerSet; i++) {
+        if (cache->blocks[i].tag != (int) 0xdeadbeef && cache->blocks[i].isDirty) {
+            memcpy(state->mem + cache->blocks[i].set, cache->blocks[i].data, cache->blockSize * sizeof(int));
+        }
+    }
+}
+
+/* runs the program from address 0 until it halts and returns the number
+   of instructions executed */
+int runProgram(stateType *state) {
+    for (int i = 0; i < NUMREGS; i++) {
+        state->reg[i] = 0;
+    }
+    state->pc = 0;
+    int done = 0;
+    int totalInstructions = 0;
+    
+    //printState(state);
+    
+    while (!done) {
+        done = executeInstruction(state);
+        totalInstructions++;
+        if (instructionLimit && totalInstructions > instructionLimit) {
+            exitProgram("Instruction limit exceeded");
+        }
+        
+        if (!done) {
+            //printState(state);
+        }
+    }
+    
+    if (writeBufferCount > 0) {
+        drainWriteBuffer(state, true);
+    }
+    
+    /*printf("machine halted\n");
+    printf("total of %d instructions executed\n", totalInstructions);
+    printf("final state of machine:\n");
+    printState(state);*/
+    
+    return totalInstructions;
+}
+
+/* Runs the program on coreCount cores sharing memory, each from address 0
+   with its own registers and a private cache of the current cache's
+   shape. Core i starts with i in CORE_ID_REGISTER and the number of cores
+   in CORE_COUNT_REGISTER. The cores take turns of quantum instructions in
+   order of ID, skipping cores that have halted, so every run of a program
+   interleaves the same way. */
+void runCores(stateType *state, int cores, int quantum) {
+    stateType *coreStates = malloc(cores * sizeof(stateType));
+    coreCaches = malloc(cores * sizeof(cacheStruct));
+    coreStatistics = calloc(cores, sizeof(coreStats));
+    cacheStruct *shape = cache;
+    for (int core = 0; core < cores; core++) {
+        coreStates[core] = *state;
+        for (int i = 0; i < NUMREGS; i++) {
+            coreStates[core].reg[i] = 0;
+        }
+        coreStates[core].reg[CORE_ID_REGISTER] = core;
+        coreStates[core].reg[CORE_COUNT_REGISTER] = cores;
+        coreStates[core].pc = 0;
+        cache = &coreCaches[core];
+        initializeCache();
+        cache->blockSize = shape->blockSize;
+        cache->numSets = shape->numSets;
+        cache->blocksPerSet = shape->blocksPerSet;
+    }
+    coreCount = cores;
+    
+    bool *halted = calloc(cores, sizeof(bool));
+    int running = cores;
+    while (running > 0) {
+        for (currentCore = 0; currentCore < cores; currentCore++) {
+            if (halted[currentCore]) {
+                continue;
+            }
+            coreStats *statistics = &coreStatistics[currentCore];
+            cache = &coreCaches[currentCore];
+            long long hits = cacheHits;
+            long long misses = cacheMisses;
+            for (int i = 0; i < quantum && !halted[currentCore]; i++) {
+                halted[currentCore] = executeInstruction(&coreStates[currentCore]);
+                statistics->instructions++;
+            }
+            statistics->hits += cacheHits - hits;
+            statistics->misses += cacheMisses - misses;
+            running -= halted[currentCore];
+        }
+    }
+    
+    cache = shape;
+    coreCount = 1;
+    currentCore = 0;
+    free(halted);
+    free(coreCaches);
+    coreCaches = NULL;
+    free(coreStates);
+}
+
+/* fetches and executes the instruction at pc; returns whether it was halt */
+bool executeInstruction(stateType *state) {
+    instructionInfo instructionDetails;
+    
+    //int value = state->mem[state->pc];
+    if (profileExecutions != NULL) {
+        profileExecutions[state->pc]++;
+    }
+    accessPC = -1;
+    long long fetchStall = pipelineEnabled ? memoryStallCycles() : 0;
+    long long dataStall = 0;
+    bool mispredicted = false;
+    int value = load(state->pc, state);
+    if (pipelineEnabled) {
+        fetchStall = memoryStallCycles() - fetchStall;
+        dataStall = memoryStallCycles();
+    }
+    instructionDetails.opcode = value >> 22 & BITMASK_FOR_PARSING_MACHINE_CODE;
+    instructionDetails.arg0 = value >> 19 & BITMASK_FOR_PARSING_MACHINE_CODE;
+    instructionDetails.arg1 = value >> 16 & BITMASK_FOR_PARSING_MACHINE_CODE;
+    instructionDetails.arg2 = value & BITMASK_BITS_ZERO_TO_FIFTEEN;
+    state->pc++;
+    if (state->pc >= state->memorySize) {
+        exitProgram("Program counter out of bounds");
+    }
+    
+    switch (instructionDetails.opcode) {
+        case 0:
+        case 1: {
+            if (!isValidRegister(instructionDetails.arg0) || !isValidRegister(instructionDetails.arg1) ||
+                !isValidRegister(instructionDetails.arg2)) {
+                exitProgram("Invalid register");
+            }
+            if (instructionDetails.opcode == 0) {
+                state->reg[instructionDetails.arg2] = state->reg[instructionDetails.arg0] +
+                state->reg[instructionDetails.arg1];
+            } else if (instructionDetails.opcode == 1) {
+                state->reg[instructionDetails.arg2] = ~(state->reg[instructionDetails.arg0] |
+                                                       state->reg[instructionDetails.arg1]);
+            } else {
+                exitProgram("Invalid RType opcode");
+            }
+            break;
+        }
+        case 2:
+        case 3:
+        case 4: {
+            int offset = convertNum(instructionDetails.arg2);
+            
+            if (offset < MIN_OFFSET || offset > MAX_OFFSET) {
+                exitProgram("Offset out of bounds");
+            }
+            if (!isValidRegister(instructionDetails.arg0) || !isValidRegister(instructionDetails.arg1)) {
+                exitProgram("Invalid register");
+            }
+            int address = state->reg[instructionDetails.arg0] + offset;
+            if (profileAccesses != NULL && instructionDetails.opcode != 4 &&
+                address >= 0 && address < state->memorySize) {
+                profileAccesses[address]++;
+            }
+            accessPC = state->pc - 1;
+            if (instructionDetails.opcode == 2) {
+                //state->reg[instructionDetails.arg1] = state->mem[state->reg[instructionDetails.arg0] + offset];
+                int data = load(address, state);
+                state->reg[instructionDetails.arg1] = data;
+            } else if (instructionDetails.opcode == 3) {
+                //state->mem[state->reg[instructionDetails.arg0] + offset] = state->reg[instructionDetails.arg1];
+                store(address, state->reg[instructionDetails.arg1], state);
+            } else if (instructionDetails.opcode == 4) {
+                bool taken = state->reg[instructionDetails.arg0] == state->reg[instructionDetails.arg1];
+                mispredicted = taken;
+                if (predictor != noPredictor) {
+                    mispredicted = observeBranch(state->pc - 1, taken);
+                }
+                if (taken) {
+                    state->pc += offset;
+                }
+            } else {
+                exitProgram("Invalid IType opcode");
+            }
+            break;
+        }
+        case 5: {
+            if (instructionDetails.opcode == 5) {
+                state->reg[instructionDetails.arg1] = state->pc;
+                state->pc = state->reg[instructionDetails.arg0];
+                mispredicted = true;
+                if (btbSize > 0 || rasDepth > 0) {
+                    mispredicted = observeJump(state->reg[instructionDetails.arg1] - 1, state->pc, instructionDetails.arg0,
+                                instructionDetails.arg1);
+                }
+            } else {
+                exitProgram("Invalid JType opcode");
+            }
+            break;
+        }
+        case 6: {
+            break;
+        }
+        case 7: {
+            break;
+        }
+            
+        default:
+            exitProgram("Unsupported opcode");
+    }
+    if (pipelineEnabled) {
+        timeInstruction(&instructionDetails, fetchStall, memoryStallCycles() - dataStall, mispredicted);
+    }
+    return instructionDetails.opcode == 6;
+}
+
+/* Writes the counts of every address in the program that was executed,
+   loaded or stored, or missed in the cache: a header with the program
+   size, so the linker can tell the profile belongs to its layout, then
+   "address executions accesses misses" lines. */
+void writeProfile(const char *fileName, stateType *state) {
+    FILE *profileFile = fopen(fileName, "w");
+    if (profileFile == NULL) {
+        exitWithError("error: can't open file %s\n", fileName);
+    }
+    fprintf(profileFile, "%s %d %d\n", PROFILE_MAGIC, PROFILE_VERSION, state->numMemory);
+    for (int i = 0; i < state->numMemory; i++) {
+        if (profileExecutions[i] || profileAccesses[i] || profileMisses[i]) {
+            fprintf(profileFile, "%d %lld %lld %lld\n", i, profileExecutions[i], profileAccesses[i],
+                    profileMisses[i]);
+        }
+    }
+    if (fclose(profileFile) != 0) {
+        exitWithError("error in writing %s\n", fileName);
+    }
+}
+
+#ifndef LC2K_LIBRARY
+/*
+ * Server mode keeps one process and a pool of workers alive for harnesses
+ * that run many short programs. Clients send jobs on stdin, or over a Unix
+ * domain socket with -socket, one connection per client. A job is a header
+ * line
+ *     job <id> <blockSizeInWords> <numberOfSets> <blocksPerSet> <words> [<instruction limit>]
+ * followed by the program's machine code, one word per line as in a
+ * machine-code file. Jobs run in parallel, so results come back as each
+ * finishes, tagged with the job's id:
+ *     result <id> ok queue <us> run <us> instructions <n> hits <n> misses <n> registers <r0> ... <r7>
+ *     result <id> error queue <us> run <us> <message>
+ * where queue is the time the job waited for a worker and run the time it
+ * took to simulate.
+ */
+int runServer(int argc, char *argv[]) {
+    const char *socketName = NULL;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "-socket") && i + 1 < argc) {
+            socketName = argv[++i];
+        } else if (!strcmp(argv[i], "-workers") && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else {
+            printf("error: usage: %s -server [-socket <path>] [-workers <count>]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (workers < 1) {
+        workers = 1;
+    }
+    /* a client that hangs up early loses its results, not the server */
+    signal(SIGPIPE, SIG_IGN);
+    
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, serverWorker, NULL) != 0) {
+            exitProgram("Could not start server workers");
+        }
+    }
+    
+    if (socketName == NULL) {
+        serverConnection connection = { stdin, stdout, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+        serveConnection(&connection);
+    } else {
+        struct sockaddr_un address = {0};
+        address.sun_family = AF_UNIX;
+        if (strlen(socketName) >= sizeof(address.sun_path)) {
+            exitProgram("Socket path too long");
+        }
+        strcpy(address.sun_path, socketName);
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(socketName);
+        if (listener < 0 || bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+            listen(listener, SOMAXCONN) != 0) {
+            printf("error: can't listen on %s: %s\n", socketName, strerror(errno));
+            exit(1);
+        }
+        for (;;) {
+            int client = accept(listener, NULL, NULL);
+            if (client < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                printf("error: accept: %s\n", strerror(errno));
+                break;
+            }
+            serverConnection *connection = calloc(1, sizeof(serverConnection));
+            connection->in = fdopen(client, "r");
+            connection->out = fdopen(dup(client), "w");
+            pthread_mutex_init(&connection->lock, NULL);
+            pthread_cond_init(&connection->idle, NULL);
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, serverClient, connection) != 0) {
+                exitProgram("Could not start a server client");
+            }
+            pthread_detach(thread);
+        }
+        close(listener);
+    }
+    
+    pthread_mutex_lock(&queueLock);
+    queueClosed = true;
+    pthread_cond_broadcast(&queueReady);
+    pthread_mutex_unlock(&queueLock);
+    for (int i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return(0);
+}
+
+void *serverClient(void *argument) {
+    serverConnection *connection = argument;
+    serveConnection(connection);
+    fclose(connection->in);
+    fclose(connection->out);
+    pthread_mutex_destroy(&connection->lock);
+    pthread_cond_destroy(&connection->idle);
+    free(connection);
+    return NULL;
+}
+
+/* queues a connection's jobs until it closes or sends a malformed one,
+   then waits for the queued jobs to report back */
+void serveConnection(serverConnection *connection) {
+    int lineNumber = 0;
+    for (;;) {
+        serverJob *job = calloc(1, sizeof(serverJob));
+        int status = readJob(connection, job, &lineNumber);
+        if (status <= 0) {
+            if (status < 0) {
+                pthread_mutex_lock(&connection->lock);
+                fprintf(connection->out, "error: malformed job at line %d\n", lineNumber);
+                fflush(connection->out);
+                pthread_mutex_unlock(&connection->lock);
+            }
+            free(job->words);
+            free(job);
+            break;
+        }
+        job->connection = connection;
+        pthread_mutex_lock(&connection->lock);
+        connection->pending++;
+        pthread_mutex_unlock(&connection->lock);
+        job->queued = monotonicSeconds();
+        enqueueJob(job);
+    }
+    
+    pthread_mutex_lock(&connection->lock);
+    while (connection->pending > 0) {
+        pthread_cond_wait(&connection->idle, &connection->lock);
+    }
+    pthread_mutex_unlock(&connection->lock);
+}
+
+/* reads the next job; returns 1 for a job, 0 at the end of input and -1
+   for a malformed job */
+int readJob(serverConnection *connection, serverJob *job, int *lineNumber) {
+    char line[MAXLINELENGTH];
+    char format[32];
+    int fields;
+    
+    snprintf(format, sizeof(format), "job %%%ds %%d %%d %%d %%d %%lld", MAX_JOB_ID - 1);
+    do {
+        if (fgets(line, MAXLINELENGTH, connection->in) == NULL) {
+            return 0;
+        }
+        (*lineNumber)++;
+    } while (line[strspn(line, " \t\r\n")] == '\0');
+    
+    fields = sscanf(line, format, job->id, &job->blockSize, &job->numSets, &job->blocksPerSet, &job->size,
+                    &job->limit);
+    if (fields < 5 || job->size < 0 || job->size > MAX_OFFSET + 1 - MIN_OFFSET || job->limit < 0) {
+        return -1;
+    }
+    job->words = malloc((job->size ? job->size : 1) * sizeof(int));
+    for (int i = 0; i < job->size; i++) {
+        if (fgets(line, MAXLINELENGTH, connection->in) == NULL) {
+            return -1;
+        }
+        (*lineNumber)++;
+        if (sscanf(line, "%d", &job->words[i]) != 1) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+void enqueueJob(serverJob *job) {
+    pthread_mutex_lock(&queueLock);
+    if (queueTail != NULL) {
+        queueTail->next = job;
+    } else {
+        queueHead = job;
+    }
+    queueTail = job;
+    pthread_cond_signal(&queueReady);
+    pthread_mutex_unlock(&queueLock);
+}
+
+/* waits for the next job; NULL once the queue is closed and empty */
+serverJob *dequeueJob() {
+    pthread_mutex_lock(&queueLock);
+    while (queueHead == NULL && !queueClosed) {
+        pthread_cond_wait(&queueReady, &queueLock);
+    }
+    serverJob *job = queueHead;
+    if (job != NULL) {
+        queueHead = job->next;
+        if (queueHead == NULL) {
+            queueTail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&queueLock);
+    return job;
+}
+
+/* Each worker keeps one machine for every job it runs: the memory is
+   allocated once and only the words a job loaded or stored are cleared
+   after it, and the cache is reset rather than rebuilt. */
+void *serverWorker(void *unused) {
+    stateType state = {0};
+    (void) unused;
+    state.memorySize = NUMMEMORY;
+    state.mem = calloc(state.memorySize, sizeof(int));
+    initializeCache();
+    quiet = true;
+    
+    serverJob *job;
+    while ((job = dequeueJob()) != NULL) {
+        int totalInstructions = 0;
+        double start = monotonicSeconds();
+        const char *error = simulateJob(job, &state, &totalInstructions);
+        double finish = monotonicSeconds();
+        
+        serverConnection *connection = job->connection;
+        pthread_mutex_lock(&connection->lock);
+        fprintf(connection->out, "result %s %s queue %.0fus run %.0fus", job->id, error ? "error" : "ok",
+                (start - job->queued) * 1e6, (finish - start) * 1e6);
+        if (error != NULL) {
+            fprintf(connection->out, " %s\n", error);
+        } else {
+            fprintf(connection->out, " instructions %d hits %lld misses %lld registers", totalInstructions,
+                    cacheHits, cacheMisses);
+            for (int i = 0; i < NUMREGS; i++) {
+                fprintf(connection->out, " %d", state.reg[i]);
+            }
+            fprintf(connection->out, "\n");
+        }
+        fflush(connection->out);
+        if (--connection->pending == 0) {
+            pthread_cond_signal(&connection->idle);
+        }
+        pthread_mutex_unlock(&connection->lock);
+        
+        int used = state.numMemory > storeHighWater ? state.numMemory : storeHighWater;
+        memset(state.mem, 0, used * sizeof(int));
+        free(job->words);
+        free(job);
+    }
+    
+    free(state.mem);
+    free(cache);
+    return NULL;
+}
+
+/* runs a job on the worker's machine and returns NULL, or the message the
+   command-line simulator would have stopped with */
+const char *simulateJob(serverJob *job, stateType *state, int *totalInstructions) {
+    jmp_buf errorJump;
+    
+    state->numMemory = 0;
+    storeHighWater = 0;
+    cacheHits = cacheMisses = 0;
+    for (int i = 0; i < NUMREGS; i++) {
+        state->reg[i] = 0;
+    }
+    if (setjmp(errorJump)) {
+        jobErrorJump = NULL;
+        return jobError;
+    }
+    jobErrorJump = &errorJump;
+    
+    if (!isValidCacheConfiguration(job->blockSize, job->numSets, job->blocksPerSet)) {
+        exitProgram("Invalid cache configuration");
+    }
+    cache->blockSize = job->blockSize;
+    cache->numSets = job->numSets;
+    cache->blocksPerSet = job->blocksPerSet;
+    resetCache();
+    instructionLimit = job->limit;
+    for (; state->numMemory < job->size; state->numMemory++) {
+        reserveWord(state);
+        state->mem[state->numMemory] = job->words[state->numMemory];
+    }
+    
+    *totalInstructions = runProgram(state);
+    jobErrorJump = NULL;
+    return NULL;
+}
+
+double monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Runs a machine-code file once per line of an input file, each line
+   giving the words to set in that instance's memory before it starts, as
+   "address=value" separated by spaces, and prints every instance's final
+   state. No cache is simulated. */
+int runBatch(int argc, char *argv[]) {
+    int lanes = BATCH_LANES;
+    long long limit = 0;
+    
+    for (int i = 4; i < argc; i++) {
+        if (!strcmp(argv[i], "-lanes") && i + 1 < argc) {
+            lanes = atoi(argv[++i]);
+            if (lanes < BATCH_WIDTH || lanes > MAX_BATCH_LANES || lanes % BATCH_WIDTH) {
+                argc = 0;
+            }
+        } else if (!strcmp(argv[i], "-limit") && i + 1 < argc) {
+            limit = atoll(argv[++i]);
+        } else {
+            argc = 0;
+        }
+    }
+    if (argc < 4) {
+        printf("error: usage: %s -batch <machine-code file> <input file> [-lanes <count>] "
+               "[-limit <instructions>]\n", argv[0]);
+        exit(1);
+    }
+    
+    stateType state = {0};
+    loadProgram(argv[2], &state);
+    batchPool pool = {0};
+    pool.image = state.mem;
+    pool.imageSize = state.numMemory;
+    pool.memorySize = state.memorySize;
+    pool.limit = limit;
+    readBatchInputs(argv[3], &pool);
+    
+    /* no more lanes than instances, rounded up to whole vectors */
+    if (lanes > pool.instanceCount) {
+        lanes = (pool.instanceCount + BATCH_WIDTH - 1) / BATCH_WIDTH * BATCH_WIDTH;
+    }
+    if (lanes == 0) {
+        return(0);
+    }
+    if ((long long) lanes * pool.memorySize > INT_MAX) {
+        exitProgram("Too many lanes for the program's memory");
+    }
+    pool.lanes = lanes;
+    pool.memory = malloc((size_t) lanes * pool.memorySize * sizeof(int));
+    pool.pc = malloc(lanes * sizeof(int));
+    for (int i = 0; i < NUMREGS; i++) {
+        pool.reg[i] = malloc(lanes * sizeof(int));
+    }
+    pool.base = malloc(lanes * sizeof(int));
+    pool.highWater = malloc(lanes * sizeof(int));
+    pool.instance = malloc(lanes * sizeof(int));
+    pool.recent = malloc(lanes * sizeof(int));
+    pool.instructions = malloc(lanes * sizeof(long long));
+    if (pool.memory == NULL) {
+        exitProgram("Not enough memory for the lanes");
+    }
+    for (int lane = 0; lane < lanes; lane++) {
+        pool.base[lane] = lane * pool.memorySize;
+        memcpy(pool.memory + pool.base[lane], pool.image, pool.memorySize * sizeof(int));
+        pool.highWater[lane] = 0;
+        pool.pc[lane] = EMPTY_LANE;
+        fillLane(&pool, lane);
+    }
+    
+    double start = monotonicSeconds();
+    while (stepBatch(&pool)) {
+        if (pool.retired) {
+            for (int lane = 0; lane < lanes; lane++) {
+                if (pool.pc[lane] == EMPTY_LANE) {
+                    fillLane(&pool, lane);
+                }
+            }
+            pool.retired = false;
+        }
+    }
+    double seconds = monotonicSeconds() - start;
+    
+    long long total = 0;
+    for (int i = 0; i < pool.instanceCount; i++) {
+        batchResult *result = &pool.results[i];
+        total += result->instructions;
+        if (result->error != NULL) {
+            printf("instance %d: error: %s after %lld instructions at pc %d\n", i, result->error,
+                   result->instructions, result->pc);
+            continue;
+        }
+        printf("instance %d: %lld instructions, pc %d, registers", i, result->instructions, result->pc);
+        for (int j = 0; j < NUMREGS; j++) {
+            printf(" %d", result->reg[j]);
+        }
+        if (result->changedCount > 0) {
+            printf(", memory");
+            for (int j = 0; j < result->changedCount; j++) {
+                printf(" %d=%d", result->changed[2 * j], result->changed[2 * j + 1]);
+            }
+        }
+        printf("\n");
+    }
+    printf("%d instances on %d lanes: %lld instructions in %.3f seconds (%.1f million per second), "
+           "%.1f%% of vector lanes active\n", pool.instanceCount, lanes, total, seconds,
+           seconds > 0 ? total / seconds / 1e6 : 0.0,
+           pool.vectorSteps ? 100.0 * pool.laneInstructions / (pool.vectorSteps * BATCH_WIDTH) : 0.0);
+    return(0);
+}
+
+/* reads one instance's assignments per line of the input file */
+void readBatchInputs(const char *fileName, batchPool *pool) {
+    char line[MAXLINELENGTH];
+    FILE *filePtr = fopen(fileName, "r");
+    if (filePtr == NULL) {
+        printf("error: can't open file %s", fileName);
+        perror("fopen");
+        exit(1);
+    }
+    
+    int capacity = 0;
+    while (fgets(line, MAXLINELENGTH, filePtr) != NULL) {
+        if (pool->instanceCount == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            pool->inputs = realloc(pool->inputs, capacity * sizeof(batchInput));
+        }
+        batchInput *input = &pool->inputs[pool->instanceCount++];
+        input->assignments = NULL;
+        input->count = 0;
+        for (char *token = strtok(line, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n")) {
+            int address, value;
+            char extra;
+            if (sscanf(token, "%d=%d%c", &address, &value, &extra) != 2) {
+                printf("error: bad assignment %s on line %d of %s\n", token, pool->instanceCount, fileName);
+                exit(1);
+            }
+            if (address < 0 || address >= pool->memorySize) {
+                printf("error: address %d on line %d of %s is out of range\n", address, pool->instanceCount,
+                       fileName);
+                exit(1);
+            }
+            input->assignments = realloc(input->assignments, 2 * (input->count + 1) * sizeof(int));
+            input->assignments[2 * input->count] = address;
+            input->assignments[2 * input->count + 1] = value;
+            input->count++;
+        }
+    }
+    fclose(filePtr);
+    pool->results = calloc(pool->instanceCount, sizeof(batchResult));
+}
+
+/* starts the next instance in an empty lane, on a fresh copy of the
+   program; the lane stays empty if every instance has started */
+void fillLane(batchPool *pool, int lane) {
+    if (pool->nextInstance == pool->instanceCount) {
+        return;
+    }
+    int *memory = pool->memory + pool->base[lane];
+    int used = pool->imageSize > pool->highWater[lane] ? pool->imageSize : pool->highWater[lane];
+    memcpy(memory, pool->image, used * sizeof(int));
+    
+    batchInput *input = &pool->inputs[pool->nextInstance];
+    pool->highWater[lane] = 0;
+    for (int i = 0; i < input->count; i++) {
+        int address = input->assignments[2 * i];
+        memory[address] = input->assignments[2 * i + 1];
+        if (address >= pool->highWater[lane]) {
+            pool->highWater[lane] = address + 1;
+        }
+    }
+    pool->instance[lane] = pool->nextInstance++;
+    pool->pc[lane] = 0;
+    for (int i = 0; i < NUMREGS; i++) {
+        pool->reg[i][lane] = 0;
+    }
+    pool->recent[lane] = 0;
+    pool->instructions[lane] = 0;
+}
+
+/* records the final state of the lane's instance, or the error it stopped
+   with, and empties the lane */
+void retireLane(batchPool *pool, int lane, const char *error) {
+    batchResult *result = &pool->results[pool->instance[lane]];
+    int *memory = pool->memory + pool->base[lane];
+    result->instructions = pool->instructions[lane] + pool->recent[lane];
+    result->pc = pool->pc[lane];
+    result->error = error;
+    for (int i = 0; i < NUMREGS; i++) {
+        result->reg[i] = pool->reg[i][lane];
+    }
+    int used = pool->imageSize > pool->highWater[lane] ? pool->imageSize : pool->highWater[lane];
+    for (int address = 0; address < used; address++) {
+        if (memory[address] != pool->image[address]) {
+            result->changed = realloc(result->changed, 2 * (result->changedCount + 1) * sizeof(int));
+            result->changed[2 * result->changedCount] = address;
+            result->changed[2 * result->changedCount + 1] = memory[address];
+            result->changedCount++;
+        }
+    }
+    pool->pc[lane] = EMPTY_LANE;
+    pool->retired = true;
+}
+
+/* Executes the instruction at the lowest pc of any lane in every lane at
+   that pc holding the same word there, which is all of them unless an
+   instance has stored over its code. Returns false once every lane is
+   empty. */
+bool stepBatch(batchPool *pool) {
+    int pc = EMPTY_LANE;
+    int first = -1;
+    for (int lane = 0; lane < pool->lanes; lane++) {
+        if (pool->pc[lane] < pc) {
+            pc = pool->pc[lane];
+            first = lane;
+        }
+    }
+    if (first < 0) {
+        return false;
+    }
+    
+    if (pc < 0 || pc + 1 >= pool->memorySize) {
+        for (int lane = first; lane < pool->lanes; lane++) {
+            if (pool->pc[lane] == pc) {
+                retireLane(pool, lane, pc < 0 ? "Memory address out of bounds" : "Program counter out of bounds");
+            }
+        }
+        return true;
+    }
+    int word = pool->memory[pool->base[first] + pc];
+    int executed = 0;
+    int vectors = 0;
+    for (int chunk = first - first % BATCH_WIDTH; chunk < pool->lanes; chunk += BATCH_WIDTH) {
+        int lanes = executeBatchVector(pool, chunk, pc, word);
+        executed += lanes;
+        vectors += lanes > 0;
+    }
+    pool->laneInstructions += executed;
+    pool->vectorSteps += vectors;
+    
+    /* the recent counts are ints, and can take up to 2^30 more steps */
+    if ((++pool->steps & ((1 << 30) - 1)) == 0) {
+        for (int lane = 0; lane < pool->lanes; lane++) {
+            pool->instructions[lane] += pool->recent[lane];
+            pool->recent[lane] = 0;
+        }
+    }
+    
+    if (vectors > (executed + BATCH_WIDTH - 1) / BATCH_WIDTH) {
+        if (++pool->scatteredSteps >= DIVERGENCE_LIMIT) {
+            regroupLanes(pool);
+            pool->scatteredSteps = 0;
+        }
+    } else {
+        pool->scatteredSteps = 0;
+    }
+    return true;
+}
+
+/* Executes the instruction word at pc in the lanes from chunk to chunk +
+   BATCH_WIDTH that are at pc and hold word there, and returns how many
+   that was. Register arithmetic, loads and beq use AVX2 when it is
+   available; stores, jalr and halt go lane by lane. */
+int executeBatchVector(batchPool *pool, int chunk, int pc, int word) {
+    int opcode = word >> 22 & BITMASK_FOR_PARSING_MACHINE_CODE;
+    int *regA = pool->reg[word >> 19 & BITMASK_FOR_PARSING_MACHINE_CODE] + chunk;
+    int *regB = pool->reg[word >> 16 & BITMASK_FOR_PARSING_MACHINE_CODE] + chunk;
+    int *dest = pool->reg[word & BITMASK_FOR_PARSING_MACHINE_CODE] + chunk;
+    int offset = convertNum(word & BITMASK_BITS_ZERO_TO_FIFTEEN);
+    int *pcs = pool->pc + chunk;
+    bool badRegister = opcode <= 1 && (word & BITMASK_BITS_ZERO_TO_FIFTEEN) >= NUMREGS;
+    int bits = 0; /* the lanes executing, bit i for lane chunk + i */
+    
+#ifdef __AVX2__
+    __m256i pcVector = _mm256_loadu_si256((const __m256i *) pcs);
+    __m256i mask = _mm256_cmpeq_epi32(pcVector, _mm256_set1_epi32(pc));
+    if (_mm256_testz_si256(mask, mask)) {
+        return 0;
+    }
+    __m256i bases = _mm256_loadu_si256((const __m256i *) (pool->base + chunk));
+    __m256i words = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), pool->memory,
+                                                _mm256_add_epi32(bases, _mm256_set1_epi32(pc)), mask, 4);
+    mask = _mm256_and_si256(mask, _mm256_cmpeq_epi32(words, _mm256_set1_epi32(word)));
+    bits = _mm256_movemask_ps(_mm256_castsi256_ps(mask));
+    if (badRegister) {
+        return retireLanes(pool, chunk, bits, "Invalid register");
+    }
+    __m256i a = _mm256_loadu_si256((const __m256i *) regA);
+    __m256i b = _mm256_loadu_si256((const __m256i *) regB);
+    __m256i next = _mm256_set1_epi32(pc + 1);
+    int invalid = 0; /* lw lanes whose address is out of bounds */
+    
+    if (opcode == 0 || opcode == 1) {
+        __m256i result = _mm256_add_epi32(a, b);
+        if (opcode == 1) {
+            result = _mm256_xor_si256(_mm256_or_si256(a, b), _mm256_set1_epi32(-1));
+        }
+        _mm256_storeu_si256((__m256i *) dest, _mm256_blendv_epi8(_mm256_loadu_si256((const __m256i *) dest),
+                                                                 result, mask));
+    } else if (opcode == 2) {
+        __m256i address = _mm256_add_epi32(a, _mm256_set1_epi32(offset));
+        __m256i valid = _mm256_and_si256(_mm256_cmpgt_epi32(address, _mm256_set1_epi32(-1)),
+                                         _mm256_cmpgt_epi32(_mm256_set1_epi32(pool->memorySize), address));
+        invalid = bits & ~_mm256_movemask_ps(_mm256_castsi256_ps(valid));
+        mask = _mm256_and_si256(mask, valid);
+        __m256i data = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), pool->memory,
+                                                   _mm256_add_epi32(bases, address), mask, 4);
+        _mm256_storeu_si256((__m256i *) regB, _mm256_blendv_epi8(b, data, mask));
+        bits &= ~invalid;
+    } else if (opcode == 4) {
+        __m256i taken = _mm256_cmpeq_epi32(a, b);
+        next = _mm256_add_epi32(next, _mm256_and_si256(taken, _mm256_set1_epi32(offset)));
+    }
+    if (opcode <= 2 || opcode == 4 || opcode == 7) {
+        _mm256_storeu_si256((__m256i *) pcs, _mm256_blendv_epi8(pcVector, next, mask));
+        __m256i recent = _mm256_loadu_si256((const __m256i *) (pool->recent + chunk));
+        _mm256_storeu_si256((__m256i *) (pool->recent + chunk), _mm256_sub_epi32(recent, mask));
+    }
+    /* only once the stores above can no longer overwrite the lanes this empties */
+    retireLanes(pool, chunk, invalid, "Memory address out of bounds");
+#else
+    for (int i = 0; i < BATCH_WIDTH; i++) {
+        if (pcs[i] == pc && pool->memory[pool->base[chunk + i] + pc] == word) {
+            bits |= 1 << i;
+        }
+    }
+    if (bits == 0) {
+        return 0;
+    }
+    if (badRegister) {
+        return retireLanes(pool, chunk, bits, "Invalid register");
+    }
+    if (opcode <= 2 || opcode == 4 || opcode == 7) {
+        for (int i = 0; i < BATCH_WIDTH; i++) {
+            if (!(bits & (1 << i))) {
+                continue;
+            }
+            int next = pc + 1;
+            if (opcode == 0) {
+                dest[i] = regA[i] + regB[i];
+            } else if (opcode == 1) {
+                dest[i] = ~(regA[i] | regB[i]);
+            } else if (opcode == 2) {
+                int address = regA[i] + offset;
+                if (address < 0 || address >= pool->memorySize) {
+                    retireLane(pool, chunk + i, "Memory address out of bounds");
+                    bits &= ~(1 << i);
+                    continue;
+                }
+                regB[i] = pool->memory[pool->base[chunk + i] + address];
+            } else if (opcode == 4 && regA[i] == regB[i]) {
+                next += offset;
+            }
+            pcs[i] = next;
+            pool->recent[chunk + i]++;
+        }
+    }
+#endif
+    
+    int executed = __builtin_popcount(bits);
+    if (opcode != 3 && opcode != 5 && opcode != 6 && !pool->limit) {
+        return executed;
+    }
+    for (int i = 0; i < BATCH_WIDTH; i++) {
+        if (!(bits & (1 << i))) {
+            continue;
+        }
+        int lane = chunk + i;
+        if (opcode == 3) {
+            int address = regA[i] + offset;
+            if (address < 0 || address >= pool->memorySize) {
+                retireLane(pool, lane, "Memory address out of bounds");
+                continue;
+            }
+            pool->memory[pool->base[lane] + address] = regB[i];
+            if (address >= pool->highWater[lane]) {
+                pool->highWater[lane] = address + 1;
+            }
+            pcs[i] = pc + 1;
+            pool->recent[lane]++;
+        } else if (opcode == 5) {
+            regB[i] = pc + 1;
+            pcs[i] = regA[i];
+            pool->recent[lane]++;
+        } else if (opcode == 6) {
+            pcs[i] = pc + 1;
+            pool->recent[lane]++;
+            retireLane(pool, lane, NULL);
+            continue;
+        }
+        if (pool->limit && pool->instructions[lane] + pool->recent[lane] > pool->limit) {
+            retireLane(pool, lane, "Instruction limit exceeded");
+        }
+    }
+    return executed;
+}
+
+/* empties the lanes in bits with an error, returning how many there were */
+int retireLanes(batchPool *pool, int chunk, int bits, const char *error) {
+    for (int i = 0; i < BATCH_WIDTH; i++) {
+        if (bits & (1 << i)) {
+            retireLane(pool, chunk + i, error);
+        }
+    }
+    return __builtin_popcount(bits);
+}
+
+/* sorts the lanes by pc, empty ones last, so that lanes that will run
+   together sit in as few vectors as possible */
+void regroupLanes(batchPool *pool) {
+    int lanes = pool->lanes;
+    long long *order = malloc(lanes * sizeof(long long));
+    for (int lane = 0; lane < lanes; lane++) {
+        order[lane] = (long long) pool->pc[lane] * ((long long) 1 << 32) + lane;
+    }
+    qsort(order, lanes, sizeof(long long), laneComparator);
+    
+    int *scratch = malloc(lanes * sizeof(long long));
+    int *fields[5 + NUMREGS] = { pool->pc, pool->base, pool->highWater, pool->instance, pool->recent };
+    for (int i = 0; i < NUMREGS; i++) {
+        fields[5 + i] = pool->reg[i];
+    }
+    for (int field = 0; field < 5 + NUMREGS; field++) {
+        for (int lane = 0; lane < lanes; lane++) {
+            scratch[lane] = fields[field][order[lane] & 0xFFFFFFFF];
+        }
+        memcpy(fields[field], scratch, lanes * sizeof(int));
+    }
+    long long *counts = (long long *) scratch;
+    for (int lane = 0; lane < lanes; lane++) {
+        counts[lane] = pool->instructions[order[lane] & 0xFFFFFFFF];
+    }
+    memcpy(pool->instructions, counts, lanes * sizeof(long long));
+    free(scratch);
+    free(order);
+}
+
+int laneComparator(const void *lane1, const void *lane2) {
+    long long a = *(const long long *) lane1;
+    long long b = *(const long long *) lane2;
+    return (a > b) - (a < b);
+}
+#endif
+
+#ifdef LC2K_LIBRARY
+/* Runs a linked image on a cold cache of the given shape without logging
+   cache actions, and returns the final registers, memory and counts. */
+int lc2kSimulate(const LC2KImage *image, int blockSizeInWords, int numberOfSets, int blocksPerSet,
+                 LC2KRun *run, char *error, size_t errorSize) {
+    stateType state = {0};
+    memset(run, 0, sizeof(LC2KRun));
+    lc2kMessage[0] = '\0';
+    if (setjmp(lc2kErrorJump)) {
+        lc2kCopyMessage(error, errorSize);
+        free(state.mem);
+        return 1;
+    }
+    if (!isValidCacheConfiguration(blockSizeInWords, numberOfSets, blocksPerSet)) {
+        exitProgram("Invalid cache configuration");
+    }
+    
+    state.memorySize = NUMMEMORY;
+    state.mem = calloc(state.memorySize, sizeof(int));
+    for (state.numMemory = 0; state.numMemory < image->size; state.numMemory++) {
+        reserveWord(&state);
+        state.mem[state.numMemory] = image->words[state.numMemory];
+    }
+    
+    initializeCache();
+    blockAccessTimestamp = 0;
+    cache->blockSize = blockSizeInWords;
+    cache->numSets = numberOfSets;
+    cache->blocksPerSet = blocksPerSet;
+    cacheHits = cacheMisses = 0;
+    profileExecutions = profileAccesses = profileMisses = NULL;
+    quiet = true;
+    run->instructions = runProgram(&state);
+    flushCache(&state);
+    
+    memcpy(run->reg, state.reg, sizeof(run->reg));
+    run->pc = state.pc;
+    run->cacheHits = cacheHits;
+    run->cacheMisses = cacheMisses;
+    run->memory = state.mem;
+    run->memorySize = state.memorySize;
+    return 0;
+}
+
+void lc2kFreeRun(LC2KRun *run) {
+    free(run->memory);
+    run->memory = NULL;
+    run->memorySize = 0;
+}
+#endif
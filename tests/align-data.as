@@ -0,0 +1,3 @@
+pad	.fill	7
+	.align	8	Block starts a new 8-word block
+Block	.fill	5
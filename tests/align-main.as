@@ -0,0 +1,4 @@
+	lw	0	1	ptr	r1 = address of Block
+	lw	1	2	0	r2 = Block, 5 if the address is right
+	halt
+ptr	.fill	Block
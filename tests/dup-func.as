@@ -0,0 +1 @@
+Func	halt	defines Func a second time
@@ -0,0 +1,9 @@
+	lw	0	4	fAddr	call Func in the other object
+	jalr	4	7
+Loop	add	1	1	1	reached only by returning from Func
+	lw	0	2	limit
+	beq	1	2	done
+	beq	0	0	Loop
+done	halt
+fAddr	.fill	Func
+limit	.fill	8
@@ -0,0 +1,5 @@
+Dead	lw	0	1	one	never called, removed by --gc-sections
+	halt
+Func	lw	0	1	one
+	jalr	7	6
+one	.fill	1
@@ -0,0 +1,94 @@
+// Drives the lc2k library for tests/run.sh: assembles every source named on
+// the command line, links them and runs the image on a 4 2 2 cache, then
+// prints the registers, or the error of the call that failed. Failing
+// calls are repeated to check that an error leaves the library usable.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../lc2k.h"
+
+char* readSource(const char* fileName, size_t* length);
+int runSources(int count, char** fileNames, int flags);
+
+int main(int argc, char* argv[]) {
+    int flags = 0;
+    int argIndex = 1;
+    if (argIndex < argc && !strcmp(argv[argIndex], "-p")) {
+        flags |= LC2K_POOL;
+        argIndex++;
+    }
+    if (argIndex < argc && !strcmp(argv[argIndex], "--gc-sections")) {
+        flags |= LC2K_GC_SECTIONS;
+        argIndex++;
+    }
+    if (argIndex == argc) {
+        printf("error: usage: %s [-p] [--gc-sections] <assembly-code-file> ...\n", argv[0]);
+        exit(1);
+    }
+    int failed = runSources(argc - argIndex, argv + argIndex, flags);
+    if (failed) {
+        int repeated = runSources(argc - argIndex, argv + argIndex, flags);
+        printf("repeat: %s failure\n", repeated == failed ? "same" : "different");
+    }
+    return(0);
+}
+
+char* readSource(const char* fileName, size_t* length) {
+    FILE* filePtr = fopen(fileName, "rb");
+    if (filePtr == NULL) {
+        printf("error in opening %s\n", fileName);
+        exit(1);
+    }
+    fseek(filePtr, 0, SEEK_END);
+    *length = ftell(filePtr);
+    rewind(filePtr);
+    char* source = malloc(*length + 1);
+    if (fread(source, 1, *length, filePtr) != *length) {
+        printf("error in reading %s\n", fileName);
+        exit(1);
+    }
+    fclose(filePtr);
+    return source;
+}
+
+// returns 0 once the registers are printed, otherwise 1 for a failed
+// assembly, 2 for a failed link and 3 for a failed simulation
+int runSources(int count, char** fileNames, int flags) {
+    char error[256];
+    LC2KObject* objects = calloc(count, sizeof(LC2KObject));
+    LC2KImage image = { NULL, 0 };
+    LC2KRun run;
+    int failed = 0;
+    for (int i = 0; i < count && !failed; ++i) {
+        size_t length;
+        char* source = readSource(fileNames[i], &length);
+        if (lc2kAssemble(source, length, flags & LC2K_POOL, &objects[i], error, sizeof(error))) {
+            printf("assemble error: %s\n", error);
+            failed = 1;
+        }
+        free(source);
+    }
+    if (!failed && lc2kLink(objects, count, flags, &image, error, sizeof(error))) {
+        printf("link error: %s\n", error);
+        failed = 2;
+    }
+    if (!failed && lc2kSimulate(&image, 4, 2, 2, &run, error, sizeof(error))) {
+        printf("simulate error: %s\n", error);
+        failed = 3;
+    }
+    if (!failed) {
+        printf("registers");
+        for (int i = 0; i < LC2K_NUMREGS; ++i) {
+            printf(" %d", run.reg[i]);
+        }
+        printf("\n");
+        lc2kFreeRun(&run);
+    }
+    lc2kFreeImage(&image);
+    for (int i = 0; i < count; ++i) {
+        lc2kFreeObject(&objects[i]);
+    }
+    free(objects);
+    return failed;
+}
@@ -0,0 +1,7 @@
+	lw	0	1	k	r1 = 1
+	lw	1	2	a	r2 = a[1], must stay 5 when -p pools constants
+	halt
+k	.fill	1
+a	.fill	5
+b	.fill	5
+c	.fill	9
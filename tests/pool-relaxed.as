@@ -0,0 +1,11 @@
+	lw	0	1	one	data sits past the reach of a lw offset
+	lw	0	2	two
+	lw	0	4	again	pooled with one under -p
+	add	1	2	3	r3 = 3
+	add	3	4	3	r3 = 4
+	halt
+	.align	32768	pad the text past MAX_OFFSET
+	noop
+one	.fill	1
+two	.fill	2
+again	.fill	1
@@ -0,0 +1,6 @@
+	lw	0	1	one
+	lw	0	2	uno
+	add	1	2	3	r3 = 2 whether or not -p shares the two words
+	halt
+one	.fill	1
+uno	.fill	1
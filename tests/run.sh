@@ -0,0 +1,371 @@
+#!/bin/sh
+# Regression tests: assemble, link and run small programs, then check a
+# register of the halted machine or a line of a tool's report.
+# Run from anywhere: sh tests/run.sh
+
+cd "$(dirname "$0")/.." || exit 1
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+
+cc=${CC:-gcc}
+$cc -O2 -o "$work/assembler" assembler.c || exit 1
+$cc -O2 -pthread -o "$work/linker" linker.c || exit 1
+$cc -O2 -pthread -o "$work/simulator" simulator.c -lm || exit 1
+echo > "$work/inputs"
+
+failures=0
+
+pass() {
+    echo "ok   $1"
+}
+
+fail() {
+    echo "FAIL $1: $2"
+    sed 's/^/    /' "$work/log" | tail -5
+    failures=$((failures + 1))
+}
+
+# build "<assembler flags>" "<linker flags>" <source>...: assembles each
+# tests/<source> and links the objects into $work/test.mc
+build() {
+    asflags=$1
+    ldflags=$2
+    shift 2
+    objects=
+    : > "$work/log"
+    for source; do
+        object="$work/${source%.as}.obj"
+        "$work/assembler" $asflags "tests/$source" "$object" >> "$work/log" 2>&1 || return 1
+        objects="$objects $object"
+    done
+    "$work/linker" $ldflags $objects "$work/test.mc" >> "$work/log" 2>&1
+}
+
+# register <n>: register n once $work/test.mc has halted
+register() {
+    "$work/simulator" -batch "$work/test.mc" "$work/inputs" |
+        sed -n 's/^instance 0: .*registers \([-0-9 ]*\).*/\1/p' | cut -d' ' -f$(($1 + 1))
+}
+
+# check <name> "<assembler flags>" "<linker flags>" <register> <expected> <source>...
+check() {
+    name=$1
+    reg=$4
+    expected=$5
+    if ! build "$2" "$3" $(shift 5; echo "$@"); then
+        fail "$name" "build failed"
+        return
+    fi
+    actual=$(register $reg)
+    if [ "$actual" = "$expected" ]; then
+        pass "$name: reg[$reg] = $expected"
+    else
+        fail "$name" "reg[$reg] = ${actual:-?}, expected $expected"
+    fi
+}
+
+# report <name> <pattern> <command>...: the command prints a line matching
+# the grep pattern, whether it succeeds or not
+report() {
+    name=$1
+    pattern=$2
+    shift 2
+    "$@" > "$work/log" 2>&1
+    if grep -q -- "$pattern" "$work/log"; then
+        pass "$name"
+    else
+        fail "$name" "no line matching '$pattern'"
+    fi
+}
+
+"$work/assembler" -C "$work/cache" tests/gc-func.as "$work/first.obj" > /dev/null
+report "object cache reuses an unchanged source" "object cache: 1 hits, 0 misses" \
+    "$work/assembler" -C "$work/cache" tests/gc-func.as "$work/cached.obj"
+if cmp -s "$work/first.obj" "$work/cached.obj"; then
+    pass "object cache returns the same object"
+else
+    fail "object cache returns the same object" "objects differ"
+fi
+report "object cache keys on the options" "object cache: 0 hits, 1 misses" \
+    "$work/assembler" -C "$work/cache" -b tests/gc-func.as "$work/cached.obj"
+
+check "binary objects" "-b" "" 1 8 gc-call.as gc-func.as
+"$work/assembler" tests/gc-func.as "$work/gc-func.obj" > "$work/log" 2>&1
+if "$work/linker" "$work/gc-call.obj" "$work/gc-func.obj" "$work/test.mc" >> "$work/log" 2>&1 &&
+    [ "$(register 1)" = 8 ]; then
+    pass "binary and text objects link together"
+else
+    fail "binary and text objects link together" "reg[1] = $(register 1), expected 8"
+fi
+head -c 24 "$work/gc-call.obj" > "$work/truncated.obj"
+report "truncated binary objects are rejected" "malformed binary object" \
+    "$work/linker" "$work/truncated.obj" "$work/test.mc"
+
+check "pooling keeps indexed arrays" "" "" 2 5 pool-indexed.as
+check "pooling keeps indexed arrays -p" "-p" "" 2 5 pool-indexed.as
+check "pooling shares equal constants -p" "-p" "" 3 2 pool-shared.as
+LC2K_OBJECT_CACHE="$work/cache" "$work/assembler" -p tests/pool-shared.as "$work/cached.obj" > /dev/null
+report "cache hit reports pooling" "constant pool: 1 words saved" \
+    env LC2K_OBJECT_CACHE="$work/cache" "$work/assembler" -p tests/pool-shared.as "$work/cached.obj"
+check "relaxation" "-r 5,6" "" 3 4 pool-relaxed.as
+check "relaxation -p" "-p -r 5,6" "" 3 4 pool-relaxed.as
+report "far data needs relaxation" "Offset out of range" \
+    "$work/assembler" tests/pool-relaxed.as "$work/far.obj"
+
+check "align keeps a global's data" "" "" 2 5 align-main.as align-data.as
+check "align rounds a global up to its block" "" "" 1 24 align-main.as align-data.as
+check "align survives binary objects" "-b" "" 1 24 align-main.as align-data.as
+
+check "gc-sections keeps a call's return site" "" "--gc-sections" 1 8 gc-call.as gc-func.as
+report "gc-sections removes unreachable code" "gc-func.obj: removed 2 text" \
+    "$work/linker" --gc-sections "$work/gc-call.obj" "$work/gc-func.obj" "$work/test.mc"
+
+# -i keeps a .state file beside the output and re-patches only what changed
+incremental() {
+    "$work/linker" -i "$work/gc-call.obj" "$work/gc-func.obj" "$work/test.mc"
+}
+build "" "-i" gc-call.as gc-func.as
+report "incremental link leaves unchanged objects alone" "0 of 2 objects re-patched" incremental
+sed 's/^\(limit.*\)8$/\116/' tests/gc-call.as > "$work/gc-call16.as"
+"$work/assembler" "$work/gc-call16.as" "$work/gc-call.obj" > /dev/null
+report "incremental link re-patches a changed object" "1 of 2 objects re-patched" incremental
+actual=$(register 1)
+if [ "$actual" = 16 ]; then
+    pass "incremental link output runs: reg[1] = 16"
+else
+    fail "incremental link output runs" "reg[1] = ${actual:-?}, expected 16"
+fi
+cat tests/gc-func.as > "$work/gc-func-grown.as"
+printf 'extra\t.fill\t0\n' >> "$work/gc-func-grown.as"
+"$work/assembler" "$work/gc-func-grown.as" "$work/gc-func.obj" > /dev/null
+report "incremental link falls back when sections grow" "section sizes changed, relinking everything" incremental
+
+# an archive member is linked only when it defines a global still needed
+build "" "" gc-call.as gc-func.as val.as dup-func.as
+report "archive indexes its members" "archive: 2 members, 3 symbols" \
+    "$work/linker" -a "$work/lib.a" "$work/gc-func.obj" "$work/val.obj"
+report "archive links only the members it needs" "1 of 2 members linked" \
+    "$work/linker" "$work/gc-call.obj" "$work/lib.a" "$work/test.mc"
+actual=$(register 1)
+if [ "$actual" = 8 ]; then
+    pass "archive output runs: reg[1] = 8"
+else
+    fail "archive output runs" "reg[1] = ${actual:-?}, expected 8"
+fi
+report "archive rejects duplicate members" "duplicate global label Func" \
+    "$work/linker" -a "$work/dup.a" "$work/gc-func.obj" "$work/dup-func.obj"
+
+# a relink with the simulator's profile must still compute the same result
+build "" "" gc-call.as gc-func.as
+cp "$work/test.mc" "$work/cold.mc"
+"$work/simulator" "$work/cold.mc" 4 2 2 -profile "$work/profile" > /dev/null
+report "profile-guided layout uses the profile" "profile layout: 1 of 3 text chains" \
+    "$work/linker" --profile="$work/profile" "$work/gc-call.obj" "$work/gc-func.obj" "$work/test.mc"
+actual=$(register 1)
+if [ "$actual" = 8 ]; then
+    pass "profile-guided output runs: reg[1] = 8"
+else
+    fail "profile-guided output runs" "reg[1] = ${actual:-?}, expected 8"
+fi
+report "profile-guided output runs the same instructions" "cold.mc: 16 instructions" \
+    "$work/simulator" "$work/test.mc" 4 2 2 -compare "$work/cold.mc"
+"$work/assembler" tests/stack.as "$work/stack.obj" > /dev/null
+report "profiles of another link are rejected" "was not taken from this link" \
+    "$work/linker" --profile="$work/profile" "$work/stack.obj" "$work/test.mc"
+
+build "" "--map=$work/test.map" gc-call.as gc-func.as
+report "link map places each object" "text 7-10 (4 words)" cat "$work/test.map"
+report "link map lists final symbol addresses" "Func *9 T .*gc-func.obj" cat "$work/test.map"
+report "link timing reports each phase" "timing: relocate" \
+    "$work/linker" --timing "$work/gc-call.obj" "$work/gc-func.obj" "$work/test.mc"
+report "link timing as json" '"relocate": [0-9.]*, ' \
+    "$work/linker" --timing=json "$work/gc-call.obj" "$work/gc-func.obj" "$work/test.mc"
+
+# the same programs through the library, with no files in between
+for tool in assembler linker simulator; do
+    $cc -O2 -pthread -DLC2K_LIBRARY -c $tool.c -o "$work/$tool.o" || exit 1
+done
+$cc -O2 -pthread -o "$work/library" tests/library.c \
+    "$work/assembler.o" "$work/linker.o" "$work/simulator.o" -lm || exit 1
+report "library runs a linked program" "registers 0 8 8 " \
+    "$work/library" tests/gc-call.as tests/gc-func.as
+report "library with pooling and gc-sections" "registers 0 8 8 " \
+    "$work/library" -p --gc-sections tests/gc-call.as tests/gc-func.as
+report "library reports link errors" "link error: error resolving global label Func" \
+    "$work/library" tests/gc-call.as
+report "library links again after a failed link" "repeat: same failure" \
+    "$work/library" tests/gc-call.as tests/gc-func.as tests/dup-func.as
+printf '\tfoo\t1\t2\t3\n' > "$work/bad.as"
+report "library reports assembler errors" "assemble error: Unsupported opcode" \
+    "$work/library" "$work/bad.as"
+
+# server mode: jobs on stdin, results tagged with each job's id
+build "" "" gc-call.as gc-func.as
+words=$(($(wc -l < "$work/test.mc")))
+{
+    echo "job first 4 2 2 $words"
+    cat "$work/test.mc"
+    echo "job limited 4 2 2 $words 5"
+    cat "$work/test.mc"
+    echo "job bad 3 2 2 $words"
+    cat "$work/test.mc"
+} > "$work/jobs"
+server() {
+    "$work/simulator" -server -workers 2 < "$work/jobs"
+}
+report "server runs a job" "result first ok .* registers 0 8 8 " server
+report "server applies a job's instruction limit" "result limited error .*Instruction limit exceeded" server
+report "server reports a job's bad cache" "result bad error .*Invalid cache configuration" server
+
+# cache and timing models, on a loop that reads one array and writes another
+check "sum program" "" "" 2 36 sum.as
+simulate() {
+    "$work/simulator" "$work/test.mc" 4 2 2 "$@"
+}
+report "cores each run the program" "total: 104 instructions" simulate -cores 2
+report "cores invalidate each other's copies" "core 0: .* [1-9][0-9]* invalidations" simulate -cores 2 -quantum 1
+
+# in a cache that holds the whole program only the 7 compulsory misses are
+# left to hide
+large() {
+    "$work/simulator" "$work/test.mc" 4 16 4 "$@"
+}
+report "nextline prefetch hides misses" "prefetch: 4 issued, 3 useful, 0 evicted unused" large -prefetch nextline
+report "stride prefetch hides misses" "prefetch: [0-9]* issued, [1-9][0-9]* useful" large -prefetch stride
+report "stream prefetch hides misses" "prefetch: [0-9]* issued, [1-9][0-9]* useful" large -prefetch stream -degree 2
+
+# the program touches 7 blocks, 2 of them only by its 8 stores
+report "write-back keeps stores in the cache" "write-back, write-allocate: 28 words read from memory, 0 words written" \
+    large -write back
+report "write-through writes every store" "write-through, write-allocate: 28 words read from memory, 8 words written" \
+    large -write through
+report "no-write-allocate leaves stored blocks out" "no-write-allocate: 20 words read from memory" \
+    large -write through -no-write-allocate
+report "write buffer takes every write-through store" "write buffer of 4: 8 writes" \
+    large -write through -write-buffer 4
+
+report "a cache holding the program only misses compulsorily" "7 cache misses: 7 compulsory, 0 capacity, 0 conflict" \
+    large -classify
+report "miss classification on a small cache" "24 cache misses: 7 compulsory, 2 capacity, 15 conflict" \
+    simulate -classify
+report "a large victim cache catches every non-compulsory miss" "victim cache of 8: 17 hits, 7 misses" \
+    simulate -victim 8
+
+# 70 memory accesses to a program of 27 words: 2 pages of 16 words, 4 of 8
+report "without a TLB every access walks the page table" "page walks: 70, 70 memory accesses" large -mmu 16
+report "a TLB misses once per page" "tlb level 1 (4 entries, 2-way, lru): 68 hits, 2 misses" \
+    large -mmu 16 -tlb 4,2
+report "a second-level TLB misses once per page" "tlb level 2 (4 entries, 4-way, lru): 34 hits, 4 misses" \
+    large -mmu 8 -tlb 1,1 -tlb 4,4
+report "a TLB needs the MMU" "error: usage:" large -tlb 4,2
+
+# the loop branch is taken 1 of 9 times, the back edge 8 of 8
+report "static taken prediction" "(taken): 17 executed, 9 taken, 8 mispredicted" simulate -predict taken
+report "static not-taken prediction" "(nottaken): 17 executed, 9 taken, 9 mispredicted" simulate -predict nottaken
+report "bimodal prediction learns each branch" "(bimodal, 1024 counters): 17 executed, 9 taken, 2 mispredicted" \
+    simulate -predict bimodal
+build "" "" gc-call.as gc-func.as
+report "a return stack predicts the return" "2 executed, 1 returns, 1 mispredicted" simulate -btb 4 -ras 2
+report "a cold BTB mispredicts the call and the return" "2 executed, 0 returns, 2 mispredicted" simulate -btb 4
+
+# 52 instructions plus 8 load-use bubbles, 3 cycles for each mispredicted
+# beq and 4 to fill the pipeline
+build "" "" sum.as
+report "pipeline without misses" "52 instructions, 91 cycles" large -pipeline -miss-penalty 0
+report "pipeline with bimodal prediction" "52 instructions, 70 cycles" large -pipeline -miss-penalty 0 -predict bimodal
+report "pipeline stalls on cache misses" "8 load-use, 27 beq mispredictions, 0 jalr mispredictions, 140 fetch misses" \
+    simulate -pipeline
+
+# the 7 block fills fall in 2 rows of 16 words, or 7 rows of 4
+report "open rows hit after their first access" "7 accesses, 5 row hits, 2 row misses, 0 row conflicts" \
+    large -dram 4,16
+report "closed rows miss every time" "7 accesses, 0 row hits, 7 row misses, 0 row conflicts" \
+    large -dram 4,16,closed
+report "one bank conflicts on every new row" "7 accesses, 0 row hits, 1 row misses, 6 row conflicts" \
+    large -dram 1,4
+report "dram timing changes the access time" "7 demand dram accesses for 104 cycles" \
+    large -dram 4,16 -dram-timing 10,10,10,4
+
+# 20 instances of the sum program on 8 lanes, instance k summing the first
+# k % 9 words of the array
+k=0
+while [ $k -lt 20 ]; do
+    echo "9=$((k % 9))"
+    k=$((k + 1))
+done > "$work/instances"
+batch() {
+    "$work/simulator" -batch "$work/test.mc" "$work/instances" "$@"
+}
+report "batch refills lanes as instances finish" "instance 17: 52 instructions, pc 9, registers 0 0 36 " batch -lanes 8
+report "batch counts every instance" "20 instances on 8 lanes: 518 instructions" batch -lanes 8
+report "batch limit stops a long instance" "instance 17: error: Instruction limit exceeded" \
+    batch -lanes 8 -limit 30
+report "batch lanes fill whole vectors" "error: usage:" batch -lanes 3
+
+check "Stack resolves past the image" "" "" 1 3 stack.as
+build "" "" gc-call.as gc-func.as dup-func.as
+report "duplicate globals are rejected" "duplicate global labels found" \
+    "$work/linker" "$work/gc-call.obj" "$work/gc-func.obj" "$work/dup-func.obj" "$work/test.mc"
+build "" "" gc-call.as gc-func.as stack-defined.as
+report "Stack cannot be defined" "reserved label Stack used" \
+    "$work/linker" "$work/gc-call.obj" "$work/gc-func.obj" "$work/stack-defined.obj" "$work/test.mc"
+
+# enough relocations to split into several parallel tasks; every lw and
+# .fill must end up pointing at Val, the word after them at 10001
+i=0
+while [ $i -lt 5000 ]; do
+    printf '\tlw\t0\t1\tVal\n'
+    i=$((i + 1))
+done > "$work/relocations.as"
+printf '\thalt\n' >> "$work/relocations.as"
+i=0
+while [ $i -lt 5000 ]; do
+    printf '\t.fill\tVal\n'
+    i=$((i + 1))
+done >> "$work/relocations.as"
+"$work/assembler" "$work/relocations.as" "$work/relocations.obj" > "$work/log" 2>&1
+"$work/assembler" tests/val.as "$work/val.obj" >> "$work/log" 2>&1
+"$work/linker" "$work/relocations.obj" "$work/val.obj" "$work/test.mc" >> "$work/log" 2>&1
+lw=$(grep -c '^8464145$' "$work/test.mc")
+fill=$(grep -c '^10001$' "$work/test.mc")
+if [ "$lw" = 5000 ] && [ "$fill" = 5000 ]; then
+    pass "parallel relocation patches every word"
+else
+    fail "parallel relocation patches every word" "$lw lw and $fill .fill words patched, expected 5000 each"
+fi
+
+# objects are read in parallel, but the first bad one on the command line
+# is the one reported
+: > "$work/empty.obj"
+printf '1 0 0 0\nx\n' > "$work/bad.obj"
+report "first unreadable object is reported" "bad.obj:2: malformed text word" \
+    "$work/linker" "$work/val.obj" "$work/bad.obj" "$work/empty.obj" "$work/test.mc"
+report "empty objects are rejected" "empty.obj:1: malformed header" \
+    "$work/linker" "$work/val.obj" "$work/empty.obj" "$work/bad.obj" "$work/test.mc"
+report "missing objects are reported" "missing.obj: cannot open object file" \
+    "$work/linker" "$work/val.obj" "$work/missing.obj" "$work/test.mc"
+
+printf '1000000000 0 0 0\n' > "$work/huge.obj"
+report "text header counts are bounded by the file size" "header counts exceed the file size" \
+    "$work/linker" "$work/huge.obj" "$work/test.mc"
+
+# more objects and words than the linker's old fixed tables held
+fillers=
+for k in 1 2 3 4 5 6; do
+    i=0
+    while [ $i -lt 60 ]; do
+        printf '\t.fill\t%d\n' $i
+        i=$((i + 1))
+    done > "$work/filler$k.as"
+    "$work/assembler" "$work/filler$k.as" "$work/filler$k.obj" > /dev/null
+    fillers="$fillers $work/filler$k.obj"
+done
+if build "" "" gc-call.as gc-func.as &&
+    "$work/linker" "$work/gc-call.obj" "$work/gc-func.obj" $fillers "$work/test.mc" >> "$work/log" 2>&1 &&
+    [ "$(register 1)" = 8 ]; then
+    pass "eight objects and over 300 words link"
+else
+    fail "eight objects and over 300 words link" "reg[1] = $(register 1), expected 8"
+fi
+
+[ $failures -eq 0 ]
@@ -0,0 +1 @@
+Stack	.fill	0	Stack is reserved for the linker
@@ -0,0 +1,3 @@
+	lw	0	1	sp	r1 = Stack, the first word after the image
+	halt
+sp	.fill	Stack
@@ -0,0 +1,27 @@
+	lw	0	1	n	r1 = words left
+	lw	0	4	neg1
+loop	beq	1	0	done
+	add	1	4	1
+	lw	1	3	array
+	add	2	3	2	r2 = sum of the array
+	sw	1	2	sums
+	beq	0	0	loop
+done	halt
+n	.fill	8
+neg1	.fill	-1
+array	.fill	1
+	.fill	2
+	.fill	3
+	.fill	4
+	.fill	5
+	.fill	6
+	.fill	7
+	.fill	8
+sums	.fill	0
+	.fill	0
+	.fill	0
+	.fill	0
+	.fill	0
+	.fill	0
+	.fill	0
+	.fill	0
@@ -0,0 +1 @@
+Val	.fill	7